@@ -1,99 +1,641 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
+#include <sys/mman.h>
 #include "allocator.h"
 #include "util.h"
 
-buddy_allocator_t* new_buddy_allocator(void) {
+#define BITS_PER_WORD (8 * sizeof(unsigned long))
+
+static int _coalesce_all_deferred(buddy_allocator_t *allocator);
+
+// new_buddy_allocator creates an allocator managing total_pages pages with
+// blocks of up to 2^max_order pages. total_pages need not be a power of two:
+// the arena is seeded with as many max_order blocks as fit, and the tail is
+// covered by the largest aligned blocks that still fit.
+buddy_allocator_t* new_buddy_allocator(int total_pages, int max_order) {
     buddy_allocator_t* buddy_allocator = (buddy_allocator_t*)malloc(sizeof(buddy_allocator_t));
+    buddy_allocator->total_pages = total_pages;
+    buddy_allocator->max_order = max_order;
 
-    buddy_allocator->active_list = new_lru_cache(MAX_LRU_ENTRIES);
-    buddy_allocator->inactive_list = new_lru_cache(MAX_LRU_ENTRIES);
+    buddy_allocator->lru_node_pool = new_object_pool(sizeof(lru_node_t), 2 * MAX_LRU_ENTRIES);
+    buddy_allocator->evicted_block_pool = new_object_pool(sizeof(block_descriptor_t), 256);
+    buddy_allocator->seq_map = new_seq_map(2 * MAX_LRU_ENTRIES);
+    buddy_allocator->policy_ops = &lru_policy_ops;
+    buddy_allocator->lru_entries = MAX_LRU_ENTRIES;
+    buddy_allocator->policy = lru_policy_ops.create(buddy_allocator, 2 * MAX_LRU_ENTRIES);
     
+    buddy_allocator->pages = (block_descriptor_t*)calloc(total_pages, sizeof(block_descriptor_t));
 
-    for(int i = 0; i <= 9; i++) {
-        buddy_allocator->free_list[i] = (free_list_t*)malloc(sizeof(free_list_t));
-        buddy_allocator->free_list[i]->size = 0;
-        buddy_allocator->free_list[i]->head = NULL;
+    buddy_allocator->free_list = (free_list_t**)malloc((max_order + 1) * sizeof(free_list_t*));
+    for(int i = 0; i <= max_order; i++) {
+        buddy_allocator->free_list[i] = new_free_list(i, total_pages);
     }
+    buddy_allocator->deferred = (free_list_t**)malloc((DEFERRED_MAX_ORDER + 1) * sizeof(free_list_t*));
+    for (int i = 0; i <= DEFERRED_MAX_ORDER; i++)
+        buddy_allocator->deferred[i] = new_free_list(i, total_pages);
+    buddy_allocator->deferred_high = 0;
+    buddy_allocator->extfrag_threshold = EXTFRAG_THRESHOLD;
+    buddy_allocator->cma_start = 0;
+    buddy_allocator->cma_end = 0;
+    buddy_allocator->cma_order = -1;
+    buddy_allocator->cma_min_order = 0;
+    buddy_allocator->cma_free_list = NULL;
+
+    // add the initial blocks to free list
+    _seed_free_lists(buddy_allocator, buddy_allocator->free_list, max_order, 0, total_pages);
+
+    buddy_allocator->concurrency = SINGLE_THREADED;
+    buddy_allocator->pcp_caches = NULL;
+    buddy_allocator->lf_free_list = NULL;
+    buddy_allocator->slab_caches = NULL;
+    memset(&buddy_allocator->stats, 0, sizeof(allocator_stats_t));
+    buddy_allocator->stats.splits = (unsigned long long*)calloc(max_order + 1, sizeof(unsigned long long));
+    buddy_allocator->stats.merges = (unsigned long long*)calloc(max_order + 1, sizeof(unsigned long long));
 
-    // add the block of 512 to free list
-    block_descriptor_t *init_block = new_block_descriptor(9, 0);
-    buddy_allocator->free_list[9]->head = init_block;
-    buddy_allocator->free_list[9]->size++;
+    buddy_allocator->nr_free_pages = total_pages;
+    // Linux's defaults scaled down: min is 1/32 of memory, low and high
+    // are each a quarter of min further up
+    int min = total_pages / 32 > 0 ? total_pages / 32 : 1;
+    int gap = min / 4 > 0 ? min / 4 : 1;
+    set_watermarks(buddy_allocator, min, min + gap, min + 2 * gap);
+    buddy_allocator->kswapd_running = 0;
+    buddy_allocator->memory = NULL;
+    buddy_allocator->swap = NULL;
+    buddy_allocator->zswap = NULL;
+    buddy_allocator->partial_eviction = 0;
+    buddy_allocator->idle_hand = 0;
+    set_readahead(buddy_allocator, 0);
+    return buddy_allocator;
+}
+
+// new_concurrent_buddy_allocator creates an allocator whose allocate_pages,
+// access_pages and free_pages may be called from several threads at once.
+// Blocks up to PCP_MAX_ORDER come from per-thread caches, so only cache
+// refills/drains and larger orders take the allocator lock. The seq_map and
+// replacement policy stay behind lru_lock though, which every allocate_pages,
+// access_page and free_pages takes once, so throughput stops scaling with
+// threads once that bookkeeping dominates.
+buddy_allocator_t* new_concurrent_buddy_allocator(int total_pages, int max_order) {
+    buddy_allocator_t* buddy_allocator = new_buddy_allocator(total_pages, max_order);
+    buddy_allocator->concurrency = CONCURRENT_PCP;
+    pthread_mutex_init(&buddy_allocator->lock, NULL);
+    pthread_mutex_init(&buddy_allocator->lru_lock, NULL);
+    pthread_mutex_init(&buddy_allocator->pcp_list_lock, NULL);
+    pthread_mutex_init(&buddy_allocator->slab_lock, NULL);
+    return buddy_allocator;
+}
 
+// new_lock_free_buddy_allocator is the alternative to per-thread caches: the
+// free lists become lock-free stacks, so taking and releasing blocks never
+// waits on a mutex, though the seq_map and policy bookkeeping around it
+// still does. The per-order free_list structures are left empty and unused;
+// lf_free_pages reports free space instead.
+buddy_allocator_t* new_lock_free_buddy_allocator(int total_pages, int max_order) {
+    buddy_allocator_t* buddy_allocator = new_buddy_allocator(total_pages, max_order);
+    buddy_allocator->concurrency = CONCURRENT_LOCK_FREE;
+    pthread_mutex_init(&buddy_allocator->lru_lock, NULL);
+    pthread_mutex_init(&buddy_allocator->slab_lock, NULL);
+    init_lf_free_lists(buddy_allocator);
     return buddy_allocator;
 }
 
+// destroy_buddy_allocator closes the allocator's swap and frees it with
+// everything it tracks. kswapd must be stopped and its slab caches
+// destroyed, and no other thread may use it anymore.
+void destroy_buddy_allocator(buddy_allocator_t *allocator) {
+    close_swap(allocator);
+
+    size_t cursor = 0;
+    seq_entry_t *entry;
+    while ((entry = seq_map_next(allocator->seq_map, &cursor)) != NULL)
+        if (entry->sparse != NULL)
+            _destroy_sparse_block(entry->sparse);
+    allocator->policy_ops->destroy(allocator->policy);
+    destroy_seq_map(allocator->seq_map);
+    destroy_object_pool(allocator->lru_node_pool);
+    destroy_object_pool(allocator->evicted_block_pool);
+
+    for (int i = 0; i <= allocator->max_order; i++)
+        destroy_free_list(allocator->free_list[i]);
+    free(allocator->free_list);
+    for (int i = 0; i <= DEFERRED_MAX_ORDER; i++)
+        destroy_free_list(allocator->deferred[i]);
+    free(allocator->deferred);
+    for (int i = 0; i <= allocator->cma_order; i++)
+        destroy_free_list(allocator->cma_free_list[i]);
+    free(allocator->cma_free_list);
+    if (allocator->lf_free_list != NULL)
+        _destroy_lf_free_lists(allocator);
+    _destroy_pcp_caches(allocator);
+    free_allocator_stats(&allocator->stats);
+    free(allocator->pages);
+
+    if (allocator->concurrency == CONCURRENT_PCP) {
+        pthread_mutex_destroy(&allocator->lock);
+        pthread_mutex_destroy(&allocator->pcp_list_lock);
+    }
+    if (allocator->concurrency != SINGLE_THREADED) {
+        pthread_mutex_destroy(&allocator->lru_lock);
+        pthread_mutex_destroy(&allocator->slab_lock);
+    }
+    free(allocator);
+}
+
+// _seed_free_lists covers the free pages from start to end with the largest
+// aligned blocks of up to max_order that fit, pushed onto lists.
+void _seed_free_lists(buddy_allocator_t *allocator, free_list_t **lists, int max_order, int start, int end) {
+    int address = start;
+    while (address < end) {
+        int order = max_order;
+        while ((address & ((1 << order) - 1)) != 0 || address + (1 << order) > end)
+            order--;
+
+        block_descriptor_t *init_block = init_block_descriptor(&allocator->pages[address], order, address);
+        push_back(lists[order], init_block);
+        address += 1 << order;
+    }
+}
+
+static const replacement_policy_ops_t *replacement_policies[NR_POLICIES] = {
+    [POLICY_LRU] = &lru_policy_ops,
+    [POLICY_LRU_WORKINGSET] = &lru_workingset_policy_ops,
+    [POLICY_CLOCK] = &clock_policy_ops,
+    [POLICY_CLOCK_PRO] = &clock_pro_policy_ops,
+    [POLICY_ARC] = &arc_policy_ops,
+};
+
+// set_replacement_policy switches an allocator that tracks no blocks yet, as
+// right after creation, to another replacement policy. Every policy keeps up
+// to 2 * lru_entries blocks in memory. Returns -1 if blocks are tracked.
+int set_replacement_policy(buddy_allocator_t *allocator, replacement_policy_t policy) {
+    if (seq_map_count(allocator->seq_map) != 0)
+        return -1;
+    allocator->policy_ops->destroy(allocator->policy);
+    allocator->policy_ops = replacement_policies[policy];
+    allocator->policy = allocator->policy_ops->create(allocator, 2 * allocator->lru_entries);
+    return 0;
+}
+
+// set_lru_entries resizes the replacement policy of an allocator that tracks
+// no blocks yet to keep up to 2 * nr_entries blocks in memory, as two lru
+// lists of nr_entries would, instead of 2 * MAX_LRU_ENTRIES. Returns -1 if
+// blocks are tracked.
+int set_lru_entries(buddy_allocator_t *allocator, int nr_entries) {
+    if (seq_map_count(allocator->seq_map) != 0 || nr_entries <= 0)
+        return -1;
+    allocator->lru_entries = nr_entries;
+    allocator->policy_ops->destroy(allocator->policy);
+    allocator->policy = allocator->policy_ops->create(allocator, 2 * nr_entries);
+    return 0;
+}
+
+// find_replacement_policy returns the policy called name, or -1.
+int find_replacement_policy(const char *name) {
+    for (int i = 0; i < NR_POLICIES; i++)
+        if (strcmp(replacement_policies[i]->name, name) == 0)
+            return i;
+    return -1;
+}
+
+const char *replacement_policy_name(replacement_policy_t policy) {
+    return replacement_policies[policy]->name;
+}
+
+// _drain_policy applies the hits the replacement policy has buffered, if any.
+// Called with lru_lock held.
+void _drain_policy(buddy_allocator_t *allocator) {
+    if (allocator->policy_ops->drain != NULL)
+        allocator->policy_ops->drain(allocator->policy);
+}
+
+void dump_replacement_policy(buddy_allocator_t *allocator) {
+    allocator->policy_ops->dump(allocator->policy);
+}
+
+// set_watermarks sets the free page levels that drive background reclaim,
+// see start_kswapd. They have no effect while kswapd is not running.
+void set_watermarks(buddy_allocator_t *allocator, int min, int low, int high) {
+    allocator->watermark[WMARK_MIN] = min;
+    allocator->watermark[WMARK_LOW] = low;
+    allocator->watermark[WMARK_HIGH] = high;
+}
+
+static void _mod_free_pages(buddy_allocator_t *allocator, long delta) {
+    if (allocator->concurrency == SINGLE_THREADED)
+        allocator->nr_free_pages += delta;
+    else
+        __atomic_fetch_add(&allocator->nr_free_pages, delta, __ATOMIC_RELAXED);
+}
+
+long free_page_count(buddy_allocator_t *allocator) {
+    return __atomic_load_n(&allocator->nr_free_pages, __ATOMIC_RELAXED);
+}
+
+void _lock_lru(buddy_allocator_t *allocator) {
+    if (allocator->concurrency != SINGLE_THREADED)
+        pthread_mutex_lock(&allocator->lru_lock);
+}
+
+void _unlock_lru(buddy_allocator_t *allocator) {
+    if (allocator->concurrency != SINGLE_THREADED)
+        pthread_mutex_unlock(&allocator->lru_lock);
+}
+
+// enable_swap gives an allocator that holds no blocks yet real memory,
+// total_pages * PAGE_SIZE bytes mapped at creation, and a swap file at
+// swap_path written back by nr_io_threads threads. Evicting a block then
+// writes its pages to swap and a page fault reads them back. Returns -1 if
+// blocks are held or the memory or the swap file can't be set up.
+int enable_swap(buddy_allocator_t *allocator, const char *swap_path, int nr_io_threads) {
+    if (seq_map_count(allocator->seq_map) != 0 || allocator->swap != NULL)
+        return -1;
+
+    size_t bytes = (size_t)allocator->total_pages * PAGE_SIZE;
+    void *memory = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+        return -1;
+    allocator->swap = open_swap_device(swap_path, PAGE_SIZE, allocator->total_pages, nr_io_threads);
+    if (allocator->swap == NULL) {
+        munmap(memory, bytes);
+        return -1;
+    }
+    allocator->memory = (char*)memory;
+    return 0;
+}
+
+// close_swap releases the memory, the zswap pool and the swap file, along
+// with the contents of the evicted blocks kept in them. The allocator must
+// not be used afterwards.
+void close_swap(buddy_allocator_t *allocator) {
+    if (allocator->swap == NULL)
+        return;
+    _lock_lru(allocator);
+    size_t cursor = 0;
+    seq_entry_t *entry;
+    while ((entry = seq_map_next(allocator->seq_map, &cursor)) != NULL) {
+        _drop_evicted(allocator, entry, -1);
+        for (int i = 0; entry->sparse != NULL && i < 1 << entry->sparse->order; i++)
+            _drop_evicted(allocator, entry, i);
+    }
+    close_zswap(allocator);
+    close_swap_device(allocator->swap);
+    munmap(allocator->memory, (size_t)allocator->total_pages * PAGE_SIZE);
+    allocator->swap = NULL;
+    allocator->memory = NULL;
+    _unlock_lru(allocator);
+}
+
+// block_address returns the memory of a block, NULL without enable_swap.
+void *block_address(buddy_allocator_t *allocator, block_descriptor_t *block) {
+    if (allocator->memory == NULL)
+        return NULL;
+    return allocator->memory + (size_t)block->first_page_address * PAGE_SIZE;
+}
+
+// seq_address returns the memory of seq_no's block, NULL if it is not in
+// memory, has been split by partial eviction or there is no backing memory.
+// It is valid until the block is evicted, moved by compaction or freed.
+void *seq_address(buddy_allocator_t *allocator, long long seq_no) {
+    _lock_lru(allocator);
+    seq_entry_t *entry = seq_map_find(allocator->seq_map, seq_no);
+    void *address = entry != NULL && entry->allocated_block != NULL && entry->sparse == NULL ? block_address(allocator, entry->allocated_block)
+                                                                   : NULL;
+    _unlock_lru(allocator);
+    return address;
+}
+
+// seq_page_address returns the memory of page of seq_no's block, also once
+// partial eviction has split it, NULL if that page is not in memory or there
+// is no backing memory. Valid as long as seq_address would be.
+void *seq_page_address(buddy_allocator_t *allocator, long long seq_no, int page) {
+    _lock_lru(allocator);
+    seq_entry_t *entry = seq_map_find(allocator->seq_map, seq_no);
+    char *address = NULL;
+    if (entry != NULL && entry->sparse != NULL) {
+        if (page >= 0 && page < 1 << entry->sparse->order && entry->sparse->pages[page] != NULL)
+            address = (char*)block_address(allocator, entry->sparse->pages[page]);
+    } else if (entry != NULL && entry->allocated_block != NULL && page >= 0 && page < 1 << entry->allocated_block->order) {
+        address = (char*)block_address(allocator, entry->allocated_block);
+        if (address != NULL)
+            address += (size_t)page * PAGE_SIZE;
+    }
+    _unlock_lru(allocator);
+    return address;
+}
+
+// _save_evicted keeps the nr_pages pages at pages of entry's evicted block,
+// or of page of its sparse block (page -1 for the whole block): in zswap if
+// it takes them, else in the swap file. Called with lru_lock held.
+void _save_evicted(buddy_allocator_t *allocator, seq_entry_t *entry, int page, void *pages, int nr_pages) {
+    swap_extent_t **swap = page < 0 ? &entry->swap : &entry->sparse->swap[page];
+    zswap_entry_t **zswap = page < 0 ? &entry->zswap : &entry->sparse->zswap[page];
+    if (allocator->zswap != NULL && (*zswap = zswap_store(allocator, entry->seq_no, page, pages, nr_pages)) != NULL)
+        return;
+
+    *swap = swap_out(allocator->swap, pages, nr_pages);
+    if (*swap == NULL)
+        fprintf(stderr, "Swap file full, contents of seq_no %lld lost\n", entry->seq_no);
+    count_events(allocator, swap_outs, nr_pages);
+}
+
+// _load_evicted copies what _save_evicted kept back to pages and lets go of it
+void _load_evicted(buddy_allocator_t *allocator, seq_entry_t *entry, int page, void *pages) {
+    swap_extent_t **swap = page < 0 ? &entry->swap : &entry->sparse->swap[page];
+    zswap_entry_t **zswap = page < 0 ? &entry->zswap : &entry->sparse->zswap[page];
+    if (*zswap != NULL) {
+        if (zswap_load(allocator, *zswap, pages) != 0)
+            fprintf(stderr, "Zswap data corrupt, contents of seq_no %lld lost\n", entry->seq_no);
+        *zswap = NULL;
+        count_event(allocator, zswap_hits);
+    } else if (*swap != NULL) {
+        if (allocator->zswap != NULL)
+            count_event(allocator, zswap_misses);
+        if (swap_in(allocator->swap, *swap, pages) == 1)
+            count_event(allocator, swap_cache_hits);
+        count_events(allocator, swap_ins, (*swap)->nr_pages);
+        swap_release(allocator->swap, *swap);
+        *swap = NULL;
+    }
+}
+
+// _drop_evicted lets go of what _save_evicted kept, its seq_no is being freed
+void _drop_evicted(buddy_allocator_t *allocator, seq_entry_t *entry, int page) {
+    swap_extent_t **swap = page < 0 ? &entry->swap : &entry->sparse->swap[page];
+    zswap_entry_t **zswap = page < 0 ? &entry->zswap : &entry->sparse->zswap[page];
+    if (*zswap != NULL)
+        zswap_invalidate(allocator, *zswap);
+    if (*swap != NULL)
+        swap_release(allocator->swap, *swap);
+    *zswap = NULL;
+    *swap = NULL;
+}
+
+// _balance_free_pages runs before taking a block of order while kswapd is
+// running. Falling below the low watermark wakes kswapd; only an allocation
+// that would leave less than the min watermark reclaims in the caller.
+void _balance_free_pages(buddy_allocator_t *allocator, int order, int lru_locked) {
+    if (!allocator->kswapd_running)
+        return;
+
+    long after = free_page_count(allocator) - (1L << order);
+    if (after < allocator->watermark[WMARK_LOW])
+        wakeup_kswapd(allocator);
+
+    while (after < allocator->watermark[WMARK_MIN]) {
+        if (!lru_locked)
+            _lock_lru(allocator);
+        int reclaimed = reclaim(allocator);
+        if (!lru_locked)
+            _unlock_lru(allocator);
+        if (reclaimed != 0)
+            return;
+        count_event(allocator, direct_reclaims);
+        // evictions land in this thread's cache, still counted as free
+        after = free_page_count(allocator) - (1L << order);
+    }
+}
+
+// _clear_page_flags starts tracking the pages of a block from scratch
+void _clear_page_flags(buddy_allocator_t *allocator, block_descriptor_t *block) {
+    for (int i = 0; i < 1 << block->order; i++)
+        allocator->pages[block->first_page_address + i].flags = 0;
+}
+
 // allocate_pages allocates a block of contiguous pages for a process seq_no
 // Three cases:
 // 1) If there is a free block of the exact size, just allocate.
 // 2) If there is not a free block of the exact size, but free block of bigger size,
 //    split the bigger block and allocate.
-// 3) If there is no suitable free block, try evict blocks from inactive list until
-//    there is block matching the 2 cases above.
-// After each allocation, the block will be moved into the inactive list.
-void allocate_pages(buddy_allocator_t *allocator, int seq_no, int page_size) {
-    // check if already allocated
-    if (allocated_seq_no_hash_table[seq_no] != NULL || evicted_seq_no_hash_table[seq_no] != NULL) {
-        printf("Sorry, already allocated \n");
+// 3) If there is no suitable free block, try evict blocks chosen by the replacement
+//    policy until there is block matching the 2 cases above.
+// After each allocation, the block is handed to the replacement policy.
+void allocate_pages(buddy_allocator_t *allocator, long long seq_no, int page_size) {
+    // check if already allocated, the concurrent modes only check once the
+    // block is taken to spare an acquisition of lru_lock
+    if (allocator->concurrency == SINGLE_THREADED && seq_map_find(allocator->seq_map, seq_no) != NULL) {
+        alloc_log("Sorry, already allocated \n");
         return;
     }
 
-    block_descriptor_t *allocated_block = _allocate_block(allocator, get_order(page_size));
+    int req_order = get_order(page_size);
+    if (req_order > allocator->max_order) {
+        alloc_log("Sorry, request of %d pages exceeds max order %d \n", page_size, allocator->max_order);
+        return;
+    }
+
+    // the block is taken without holding lru_lock, small orders usually come
+    // straight from this thread's cache
+    _balance_free_pages(allocator, req_order, 0);
+    block_descriptor_t *allocated_block = _get_block(allocator, req_order);
 
     while (allocated_block == NULL) {
+        _lock_lru(allocator);
+        // moving blocks is tried first, it keeps them all in memory, out of
+        // the reserved region first, which costs no more than the request
+        int compacted = cma_evacuate(allocator, req_order) == 0 || try_compaction(allocator, req_order) == 0;
+        int reclaimed = compacted ? 0 : reclaim(allocator);
+        _unlock_lru(allocator);
         // if nothing to reclaim
-        if (reclaim(allocator) != 0) {
-            printf("Sorry, failed to allocate memory \n");
+        if (reclaimed != 0) {
+            count_event(allocator, failed_allocations);
+            alloc_log("Sorry, failed to allocate memory \n");
             return;
         }
-        allocated_block = _allocate_block(allocator, get_order(page_size));
+        if (!compacted)
+            count_event(allocator, direct_reclaims);
+        allocated_block = _get_block(allocator, req_order);
     }
 
-    allocated_seq_no_hash_table[seq_no] = allocated_block;
+    _lock_lru(allocator);
+    if (allocator->concurrency != SINGLE_THREADED && seq_map_find(allocator->seq_map, seq_no) != NULL) {
+        _unlock_lru(allocator);
+        _put_block(allocator, allocated_block);
+        alloc_log("Sorry, already allocated \n");
+        return;
+    }
+
+    seq_entry_t *entry = seq_map_insert(allocator->seq_map, seq_no);
+    entry->allocated_block = allocated_block;
     allocated_block->seq_no = seq_no;
+    if (allocator->partial_eviction)
+        _clear_page_flags(allocator, allocated_block);
     
-    lru_node_t *evicted_node = lru_insert(allocator->inactive_list, allocated_block);
-    if (evicted_node != NULL) {
-        _free_block(allocator, evicted_node->block);
-        allocated_seq_no_hash_table[evicted_node->block->seq_no] = NULL;
-        evicted_seq_no_hash_table[evicted_node->block->seq_no] = evicted_node->block;
+    block_descriptor_t *victim = allocator->policy_ops->admit(allocator->policy, entry, 0);
+    if (victim != NULL)
+        _evict_block(allocator, victim);
+    _unlock_lru(allocator);
+}
+
+static block_descriptor_t *_get_free_block(buddy_allocator_t *allocator, int req_order) {
+    if (allocator->concurrency == SINGLE_THREADED)
+        return _allocate_block(allocator, req_order);
+    if (allocator->concurrency == CONCURRENT_LOCK_FREE)
+        return lf_alloc_block(allocator, req_order);
+
+    block_descriptor_t *block = NULL;
+    if (req_order <= PCP_MAX_ORDER) {
+        block = pcp_alloc_block(get_pcp_cache(allocator), req_order);
+    } else {
+        pthread_mutex_lock(&allocator->lock);
+        block = _allocate_block(allocator, req_order);
+        pthread_mutex_unlock(&allocator->lock);
     }
+    if (block != NULL)
+        return block;
+
+    // free pages may be sitting in other threads' caches
+    drain_all_pcp(allocator);
+    pthread_mutex_lock(&allocator->lock);
+    block = _allocate_block(allocator, req_order);
+    pthread_mutex_unlock(&allocator->lock);
+    return block;
 }
 
-block_descriptor_t *_allocate_block(buddy_allocator_t *allocator, int req_order) {
+// _get_block takes a free block of req_order, from the calling thread's cache
+// or the lock-free lists in the concurrent modes. Returns NULL if no free
+// block is large enough.
+block_descriptor_t *_get_block(buddy_allocator_t *allocator, int req_order) {
+    block_descriptor_t *block = _get_free_block(allocator, req_order);
+    if (block != NULL)
+        _mod_free_pages(allocator, -(1L << req_order));
+    return block;
+}
+
+// _get_unmovable_block takes a free block of req_order for pages that can
+// neither be moved nor evicted, like slabs. It never comes from the reserved
+// region, which must stay free for cma_evacuate to empty, and bypasses the
+// thread's cache, which may hold blocks borrowing it. Returns NULL if no
+// free block is large enough.
+block_descriptor_t *_get_unmovable_block(buddy_allocator_t *allocator, int req_order) {
+    block_descriptor_t *block;
+    if (allocator->concurrency == CONCURRENT_LOCK_FREE) {
+        block = lf_alloc_block(allocator, req_order);
+    } else if (allocator->concurrency == SINGLE_THREADED) {
+        block = _allocate_unreserved_block(allocator, req_order);
+    } else {
+        pthread_mutex_lock(&allocator->lock);
+        block = _allocate_unreserved_block(allocator, req_order);
+        pthread_mutex_unlock(&allocator->lock);
+        if (block == NULL) {
+            // free pages may be sitting in threads' caches
+            drain_all_pcp(allocator);
+            pthread_mutex_lock(&allocator->lock);
+            block = _allocate_unreserved_block(allocator, req_order);
+            pthread_mutex_unlock(&allocator->lock);
+        }
+    }
+    if (block != NULL)
+        _mod_free_pages(allocator, -(1L << req_order));
+    return block;
+}
+
+// _get_blocks takes up to nr_blocks free blocks of req_order at once, all
+// under one hold of the allocator lock in CONCURRENT_PCP mode, bypassing
+// the thread's cache. Returns the blocks taken.
+int _get_blocks(buddy_allocator_t *allocator, int req_order, int nr_blocks, block_descriptor_t **blocks) {
+    int nr_taken = 0;
+    if (allocator->concurrency == CONCURRENT_LOCK_FREE) {
+        while (nr_taken < nr_blocks && (blocks[nr_taken] = lf_alloc_block(allocator, req_order)) != NULL)
+            nr_taken++;
+    } else if (allocator->concurrency == SINGLE_THREADED) {
+        nr_taken = _allocate_blocks(allocator, req_order, nr_blocks, blocks);
+    } else {
+        pthread_mutex_lock(&allocator->lock);
+        nr_taken = _allocate_blocks(allocator, req_order, nr_blocks, blocks);
+        pthread_mutex_unlock(&allocator->lock);
+        if (nr_taken < nr_blocks) {
+            // free pages may be sitting in threads' caches
+            drain_all_pcp(allocator);
+            pthread_mutex_lock(&allocator->lock);
+            nr_taken += _allocate_blocks(allocator, req_order, nr_blocks - nr_taken, blocks + nr_taken);
+            pthread_mutex_unlock(&allocator->lock);
+        }
+    }
+    _mod_free_pages(allocator, -((long)nr_taken << req_order));
+    return nr_taken;
+}
+
+// _put_block releases a block taken with _get_block.
+void _put_block(buddy_allocator_t *allocator, block_descriptor_t *block) {
+    _mod_free_pages(allocator, 1L << block->order);
+    if (allocator->concurrency == SINGLE_THREADED) {
+        _free_block(allocator, block);
+    } else if (allocator->concurrency == CONCURRENT_LOCK_FREE) {
+        lf_free_block(allocator, block);
+    } else if (block->order <= PCP_MAX_ORDER && !in_cma_region(allocator, block->first_page_address)) {
+        // the reserved region's blocks skip the cache, for cma_evacuate to find them free
+        pcp_free_block(get_pcp_cache(allocator), block);
+    } else {
+        pthread_mutex_lock(&allocator->lock);
+        _free_block(allocator, block);
+        pthread_mutex_unlock(&allocator->lock);
+    }
+}
+
+// _put_blocks releases nr_blocks blocks taken with _get_block(s), those that
+// don't go to the thread's cache under one hold of the allocator lock. The
+// order of blocks is not kept.
+void _put_blocks(buddy_allocator_t *allocator, block_descriptor_t **blocks, int nr_blocks) {
+    if (allocator->concurrency != CONCURRENT_PCP) {
+        for (int i = 0; i < nr_blocks; i++)
+            _put_block(allocator, blocks[i]);
+        return;
+    }
+
+    // a block released to the cache may be taken again by now, only the
+    // others are left in blocks
+    int nr_locked = 0;
+    for (int i = 0; i < nr_blocks; i++) {
+        if (blocks[i]->order <= PCP_MAX_ORDER)
+            _put_block(allocator, blocks[i]);
+        else
+            blocks[nr_locked++] = blocks[i];
+    }
+    if (nr_locked == 0)
+        return;
+    pthread_mutex_lock(&allocator->lock);
+    for (int i = 0; i < nr_locked; i++) {
+        _mod_free_pages(allocator, 1L << blocks[i]->order);
+        _free_block(allocator, blocks[i]);
+    }
+    pthread_mutex_unlock(&allocator->lock);
+}
+
+// _take_free_block takes a block of req_order off lists, the free lists of
+// memory or of the reserved region, whose blocks go up to max_order.
+block_descriptor_t *_take_free_block(buddy_allocator_t *allocator, free_list_t **lists, int max_order, int req_order) {
     // Case 1
-    if (allocator->free_list[req_order]->size > 0)
+    if (lists[req_order]->size > 0)
 	{
 		// Remove block from free list
-        block_descriptor_t* allocated_block = remove_head(allocator->free_list[req_order]); 
-        printf("Memory from %d, order %d allocated \n", allocated_block->first_page_address,allocated_block->order);
+        block_descriptor_t* allocated_block = remove_head(lists[req_order]); 
+        alloc_log("Memory from %d, order %d allocated \n", allocated_block->first_page_address,allocated_block->order);
                
         return allocated_block;
 	}
 	
-    for(int i = req_order + 1; i < 10; i++)
+    for(int i = req_order + 1; i <= max_order; i++)
     {
         // Case 2
-        if(allocator->free_list[i]->size != 0) {
-            block_descriptor_t* splitted_block = remove_head(allocator->free_list[i]);
+        if(lists[i]->size != 0) {
+            block_descriptor_t* splitted_block = remove_head(lists[i]);
             i--;
             // Iterative split
             for(; i >= req_order; i--)
             {
-                // Divide block into two halves
-                block_descriptor_t *block_1 = new_block_descriptor(i, splitted_block->first_page_address);
-                block_descriptor_t *block_2 = new_block_descriptor(i, splitted_block->first_page_address+(0x1<<i));
-                
-                push_back(allocator->free_list[i], block_1);
-                push_back(allocator->free_list[i], block_2);
-                                
-                // Remove first free block to further split
-                splitted_block = remove_head(allocator->free_list[i]);
+                count_event(allocator, splits[i + 1]);
+                // Divide block into two halves, keep the first half to further split
+                // and free the second half, described by its own first page
+                int buddy_address = splitted_block->first_page_address+(0x1<<i);
+                block_descriptor_t *buddy = init_block_descriptor(&allocator->pages[buddy_address], i, buddy_address);
+
+                splitted_block->order = i;
+                push_back(lists[i], buddy);
             }
 
-        printf("Memory from %d, order %d allocated\n", splitted_block->first_page_address,splitted_block->order);
+        alloc_log("Memory from %d, order %d allocated\n", splitted_block->first_page_address,splitted_block->order);
         
         return splitted_block;
         }
@@ -102,106 +644,322 @@ block_descriptor_t *_allocate_block(buddy_allocator_t *allocator, int req_order)
     return NULL;
 }
 
+// _take_cma_block takes a block of req_order from the reserved region, for a
+// request that may have one, see _allocate_block.
+static block_descriptor_t *_take_cma_block(buddy_allocator_t *allocator, int req_order) {
+    block_descriptor_t *block = _take_free_block(allocator, allocator->cma_free_list, allocator->cma_order, req_order);
+    if (block != NULL && req_order >= allocator->cma_min_order)
+        count_event(allocator, cma_allocations);
+    else if (block != NULL)
+        count_event(allocator, cma_borrows);
+    return block;
+}
+
+// _allocate_block takes a block of req_order off the free lists, splitting a
+// larger one if needed. With a reserved region, requests of cma_min_order
+// and above take from it first, and smaller ones only borrow it once the
+// rest of memory has no block for them.
+block_descriptor_t *_allocate_block(buddy_allocator_t *allocator, int req_order) {
+    block_descriptor_t *block = NULL;
+    int reserved = allocator->cma_free_list != NULL && req_order <= allocator->cma_order;
+    if (reserved && req_order >= allocator->cma_min_order && (block = _take_cma_block(allocator, req_order)) != NULL)
+        return block;
 
-// access_pages access a page at a specific position from the block 
+    block = _allocate_unreserved_block(allocator, req_order);
+    if (block == NULL && reserved && req_order < allocator->cma_min_order)
+        block = _take_cma_block(allocator, req_order);
+    return block;
+}
+
+// _allocate_unreserved_block takes a block of req_order from outside the
+// reserved region. With deferred coalescing, a deferred block of the exact
+// order is reused first, and the deferred blocks are only merged when
+// nothing else fits.
+block_descriptor_t *_allocate_unreserved_block(buddy_allocator_t *allocator, int req_order) {
+    if (allocator->deferred_high > 0 && req_order <= DEFERRED_MAX_ORDER) {
+        free_list_t *deferred = allocator->deferred[req_order];
+        if (deferred->size > 0) {
+            // the most recently freed block, its buddy is the likeliest to be in use
+            block_descriptor_t *block = deferred->tail;
+            remove_node(deferred, block);
+            count_event(allocator, deferred_reuses);
+            return block;
+        }
+    }
+
+    block_descriptor_t *block = _take_free_block(allocator, allocator->free_list, allocator->max_order, req_order);
+    if (block == NULL && allocator->deferred_high > 0 && _coalesce_all_deferred(allocator) > 0)
+        block = _take_free_block(allocator, allocator->free_list, allocator->max_order, req_order);
+    return block;
+}
+
+// _carve_block takes nr_blocks blocks of req_order from the start of a free
+// block of a larger order taken off its list, in one pass instead of a split
+// chain per block. What is left is freed as the largest aligned blocks that
+// fit, whose buddies all hold blocks taken. Returns the blocks taken.
+static int _carve_block(buddy_allocator_t *allocator, block_descriptor_t *block, int req_order,
+                        int nr_blocks, block_descriptor_t **blocks) {
+    int order = block->order, start = block->first_page_address;
+    if (nr_blocks > 1 << (order - req_order))
+        nr_blocks = 1 << (order - req_order);
+    // an order i + 1 block is split for every 2^(i + 1 - req_order) blocks taken, rounded up
+    for (int i = req_order; i < order; i++)
+        count_events(allocator, splits[i + 1], ((nr_blocks - 1) >> (i + 1 - req_order)) + 1);
+
+    for (int i = 0; i < nr_blocks; i++) {
+        int address = start + (i << req_order);
+        blocks[i] = init_block_descriptor(&allocator->pages[address], req_order, address);
+        alloc_log("Memory from %d, order %d allocated\n", address, req_order);
+    }
+    int address = start + (nr_blocks << req_order), end = start + (1 << order);
+    while (address < end) {
+        int i = req_order;
+        while (address + (2 << i) <= end && (address & ((2 << i) - 1)) == 0)
+            i++;
+        push_back(allocator->free_list[i], init_block_descriptor(&allocator->pages[address], i, address));
+        address += 1 << i;
+    }
+    return nr_blocks;
+}
+
+// _allocate_blocks takes up to nr_blocks blocks of req_order off the free
+// lists, as _allocate_block would one by one, but splitting each larger
+// block only once for as many as it holds. Returns the blocks taken.
+int _allocate_blocks(buddy_allocator_t *allocator, int req_order, int nr_blocks, block_descriptor_t **blocks) {
+    int nr_taken = 0;
+    int reserved = allocator->cma_free_list != NULL && req_order <= allocator->cma_order;
+    if (reserved && req_order >= allocator->cma_min_order)
+        while (nr_taken < nr_blocks && (blocks[nr_taken] = _take_cma_block(allocator, req_order)) != NULL)
+            nr_taken++;
+
+    int coalesced = allocator->deferred_high == 0;
+    while (nr_taken < nr_blocks) {
+        if ((req_order <= DEFERRED_MAX_ORDER && allocator->deferred_high > 0 && allocator->deferred[req_order]->size > 0) ||
+            allocator->free_list[req_order]->size > 0) {
+            blocks[nr_taken++] = _allocate_block(allocator, req_order);
+            continue;
+        }
+
+        int order = req_order + 1;
+        while (order <= allocator->max_order && allocator->free_list[order]->size == 0)
+            order++;
+        if (order <= allocator->max_order) {
+            block_descriptor_t *block = remove_head(allocator->free_list[order]);
+            nr_taken += _carve_block(allocator, block, req_order, nr_blocks - nr_taken, blocks + nr_taken);
+        } else if (!coalesced) {
+            coalesced = 1;
+            if (_coalesce_all_deferred(allocator) == 0)
+                break;
+        } else {
+            break;
+        }
+    }
+
+    if (reserved && req_order < allocator->cma_min_order)
+        while (nr_taken < nr_blocks && (blocks[nr_taken] = _take_cma_block(allocator, req_order)) != NULL)
+            nr_taken++;
+    return nr_taken;
+}
+
+
+// _fault_block takes a block of order to bring an evicted block or page back
+// into, compacting or reclaiming until there is one. Called with lru_lock
+// held. Returns NULL if nothing is left to reclaim.
+block_descriptor_t *_fault_block(buddy_allocator_t *allocator, int order) {
+    _balance_free_pages(allocator, order, 1);
+    block_descriptor_t *block = _get_block(allocator, order);
+
+    while (block == NULL) {
+        if (cma_evacuate(allocator, order) == 0 || try_compaction(allocator, order) == 0) {
+            block = _get_block(allocator, order);
+            continue;
+        }
+        // if nothing to reclaim
+        if (reclaim(allocator) != 0) {
+            count_event(allocator, failed_allocations);
+            alloc_log("Sorry, failed to swap in memory \n");
+            return NULL;
+        }
+        count_event(allocator, direct_reclaims);
+        block = _get_block(allocator, order);
+    }
+    return block;
+}
+
+// access_page access a page at a specific position from the block
 // allocated for seq_no
-// Two cases:
-// 1) If the allocated block is in physical memory, move the block to active list. If already
-//    in the active list, do nothing.
+// Three cases:
+// 1) If the allocated block is in physical memory, report the hit to the replacement policy.
 // 2) If the allocated block is not in physical memory, bring the whole block back from the
-//    evicted map. Move the block to active list.
-void access_pages(buddy_allocator_t *allocator, int seq_no) {
+//    evicted map and hand it to the replacement policy again.
+// 3) If the block has been split by partial eviction, only the page itself is looked at,
+//    and brought back if it was evicted.
+// The page only matters with partial eviction, which keeps track of the pages accessed.
+void _access_page(buddy_allocator_t *allocator, long long seq_no, int page) {
 
-    if(allocated_seq_no_hash_table[seq_no] == NULL && evicted_seq_no_hash_table[seq_no] == NULL) {
-        printf("Not found, seq_no %d has been freed.\n", seq_no);
+    // entry stays valid below, reclaim and the replacement policy only look entries up
+    seq_entry_t *entry = seq_map_find(allocator->seq_map, seq_no);
+    if(entry == NULL) {
+        alloc_log("Not found, seq_no %lld has been freed.\n", seq_no);
         return;
     }
 
-    if (allocated_seq_no_hash_table[seq_no] != NULL) {
-        lru_node_t  *promoted_node = lru_remove(allocator->inactive_list, seq_no);  
-        if (promoted_node != NULL) {
-            lru_node_t *downgraded_node = lru_insert(allocator->active_list, promoted_node->block);
-            if (downgraded_node != NULL){
-                lru_insert(allocator->inactive_list, downgraded_node->block);
-            }
+    if (allocator->partial_eviction) {
+        int order = entry->sparse != NULL ? entry->sparse->order
+                    : entry->allocated_block != NULL ? entry->allocated_block->order : entry->evicted_block->order;
+        if (page < 0 || page >= 1 << order) {
+            alloc_log("Sorry, page %d is outside the block of seq_no %lld \n", page, seq_no);
+            return;
         }
+    }
+
+    count_event(allocator, accesses);
+    if (entry->sparse != NULL) {
+        _access_sparse(allocator, entry, page);
+        return;
+    }
+    if (entry->allocated_block != NULL) {
+        allocator->policy_ops->access(allocator->policy, entry);
+        if (allocator->partial_eviction)
+            allocator->pages[entry->allocated_block->first_page_address + page].flags |= PG_REFERENCED;
+        if (entry->readahead)
+            _readahead_hit(allocator, entry);
         return;
     }
 
     // Page Fault!
-    if (evicted_seq_no_hash_table[seq_no] != NULL) {
-        int req_order = evicted_seq_no_hash_table[seq_no]->order;
-        block_descriptor_t *swapped_in_block = _allocate_block(allocator, req_order);
-
-        while (swapped_in_block == NULL) {
-            // if nothing to reclaim
-            if (reclaim(allocator) != 0) {
-                printf("Sorry, failed to swap in memory \n");
-                return;
-            }
-            swapped_in_block = _allocate_block(allocator, req_order);
-        }
+    if (entry->evicted_block != NULL) {
+        count_event(allocator, page_faults);
+        int req_order = entry->evicted_block->order;
+        block_descriptor_t *swapped_in_block = _fault_block(allocator, req_order);
+        if (swapped_in_block == NULL)
+            return;
 
-        allocated_seq_no_hash_table[seq_no] = swapped_in_block;
+        entry->allocated_block = swapped_in_block;
         swapped_in_block->seq_no = seq_no;
-        evicted_seq_no_hash_table[seq_no] = NULL;
-
-        if (allocator->active_list->hash_table[seq_no] == NULL) {
-            lru_node_t *downgraded_node = lru_insert(allocator->active_list, swapped_in_block);
-            if (downgraded_node != NULL) {
-                lru_node_t *evicted_node = lru_insert(allocator->inactive_list, downgraded_node->block);
-                if (evicted_node != NULL) {
-                    _free_block(allocator, evicted_node->block);
-                    allocated_seq_no_hash_table[evicted_node->block->seq_no] = NULL;
-                    evicted_node->block->seq_no = -1;
-                    evicted_seq_no_hash_table[evicted_node->block->seq_no] = evicted_node->block;
-                }
-            }
+        if (allocator->swap != NULL)
+            _load_evicted(allocator, entry, -1, block_address(allocator, swapped_in_block));
+        if (allocator->partial_eviction) {
+            _clear_page_flags(allocator, swapped_in_block);
+            allocator->pages[swapped_in_block->first_page_address + page].flags |= PG_REFERENCED;
         }
-        
+        block_descriptor_t *evicted_block = entry->evicted_block;
+        entry->evicted_block = NULL;
+
+        // a ghost node of the policy may still point at the evicted record
+        block_descriptor_t *victim = allocator->policy_ops->admit(allocator->policy, entry, 1);
+        pool_free(allocator->evicted_block_pool, evicted_block);
+        if (victim != NULL)
+            _evict_block(allocator, victim);
+        if (allocator->readahead_max > 0)
+            _readahead(allocator, entry);
     }
 
     return;
 }
 
+void access_page(buddy_allocator_t *allocator, long long seq_no, int page) {
+    _lock_lru(allocator);
+    _access_page(allocator, seq_no, page);
+    _unlock_lru(allocator);
+}
+
+// access_pages accesses the block of seq_no as a whole, which for partial
+// eviction is its first page.
+void access_pages(buddy_allocator_t *allocator, long long seq_no) {
+    access_page(allocator, seq_no, 0);
+}
+
 // free_pages explicitly free a block allocarted for seq_no.
 // Two cases:
-// 1) If the block is still in physcial memory, release the block, remove the block from any list and map.
-// 2) If the block is not in physical memory, remove the block from any list and map.
-void free_pages(buddy_allocator_t *allocator, int seq_no) {
+// 1) If the block is still in physcial memory, release the block, remove the block from the policy and map.
+// 2) If the block is not in physical memory, remove the block from the policy and map.
+void free_pages(buddy_allocator_t *allocator, long long seq_no) {
 
-    if(allocated_seq_no_hash_table[seq_no] == NULL && evicted_seq_no_hash_table[seq_no] == NULL){
-        printf("Not found, seq_no %d has not been allocated.\n", seq_no);
-        return;
+    _lock_lru(allocator);
+    block_descriptor_t *block_to_free = _forget_seq(allocator, seq_no);
+    _unlock_lru(allocator);
+
+    if (block_to_free != NULL)
+        _put_block(allocator, block_to_free);
+    
+    return;
+}
+
+// _forget_seq drops seq_no from the map and the replacement policy, and
+// whatever holds its contents if evicted. Called with lru_lock held.
+// Returns its block in memory, for the caller to release, or NULL.
+block_descriptor_t *_forget_seq(buddy_allocator_t *allocator, long long seq_no) {
+    seq_entry_t *entry = seq_map_find(allocator->seq_map, seq_no);
+    if(entry == NULL){
+        alloc_log("Not found, seq_no %lld has not been allocated.\n", seq_no);
+        return NULL;
     }
 
-    if(allocated_seq_no_hash_table[seq_no] == NULL && evicted_seq_no_hash_table[seq_no] != NULL)
+    allocator->policy_ops->forget(allocator->policy, entry);
+    if (entry->readahead)
+        _readahead_unused(allocator, entry);
+    if (entry->sparse != NULL)
+        _free_sparse(allocator, entry);
+    if(entry->allocated_block == NULL)
     {
-       evicted_seq_no_hash_table[seq_no] = NULL;
-       return;
+       _drop_evicted(allocator, entry, -1);
+       if (entry->evicted_block != NULL)
+           pool_free(allocator->evicted_block_pool, entry->evicted_block);
+       seq_map_remove(allocator->seq_map, seq_no);
+       return NULL;
     }
 
-    _free_block(allocator, allocated_seq_no_hash_table[seq_no]);
-    allocated_seq_no_hash_table[seq_no]->seq_no = -1;
-    allocated_seq_no_hash_table[seq_no] = NULL;
-
-    lru_remove(allocator->active_list, seq_no);
-    lru_remove(allocator->inactive_list, seq_no);
-    
-    return;
+    block_descriptor_t *block_to_free = entry->allocated_block;
+    seq_map_remove(allocator->seq_map, seq_no);
+    // compaction reads seq_no under lru_lock
+    block_to_free->seq_no = -1;
+    return block_to_free;
 }
 
 
-void _free_block(buddy_allocator_t *allocator, block_descriptor_t *block_to_free) {
+// _evict_block releases the pages of an allocated block and remembers its order
+// in the evicted map, so a later access can swap it back in.
+void _evict_block(buddy_allocator_t *allocator, block_descriptor_t *block_to_evict) {
+    long long seq_no = block_to_evict->seq_no;
+    count_event(allocator, reclaims);
+    seq_entry_t *entry = seq_map_find(allocator->seq_map, seq_no);
+    // a split block goes as a whole too, all the pages it has left
+    int order = entry->sparse != NULL ? entry->sparse->order : block_to_evict->order;
+    block_descriptor_t *evicted_block = (block_descriptor_t*)pool_alloc(allocator->evicted_block_pool);
+    init_block_descriptor(evicted_block, order, block_to_evict->first_page_address);
+    evicted_block->seq_no = seq_no;
+
+    entry->allocated_block = NULL;
+    entry->evicted_block = evicted_block;
+    if (entry->readahead)
+        _readahead_unused(allocator, entry);
+    if (entry->sparse != NULL)
+        _evict_sparse(allocator, entry);
+    else if (allocator->swap != NULL)
+        _save_evicted(allocator, entry, -1, block_address(allocator, block_to_evict), 1 << order);
+    if (allocator->policy_ops->evicted != NULL)
+        allocator->policy_ops->evicted(allocator->policy, entry);
+
+    if (entry->sparse == NULL) {
+        block_to_evict->seq_no = -1;
+        _put_block(allocator, block_to_evict);
+    }
+}
+
+static void _merge_free_block(buddy_allocator_t *allocator, block_descriptor_t *block_to_free) {
     // Size of block to be searched
     int order = block_to_free->order;
+    // the reserved region's blocks merge within it only
+    int in_region = in_cma_region(allocator, block_to_free->first_page_address);
+    int max_order = in_region ? allocator->cma_order : allocator->max_order;
  
     // Add the block in free list
-    push_back(allocator->free_list[order], block_to_free);
-	printf("Memory from %d, order %d freed\n", block_to_free->first_page_address, block_to_free->order);
+    push_back(in_region ? allocator->cma_free_list[order] : allocator->free_list[order], block_to_free);
+	alloc_log("Memory from %d, order %d freed\n", block_to_free->first_page_address, block_to_free->order);
 
     block_descriptor_t *free_block = block_to_free;
-   	for(int i = order; i < 9; i++)
+   	for(int i = order; i < max_order; i++)
 	{
         block_descriptor_t *merged_block = _find_buddy_and_merge(allocator, i, free_block);
         if (merged_block == NULL) break;
@@ -212,67 +970,168 @@ void _free_block(buddy_allocator_t *allocator, block_descriptor_t *block_to_free
     return;
 }
 
+// _coalesce_deferred merges up to nr_blocks deferred blocks of order back into
+// the free lists, oldest first.
+static int _coalesce_deferred(buddy_allocator_t *allocator, int order, int nr_blocks) {
+    free_list_t *deferred = allocator->deferred[order];
+    int nr_coalesced = 0;
+    for (; nr_coalesced < nr_blocks && deferred->size > 0; nr_coalesced++) {
+        block_descriptor_t *block = remove_head(deferred);
+        count_event(allocator, deferred_coalesces);
+        _merge_free_block(allocator, block);
+    }
+    return nr_coalesced;
+}
+
+static int _coalesce_all_deferred(buddy_allocator_t *allocator) {
+    int nr_coalesced = 0;
+    for (int i = 0; i <= DEFERRED_MAX_ORDER; i++)
+        nr_coalesced += _coalesce_deferred(allocator, i, allocator->deferred[i]->size);
+    return nr_coalesced;
+}
+
+// _free_block returns a block to the free lists, merging it with its free
+// buddies. With deferred coalescing, blocks up to DEFERRED_MAX_ORDER are
+// parked unmerged instead, for the next allocation of their order, and merged
+// in a batch once their list grows past deferred_high. Blocks of the reserved
+// region are always merged at once.
+void _free_block(buddy_allocator_t *allocator, block_descriptor_t *block_to_free) {
+    int order = block_to_free->order;
+    if (allocator->deferred_high == 0 || order > DEFERRED_MAX_ORDER ||
+        in_cma_region(allocator, block_to_free->first_page_address)) {
+        _merge_free_block(allocator, block_to_free);
+        return;
+    }
+
+    free_list_t *deferred = allocator->deferred[order];
+    push_back(deferred, block_to_free);
+    count_event(allocator, deferred_frees);
+    if (deferred->size > allocator->deferred_high)
+        _coalesce_deferred(allocator, order, deferred->size - allocator->deferred_high / 2);
+}
+
+// set_deferred_coalescing turns lazy coalescing on, with high as the number of
+// unmerged blocks kept per order, or off with high 0, merging any still
+// deferred. Split/merge ping-pong under churn of small blocks is avoided at the
+// cost of free pages that larger orders only see once the batch is coalesced.
+// Returns -1 for a lock-free allocator, whose free lists are not used.
+int set_deferred_coalescing(buddy_allocator_t *allocator, int high) {
+    if (allocator->concurrency == CONCURRENT_LOCK_FREE || high < 0)
+        return -1;
+
+    if (allocator->concurrency == CONCURRENT_PCP)
+        pthread_mutex_lock(&allocator->lock);
+    allocator->deferred_high = high;
+    if (high == 0)
+        _coalesce_all_deferred(allocator);
+    if (allocator->concurrency == CONCURRENT_PCP)
+        pthread_mutex_unlock(&allocator->lock);
+    return 0;
+}
+
+// coalesce_deferred merges every deferred block into the free lists now.
+// Returns the number of blocks merged.
+int coalesce_deferred(buddy_allocator_t *allocator) {
+    if (allocator->concurrency == CONCURRENT_LOCK_FREE)
+        return 0;
+
+    if (allocator->concurrency == CONCURRENT_PCP)
+        pthread_mutex_lock(&allocator->lock);
+    int nr_coalesced = _coalesce_all_deferred(allocator);
+    if (allocator->concurrency == CONCURRENT_PCP)
+        pthread_mutex_unlock(&allocator->lock);
+    return nr_coalesced;
+}
+
 // find_buddy_and_merge do what the name sugguest :)
 block_descriptor_t *_find_buddy_and_merge(buddy_allocator_t *allocator, int order, block_descriptor_t *free_block) {
     // Calculate buddy address, complement k-th bit
     int mask = 1 << free_block->order;
     int buddy_address = free_block->first_page_address ^ mask;
     int is_left_buddy = free_block->first_page_address & mask;
-    
-    // Search in free list to find it's buddy
-    block_descriptor_t *cur = allocator->free_list[order]->head;
-
-    while(cur != NULL)
-    {
-        // If buddy found and is also free, merge the buddies to make them one larger free memory block
-        if (cur->first_page_address == buddy_address)
-        {
-            
-
-            block_descriptor_t *merged_block;
-            
-            if (is_left_buddy)
-                merged_block = new_block_descriptor(free_block->order+1, buddy_address);
-            else
-                merged_block = new_block_descriptor(free_block->order+1, free_block->first_page_address);
-            // Add larger block to higher order free lsit
-            
-            push_back(allocator->free_list[order+1], merged_block);
-            remove_node(allocator->free_list[order], cur);
-            remove_node(allocator->free_list[order], free_block);
-
-            return merged_block;
-        }
 
-        cur = cur->next;
+    // The tail of a non power-of-two arena has blocks without a buddy
+    if (buddy_address + mask > allocator->total_pages)
+        return NULL;
+    // nor does the reserved region, whose blocks are on lists of their own
+    free_list_t **lists = allocator->free_list;
+    if (in_cma_region(allocator, free_block->first_page_address)) {
+        if (order >= allocator->cma_order)
+            return NULL;
+        lists = allocator->cma_free_list;
     }
 
-    return NULL;
+    // Check the order bitmap to see if it's buddy is also free
+    block_descriptor_t *buddy = find_free_block(lists[order], buddy_address);
+    if (buddy == NULL)
+        return NULL;
+
+    // Merge the buddies to make them one larger free memory block,
+    // described by the descriptor of its first page
+    block_descriptor_t *merged_block = is_left_buddy ? buddy : free_block;
+
+    count_event(allocator, merges[order]);
+    remove_node(lists[order], buddy);
+    remove_node(lists[order], free_block);
+    merged_block->order = order + 1;
+    // Add larger block to higher order free lsit
+    push_back(lists[order+1], merged_block);
+
+    return merged_block;
 }
 
 
 int reclaim(buddy_allocator_t *allocator) {
-    lru_node_t *evicted_node = lru_evict(allocator->inactive_list);
-    if (evicted_node == NULL) // lru empty
+    // idle pages of partly used blocks go first
+    if (reclaim_idle_pages(allocator) == 0)
+        return 0;
+
+    block_descriptor_t *victim = allocator->policy_ops->reclaim(allocator->policy);
+    if (victim == NULL) // nothing the policy can evict
         return -1;
     
-    _free_block(allocator, evicted_node->block);
-    allocated_seq_no_hash_table[evicted_node->block->seq_no] = NULL;
-    evicted_seq_no_hash_table[evicted_node->block->seq_no] = evicted_node->block;
+    _evict_block(allocator, victim);
     return 0;
 }
 
 
 
-// free list (a single linked list) manipulation util
+// free list (a doubly linked list) manipulation util
+free_list_t *new_free_list(int order, int total_pages) {
+    int nr_blocks = total_pages >> order;
+    int nr_words = (nr_blocks + BITS_PER_WORD - 1) / BITS_PER_WORD;
+
+    free_list_t *list = (free_list_t*)malloc(sizeof(free_list_t));
+    list->size = 0;
+    list->order = order;
+    list->head = NULL;
+    list->tail = NULL;
+    list->bitmap = (unsigned long*)calloc(nr_words, sizeof(unsigned long));
+    list->blocks = (block_descriptor_t**)calloc(nr_blocks, sizeof(block_descriptor_t*));
+    return list;
+}
+
+void destroy_free_list(free_list_t *list) {
+    free(list->bitmap);
+    free(list->blocks);
+    free(list);
+}
+
+// find_free_block returns the free block starting at address, or NULL
+// if no block of this list's order starts there.
+block_descriptor_t *find_free_block(free_list_t *list, int address) {
+    int index = address >> list->order;
+    if (!(list->bitmap[index / BITS_PER_WORD] & (1UL << (index % BITS_PER_WORD))))
+        return NULL;
+    return list->blocks[index];
+}
+
 block_descriptor_t *remove_head(free_list_t *list) {
     if (list->size == 0) {
         return NULL;
     }
     block_descriptor_t *removed_node = list->head;
-    list->head = list->head->next;
-    removed_node->next = NULL;
-    list->size--;
+    remove_node(list, removed_node);
     return removed_node;
 }
 
@@ -281,41 +1140,39 @@ void remove_node(free_list_t *list, block_descriptor_t *node_to_remove) {
         return;
     }
 
-    if (list->head == node_to_remove) {
-        block_descriptor_t *temp = list->head;
-        list->head = list->head->next;
-        temp->next = NULL;
-        list->size--;
-        return;
-    }
+    if (node_to_remove->prev != NULL)
+        node_to_remove->prev->next = node_to_remove->next;
+    else
+        list->head = node_to_remove->next;
 
-    block_descriptor_t *cur= list->head;
-    while (cur->next != NULL) {
-        if (cur->next == node_to_remove) {
-            block_descriptor_t *temp = cur->next;
-            cur->next = cur->next->next;
-            temp = NULL;
-            list->size--;
-            return;
-        }
-        cur = cur->next;
-    }
-    
+    if (node_to_remove->next != NULL)
+        node_to_remove->next->prev = node_to_remove->prev;
+    else
+        list->tail = node_to_remove->prev;
+
+    node_to_remove->prev = NULL;
+    node_to_remove->next = NULL;
+
+    int index = node_to_remove->first_page_address >> list->order;
+    list->bitmap[index / BITS_PER_WORD] &= ~(1UL << (index % BITS_PER_WORD));
+    list->blocks[index] = NULL;
+    list->size--;
     return;
 }
 
 void push_back(free_list_t *list, block_descriptor_t *new_node) {
-    if (list->head == NULL){
+    new_node->prev = list->tail;
+    new_node->next = NULL;
+
+    if (list->tail == NULL)
         list->head = new_node;
-        list->size++;
-        return;
-    }
-        
-    block_descriptor_t *cur = list->head;
-    while (cur->next != NULL) {
-        cur = cur->next;
-    }
-    cur->next = new_node;
+    else
+        list->tail->next = new_node;
+    list->tail = new_node;
+
+    int index = new_node->first_page_address >> list->order;
+    list->bitmap[index / BITS_PER_WORD] |= 1UL << (index % BITS_PER_WORD);
+    list->blocks[index] = new_node;
     list->size++;
     return;
 }
@@ -334,12 +1191,32 @@ void dump_free_list(free_list_t *list, int order) {
     return;
 }
 
-block_descriptor_t *new_block_descriptor(int order, int address) {
-    block_descriptor_t *new_block = (block_descriptor_t*) malloc(sizeof(block_descriptor_t));
+// snapshot_allocator writes the allocator state as one line of JSON, a compact
+// alternative to dump_free_list/dump_lru_cache for periodic reporting.
+void snapshot_allocator(buddy_allocator_t *allocator, FILE *out, unsigned long long request_no) {
+    int free_pages = 0;
+    unsigned active, inactive;
+    allocator->policy_ops->sizes(allocator->policy, &active, &inactive);
+
+    fprintf(out, "{\"request\":%llu,\"free_blocks\":[", request_no);
+    for (int i = 0; i <= allocator->max_order; i++) {
+        int nr_free = free_blocks(allocator, i);
+        fprintf(out, "%s%d", i > 0 ? "," : "", nr_free);
+        free_pages += nr_free << i;
+    }
+
+    fprintf(out, "],\"free_pages\":%d,\"total_pages\":%d,\"active\":%u,\"inactive\":%u,\"tracked\":%zu}\n",
+            free_pages, allocator->total_pages, active, inactive,
+            seq_map_count(allocator->seq_map));
+}
+
+block_descriptor_t *init_block_descriptor(block_descriptor_t *new_block, int order, int address) {
     new_block->order = order;
     new_block->first_page_address = address;
+    new_block->prev = NULL;
     new_block->next = NULL;
     new_block->seq_no = -1;
+    new_block->flags = 0;
 
     return new_block;
 }
\ No newline at end of file
@@ -1,71 +1,586 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "pool.h"
+#include "seq_map.h"
+#include "swap.h"
+
 #define TOTAL_PAGES 512
-#define MAX_LRU_ENTRIES 250
+#define MAX_ORDER 9 // default, see new_buddy_allocator
+#define MAX_ORDER_LIMIT 30 // largest order whose 2^order pages an int still counts
+#define PAGE_SIZE 4096 // bytes per page of backing memory, see enable_swap
+
+// per-thread page caches (CONCURRENT_PCP mode only)
+#define PCP_MAX_ORDER 3 // orders at or below this are served from the cache
+#define PCP_BATCH 16 // blocks moved per refill or drain
+#define PCP_HIGH 64 // a cache list holding more blocks than this is drained
+#define MAX_LRU_ENTRIES 250 // default, see set_lru_entries
+#define LRU_BATCH 15 // hits the lru policies buffer before moving blocks between lists, like PAGEVEC_SIZE
+
+// deferred coalescing, see set_deferred_coalescing
+#define DEFERRED_MAX_ORDER 3 // freed blocks at or below this order may be left unmerged
+
+// compaction cost model, see try_compaction
+#define EXTFRAG_THRESHOLD 500 // default, compact only above this fragmentation index
+#define COMPACT_MIGRATE_COST 1 // moving a page
+#define COMPACT_REFAULT_COST 8 // swapping an evicted page back in
+
+// compressed swap cache, see enable_zswap
+#define ZSWAP_MAX_PERCENT 75 // blocks that don't compress to this share of their size go to swap
+
+// partial eviction, see set_partial_eviction
+#define IDLE_SCAN_BATCH 32 // tracked blocks the idle hand looks at per reclaim, like SWAP_CLUSTER_MAX
+#define PG_REFERENCED 1 // page accessed since the idle hand last passed
+#define PG_SCANNED 2 // first page of a block the idle hand has passed since it was allocated
+
+// readahead, see set_readahead
+#define READAHEAD_MAX_WINDOW 32 // most evicted blocks swapped in after one fault
+
+// batch calls, see allocate_pages_batch
+#define BATCH_CHUNK 64 // requests sorted and served together
+
+// slab caches, see new_slab_cache
+#define SLAB_NAME_LEN 32
+#define SLAB_ALIGN 8 // object sizes are rounded up to a multiple of this
+#define SLAB_MAX_ORDER PCP_MAX_ORDER // largest slab
+#define SLAB_MAX_EMPTY 1 // empty slabs a cache keeps, the others go back to the free lists
+#define SLAB_MAGAZINE_SIZE 32 // objects a thread's magazine holds (concurrent modes only)
+#define SLAB_MAGAZINE_BATCH 16 // objects moved per refill or flush
+
+// free page watermarks, indexes into buddy_allocator_t.watermark
+#define WMARK_MIN 0 // below this, allocating threads reclaim themselves
+#define WMARK_LOW 1 // below this, the background reclaimer is woken
+#define WMARK_HIGH 2 // the background reclaimer stops here
+#define NR_WMARK 3
 
 typedef struct block_descriptor {
     int order;
     int first_page_address;
+    struct block_descriptor *prev;
     struct block_descriptor *next;
-    int seq_no;
+    long long seq_no;
+    int flags; // PG_ bits, kept in the descriptor of every page of a block
 }block_descriptor_t;
 
+// free_list is a doubly linked list of free blocks of a single order.
+// bitmap has one bit per block of this order (indexed by address >> order),
+// set while that block sits on the list, and blocks maps the same index back
+// to its descriptor, so buddy lookup and unlink never walk the list.
 typedef struct free_list {
     int size;
+    int order;
     block_descriptor_t *head;
     block_descriptor_t *tail;
+    unsigned long *bitmap;
+    block_descriptor_t **blocks;
 }free_list_t;
 
 typedef struct lru_node {
     struct lru_node *prev;
     struct lru_node *next;
+    struct lru_cache *owner; // list this node is linked into
     block_descriptor_t *block;
+    unsigned flags; // replacement policy state, e.g. a referenced bit
 } lru_node_t;
 
 typedef struct lru_cache {
     unsigned count; // count of pages
     unsigned capacity; // max capacity of pages
-    lru_node_t** hash_table; // hash
+    object_pool_t *node_pool; // lru_node_t storage, may be shared between caches
+    seq_map_t *seq_map; // seq_no -> node index, shared with the allocator
     lru_node_t *front;
     lru_node_t *rear;
 } lru_cache_t;
 
+// pcp_cache is one thread's stash of low-order free blocks, like Linux per-cpu
+// pageset lists. Blocks in it are neither on a free list nor marked free in the
+// order bitmaps, so they never merge until drained back to the buddy lists.
+typedef struct pcp_cache {
+    pthread_mutex_t lock; // only contended when another thread drains this cache
+    pthread_t thread;
+    struct buddy_allocator *allocator;
+    int count[PCP_MAX_ORDER + 1];
+    block_descriptor_t *lists[PCP_MAX_ORDER + 1]; // linked through block->next
+    struct pcp_cache *next;
+} pcp_cache_t;
+
+// lf_free_list is the lock-free counterpart of free_list: a Treiber stack of
+// block indices (address >> order) with an ABA tag in the upper half of head.
+// state is the source of truth for whether a block is free. A block is taken,
+// by a pop or by a merging buddy, by CAS-ing its state from LF_BLOCK_FREE to
+// LF_BLOCK_BUSY, so the stack may hold stale entries that poppers skip.
+// in_stack keeps a block from being linked in twice while such an entry is left.
+#define LF_BLOCK_BUSY 0
+#define LF_BLOCK_FREE 1
+
+typedef struct lf_free_list {
+    _Atomic unsigned long long head; // tag << 32 | (index + 1), low half 0 if empty
+    _Atomic unsigned *next; // per block, index + 1 of the next entry
+    _Atomic unsigned char *state;
+    _Atomic unsigned char *in_stack;
+} lf_free_list_t;
+
+// zswap_entry is one evicted block compressed in the zswap pool, owned by the
+// seq_entry of seq_no through its zswap field, or one page of its sparse block.
+typedef struct zswap_entry {
+    long long seq_no;
+    int page; // index in the sparse block, -1 for a whole block
+    int nr_pages;
+    size_t length; // compressed bytes in data
+    unsigned char *data;
+    struct zswap_entry *prev;
+    struct zswap_entry *next;
+} zswap_entry_t;
+
+// zswap_pool holds compressed evicted blocks, most recently stored at head,
+// under lru_lock. bytes and nr_pages are also read by get_allocator_stats.
+typedef struct zswap_pool {
+    size_t max_bytes;
+    size_t bytes; // compressed data held
+    unsigned long long nr_pages; // uncompressed size of what is held
+    zswap_entry_t *head;
+    zswap_entry_t *tail; // next to be written back
+    unsigned char *scratch; // one block of the largest order, to compress into or write back from
+} zswap_pool_t;
+
+// sparse_block is a block that the idle hand split into single pages to
+// evict the idle ones, see set_partial_eviction. Each resident page is an
+// order 0 block of its own, still at its place in the original block until
+// it is evicted; a fault brings it back anywhere.
+typedef struct sparse_block {
+    int order; // of the block before it was split
+    int nr_resident;
+    block_descriptor_t **pages; // page i's block, NULL while evicted
+    swap_extent_t **swap; // page i's contents while evicted, with swap
+    zswap_entry_t **zswap; // or compressed, with zswap
+} sparse_block_t;
+
+// slab is one block of 2^order pages of a slab cache, cut into objects. Its
+// descriptor and free bitmap live outside the block, which has no memory
+// behind it unless enable_swap was called.
+typedef struct slab {
+    block_descriptor_t *block;
+    int nr_free;
+    unsigned long *free_map; // one bit per object, set while it is free
+    struct slab_list *list; // the list the slab is on
+    struct slab *prev;
+    struct slab *next;
+} slab_t;
+
+typedef struct slab_list {
+    int size;
+    slab_t *head;
+} slab_list_t;
+
+// slab_magazine is one thread's stash of free objects of a slab cache, as in
+// Bonwick's magazine layer. Objects in it are still allocated as far as their
+// slabs are concerned, so the thread only takes the cache lock to refill or
+// flush it.
+typedef struct slab_magazine {
+    pthread_mutex_t lock; // only contended when another thread flushes this magazine
+    pthread_t thread;
+    int count;
+    long objects[SLAB_MAGAZINE_SIZE];
+    struct slab_magazine *next;
+} slab_magazine_t;
+
+// slab_cache hands out objects of one size, like a Linux kmem_cache, from
+// slabs taken from the buddy allocator. Objects are byte offsets into the
+// arena, see slab_address. They come from partial slabs before empty ones,
+// so that slabs fill up and the rest empty out and go back. Lock order is
+// magazine_list_lock > magazine->lock > lock, all before lru_lock.
+typedef struct slab_cache {
+    char name[SLAB_NAME_LEN];
+    unsigned long id; // tells the thread-local magazine slots of caches apart
+    struct buddy_allocator *allocator;
+    int object_size; // rounded up to SLAB_ALIGN
+    int order; // of every slab
+    int objects_per_slab;
+    slab_list_t partial;
+    slab_list_t full;
+    slab_list_t empty;
+    slab_t **slabs; // by first page address >> order, the slab there or NULL
+    int nr_slabs;
+    long nr_active; // objects not free in their slabs, those in magazines included
+
+    // concurrent modes
+    pthread_mutex_t lock; // lists and slabs
+    pthread_mutex_t magazine_list_lock; // magazines
+    slab_magazine_t *magazines; // every thread's magazine
+
+    struct slab_cache *next; // in the allocator's slab_caches
+} slab_cache_t;
+
+// allocator_stats counts allocator events since creation, like the buddy
+// and lru parts of /proc/vmstat. Counters are bumped with count_event or,
+// by more than one, count_events. The per-order arrays have max_order + 1
+// entries, allocated along with the allocator or, in a copy made by
+// get_allocator_stats, released by free_allocator_stats.
+typedef struct allocator_stats {
+    unsigned long long *splits; // blocks of this order split in two
+    unsigned long long *merges; // buddy pairs of this order merged
+    unsigned long long reclaims; // blocks evicted from the inactive list
+    unsigned long long accesses; // accesses to a tracked block
+    unsigned long long page_faults; // accesses to an evicted block
+    unsigned long long failed_allocations; // allocations and swap-ins that found no memory
+    unsigned long long promotions; // inactive -> active
+    unsigned long long demotions; // active -> inactive
+    unsigned long long workingset_activations; // refaults close enough to go straight to the active list
+    unsigned long long kswapd_wakeups;
+    unsigned long long kswapd_reclaims; // blocks evicted by the background reclaimer
+    unsigned long long direct_reclaims; // blocks evicted by allocating threads
+    unsigned long long deferred_frees; // freed blocks left unmerged
+    unsigned long long deferred_reuses; // allocations served by a deferred block, without splitting
+    unsigned long long deferred_coalesces; // deferred blocks merged back into the free lists
+    unsigned long long compact_stalls; // allocations that ran compaction
+    unsigned long long compact_successes; // compactions that made a free block of the order needed
+    unsigned long long compact_failures;
+    unsigned long long compact_migrations; // blocks moved by compaction
+    unsigned long long swap_outs; // pages queued for writing to swap
+    unsigned long long swap_ins; // pages read back from swap
+    unsigned long long swap_cache_hits; // swap-ins served before the pages were written
+    unsigned long long swap_write_batches; // filled in by get_allocator_stats
+    unsigned long long swap_cancelled_writes; // filled in by get_allocator_stats
+    unsigned long long zswap_stores; // evicted blocks compressed into the pool
+    unsigned long long zswap_rejects; // evicted blocks that compressed too poorly or found no room, sent to swap
+    unsigned long long zswap_hits; // page faults served from the pool
+    unsigned long long zswap_misses; // page faults that had to read swap
+    unsigned long long zswap_writebacks; // blocks moved from the pool to swap to make room
+    unsigned long long zswap_pool_bytes; // filled in by get_allocator_stats
+    unsigned long long zswap_stored_pages; // filled in by get_allocator_stats
+    unsigned long long sparse_splits; // blocks split by the idle hand
+    unsigned long long sparse_evictions; // idle pages evicted on their own
+    unsigned long long sparse_faults; // page faults that brought back a single page
+    unsigned long long readahead_blocks; // evicted blocks swapped in ahead of an access
+    unsigned long long readahead_hits; // of those, accessed while still in memory
+    unsigned long long readahead_wasted; // of those, evicted or freed without being accessed
+    unsigned long long cma_allocations; // high-order allocations served from the reserved region
+    unsigned long long cma_borrows; // low-order allocations served from it, the rest of memory being short
+    unsigned long long cma_evacuations; // high-order allocations that emptied part of it
+    unsigned long long cma_migrations; // borrowed blocks moved out of it
+    unsigned long long cma_evictions; // borrowed blocks evicted from it
+    int *free_blocks; // filled in by get_allocator_stats
+} allocator_stats_t;
+
+// checkpoint is a file being written by save_allocator or read back by
+// load_allocator, see checkpoint.c. Replacement policies save and load
+// their state through it.
+typedef struct checkpoint {
+    struct buddy_allocator *allocator;
+    FILE *out; // NULL when reading
+    const unsigned char *next; // when reading, the bytes left
+    const unsigned char *end;
+    uint64_t length; // bytes written or read so far
+    uint64_t checksum; // of those bytes
+} checkpoint_t;
+
+// counters are only ever read approximately, so a relaxed add is enough when
+// several threads may bump them
+#define count_events(allocator, counter, nr) do { \
+    if ((allocator)->concurrency == SINGLE_THREADED) \
+        (allocator)->stats.counter += (nr); \
+    else \
+        __atomic_fetch_add(&(allocator)->stats.counter, (nr), __ATOMIC_RELAXED); \
+} while (0)
+#define count_event(allocator, counter) count_events(allocator, counter, 1)
+
+// in_cma_region tells whether the page at address lies in the reserved
+// region, see set_cma_region
+#define in_cma_region(allocator, address) ((address) >= (allocator)->cma_start && (address) < (allocator)->cma_end)
+
+// replacement_policy_ops is the interface between the allocator and a page
+// replacement policy. All calls are made under lru_lock. A policy tracks
+// blocks through entry->lru_node, which may also point at a node standing for
+// an evicted block (a ghost), with node->block set to the evicted record.
+// Compaction may move a block in memory, it then repoints entry->lru_node->block
+// along with entry->allocated_block.
+typedef struct replacement_policy_ops {
+    const char *name;
+    void *(*create)(struct buddy_allocator *allocator, unsigned capacity);
+    // destroy frees the policy. Its nodes come from the allocator's
+    // lru_node_pool and are left there.
+    void (*destroy)(void *policy);
+    // admit starts tracking entry->allocated_block, newly allocated or, with
+    // refault set, swapped back in. Returns a block to evict, or NULL.
+    block_descriptor_t *(*admit)(void *policy, seq_entry_t *entry, int refault);
+    // access records a hit on a block that is in memory.
+    void (*access)(void *policy, seq_entry_t *entry);
+    // reclaim stops tracking a block and returns it for eviction, NULL if none.
+    block_descriptor_t *(*reclaim)(void *policy);
+    // evicted, if set, is called once a block returned by admit/reclaim has
+    // been swapped out and entry->evicted_block describes it.
+    void (*evicted)(void *policy, seq_entry_t *entry);
+    // forget drops every trace of entry, whose seq_no is being freed.
+    void (*forget)(void *policy, seq_entry_t *entry);
+    // sizes reports blocks considered frequently and recently used.
+    void (*sizes)(void *policy, unsigned *active, unsigned *inactive);
+    void (*dump)(void *policy);
+    // drain, if set, applies the hits the policy has buffered rather than
+    // applied right away. Every other call drains first, this is for the
+    // counters they bump to be read up to date.
+    void (*drain)(void *policy);
+    // save writes the policy's lists and counters to a checkpoint, load
+    // reads them back into a policy fresh from create, once every entry is
+    // restored. load returns -1 if what it read doesn't fit the entries.
+    void (*save)(void *policy, checkpoint_t *checkpoint);
+    int (*load)(void *policy, checkpoint_t *checkpoint);
+} replacement_policy_ops_t;
+
+typedef enum replacement_policy {
+    POLICY_LRU, // active/inactive lists
+    POLICY_LRU_WORKINGSET, // active/inactive lists sized by refault distance
+    POLICY_CLOCK, // second chance
+    POLICY_CLOCK_PRO,
+    POLICY_ARC,
+    NR_POLICIES,
+} replacement_policy_t;
+
+extern const replacement_policy_ops_t lru_policy_ops;
+extern const replacement_policy_ops_t lru_workingset_policy_ops;
+extern const replacement_policy_ops_t clock_policy_ops;
+extern const replacement_policy_ops_t clock_pro_policy_ops;
+extern const replacement_policy_ops_t arc_policy_ops;
+
+// alloc_request is one allocation queued for allocate_pages_batch
+typedef struct alloc_request {
+    long long seq_no;
+    int page_size;
+} alloc_request_t;
+
+// how allocate_pages/access_pages/free_pages may be called
+typedef enum concurrency_mode {
+    SINGLE_THREADED,
+    CONCURRENT_PCP, // locked free lists behind per-thread caches
+    CONCURRENT_LOCK_FREE, // lock-free free lists
+} concurrency_mode_t;
+
 typedef struct buddy_allocator {
-    lru_cache_t *active_list;
-    lru_cache_t *inactive_list;
-    free_list_t *free_list[10];
-} buddy_allocator_t;
+    int total_pages;
+    int max_order;
+    const replacement_policy_ops_t *policy_ops;
+    void *policy; // state of the replacement policy, see policy_ops->create
+    int lru_entries; // the policy keeps up to twice this many blocks in memory
+    free_list_t **free_list; // max_order + 1 lists, indexed by order
+    free_list_t **deferred; // DEFERRED_MAX_ORDER + 1 lists of freed blocks not yet merged
+    int deferred_high; // a deferred list longer than this is coalesced, 0 if deferring is off
+    int extfrag_threshold; // compaction runs above this fragmentation index, 1000 turns it off
+    // reserved region, see set_cma_region
+    int cma_start; // first page of the region
+    int cma_end; // past its last page, cma_start if there is none
+    int cma_order; // the region is one aligned block of this order
+    int cma_min_order; // requests of this order or above take from it first, smaller ones borrow it
+    free_list_t **cma_free_list; // cma_order + 1 lists of the region's free blocks, NULL without one
+    block_descriptor_t *pages; // one descriptor per page frame, a block is described by its first page's
+    object_pool_t *lru_node_pool;
+    object_pool_t *evicted_block_pool; // descriptors remembering evicted blocks
+    seq_map_t *seq_map; // allocated/evicted block and lru node of every live seq_no
 
-block_descriptor_t* allocated_seq_no_hash_table[1500];
-block_descriptor_t* evicted_seq_no_hash_table[1500];
+    // concurrent modes, lock order is lru_lock > pcp_list_lock > pcp->lock > lock
+    concurrency_mode_t concurrency;
+    pthread_mutex_t lock; // free lists and page descriptors
+    pthread_mutex_t lru_lock; // seq_map, lru lists and evicted blocks
+    pthread_mutex_t pcp_list_lock; // pcp_caches
+    pcp_cache_t *pcp_caches; // every thread's cache
+    lf_free_list_t *lf_free_list; // replaces free_list in CONCURRENT_LOCK_FREE mode
+    slab_cache_t *slab_caches; // see new_slab_cache
+    pthread_mutex_t slab_lock; // slab_caches, taken before any cache's locks
+
+    allocator_stats_t stats;
+
+    // backing memory and swap, NULL unless enable_swap was called
+    char *memory; // total_pages * PAGE_SIZE bytes, a block's pages start at first_page_address
+    swap_device_t *swap;
+    zswap_pool_t *zswap; // NULL unless enable_zswap was called
+
+    // partial eviction, under lru_lock
+    int partial_eviction;
+    int idle_hand; // page address the idle hand looks at next
+
+    // readahead, under lru_lock
+    int readahead_max; // largest window, 0 if readahead is off
+    int readahead_window; // blocks to read ahead at the next fault
+    long long readahead_history[2]; // last two seq_nos that faulted or hit a block read ahead, latest first
+    int readahead_predicted; // the latest of them was where the stream was predicted to go
+
+    // background reclaim, concurrent modes only
+    long nr_free_pages; // pages not held by any seq_no, including those in pcp caches
+    int watermark[NR_WMARK];
+    int kswapd_running;
+    int kswapd_wakeup; // set to have kswapd balance free pages
+    int kswapd_stop;
+    pthread_t kswapd;
+    pthread_mutex_t kswapd_lock; // kswapd_wakeup and kswapd_stop, taken after any other lock
+    pthread_cond_t kswapd_wait;
+} buddy_allocator_t;
 
 
 // memory management methods
-buddy_allocator_t* new_buddy_allocator(void);
-void allocate_pages(buddy_allocator_t *allocator, int seq_no, int page_size);
-void access_pages(buddy_allocator_t *allocator, int seq_no);
-void free_pages(buddy_allocator_t *allocator, int seq_no);
+buddy_allocator_t* new_buddy_allocator(int total_pages, int max_order);
+buddy_allocator_t* new_concurrent_buddy_allocator(int total_pages, int max_order);
+// Only taking and releasing blocks is lock-free: allocate_pages, access_page
+// and free_pages still take lru_lock once each for the seq_map and the
+// replacement policy, so they can block on one another.
+buddy_allocator_t* new_lock_free_buddy_allocator(int total_pages, int max_order);
+void destroy_buddy_allocator(buddy_allocator_t *allocator);
+int set_replacement_policy(buddy_allocator_t *allocator, replacement_policy_t policy);
+int set_lru_entries(buddy_allocator_t *allocator, int nr_entries);
+int find_replacement_policy(const char *name);
+const char *replacement_policy_name(replacement_policy_t policy);
+void dump_replacement_policy(buddy_allocator_t *allocator);
+void _drain_policy(buddy_allocator_t *allocator);
+void allocate_pages(buddy_allocator_t *allocator, long long seq_no, int page_size);
+void access_pages(buddy_allocator_t *allocator, long long seq_no);
+void access_page(buddy_allocator_t *allocator, long long seq_no, int page);
+void free_pages(buddy_allocator_t *allocator, long long seq_no);
 int reclaim(buddy_allocator_t *allocator);
 block_descriptor_t *_find_buddy_and_merge(buddy_allocator_t *allocator, int order, block_descriptor_t *free_block);
+block_descriptor_t *_take_free_block(buddy_allocator_t *allocator, free_list_t **lists, int max_order, int req_order);
+block_descriptor_t *_allocate_unreserved_block(buddy_allocator_t *allocator, int req_order);
+void _seed_free_lists(buddy_allocator_t *allocator, free_list_t **lists, int max_order, int start, int end);
 block_descriptor_t *_allocate_block(buddy_allocator_t *allocator, int req_order);
 void _free_block(buddy_allocator_t *allocator, block_descriptor_t *block_to_free);
+void _evict_block(buddy_allocator_t *allocator, block_descriptor_t *block_to_evict);
+block_descriptor_t *_get_block(buddy_allocator_t *allocator, int req_order);
+block_descriptor_t *_get_unmovable_block(buddy_allocator_t *allocator, int req_order);
+void _balance_free_pages(buddy_allocator_t *allocator, int order, int lru_locked);
+void _put_block(buddy_allocator_t *allocator, block_descriptor_t *block);
+int _allocate_blocks(buddy_allocator_t *allocator, int req_order, int nr_blocks, block_descriptor_t **blocks);
+int _get_blocks(buddy_allocator_t *allocator, int req_order, int nr_blocks, block_descriptor_t **blocks);
+void _put_blocks(buddy_allocator_t *allocator, block_descriptor_t **blocks, int nr_blocks);
+block_descriptor_t *_fault_block(buddy_allocator_t *allocator, int order);
+void _access_page(buddy_allocator_t *allocator, long long seq_no, int page);
+block_descriptor_t *_forget_seq(buddy_allocator_t *allocator, long long seq_no);
+void _lock_lru(buddy_allocator_t *allocator);
+void _unlock_lru(buddy_allocator_t *allocator);
+
+// batch methods
+int allocate_pages_batch(buddy_allocator_t *allocator, const alloc_request_t *requests, int nr_requests);
+void access_pages_batch(buddy_allocator_t *allocator, const long long *seq_nos, const int *pages, int nr_seq_nos);
+void free_pages_batch(buddy_allocator_t *allocator, const long long *seq_nos, int nr_seq_nos);
+
+// compaction methods
+int try_compaction(buddy_allocator_t *allocator, int order);
+void _move_block(buddy_allocator_t *allocator, block_descriptor_t *block, block_descriptor_t *target);
+
+// reserved region methods
+int set_cma_region(buddy_allocator_t *allocator, int order, int min_order);
+int cma_evacuate(buddy_allocator_t *allocator, int order);
+
+// slab cache methods
+slab_cache_t *new_slab_cache(buddy_allocator_t *allocator, const char *name, int object_size);
+int destroy_slab_cache(slab_cache_t *cache);
+long slab_alloc(slab_cache_t *cache);
+void slab_free(slab_cache_t *cache, long object);
+void *slab_address(slab_cache_t *cache, long object);
+int shrink_slab_cache(slab_cache_t *cache);
+long slab_pages(buddy_allocator_t *allocator);
+
+// deferred coalescing methods
+int set_deferred_coalescing(buddy_allocator_t *allocator, int high);
+int coalesce_deferred(buddy_allocator_t *allocator);
+
+// per-thread page cache methods
+pcp_cache_t *get_pcp_cache(buddy_allocator_t *allocator);
+block_descriptor_t *pcp_alloc_block(pcp_cache_t *pcp, int order);
+void pcp_free_block(pcp_cache_t *pcp, block_descriptor_t *block);
+void drain_local_pcp(buddy_allocator_t *allocator);
+void drain_all_pcp(buddy_allocator_t *allocator);
+void _destroy_pcp_caches(buddy_allocator_t *allocator);
+
+// backing memory and swap methods
+int enable_swap(buddy_allocator_t *allocator, const char *swap_path, int nr_io_threads);
+void close_swap(buddy_allocator_t *allocator);
+void *block_address(buddy_allocator_t *allocator, block_descriptor_t *block);
+void *seq_address(buddy_allocator_t *allocator, long long seq_no);
+void *seq_page_address(buddy_allocator_t *allocator, long long seq_no, int page);
+void _save_evicted(buddy_allocator_t *allocator, seq_entry_t *entry, int page, void *pages, int nr_pages);
+void _load_evicted(buddy_allocator_t *allocator, seq_entry_t *entry, int page, void *pages);
+void _drop_evicted(buddy_allocator_t *allocator, seq_entry_t *entry, int page);
+
+// compressed swap cache methods
+int enable_zswap(buddy_allocator_t *allocator, int max_pool_percent);
+void close_zswap(buddy_allocator_t *allocator);
+zswap_entry_t *zswap_store(buddy_allocator_t *allocator, long long seq_no, int page, const void *pages, int nr_pages);
+int zswap_load(buddy_allocator_t *allocator, zswap_entry_t *zentry, void *pages);
+void zswap_invalidate(buddy_allocator_t *allocator, zswap_entry_t *zentry);
+
+// partial eviction methods
+int set_partial_eviction(buddy_allocator_t *allocator, int enabled);
+int reclaim_idle_pages(buddy_allocator_t *allocator);
+void _access_sparse(buddy_allocator_t *allocator, seq_entry_t *entry, int page);
+void _evict_sparse(buddy_allocator_t *allocator, seq_entry_t *entry);
+void _free_sparse(buddy_allocator_t *allocator, seq_entry_t *entry);
+void _clear_page_flags(buddy_allocator_t *allocator, block_descriptor_t *block);
+sparse_block_t *_new_sparse_block(int order);
+void _destroy_sparse_block(sparse_block_t *sparse);
+
+// readahead methods
+int set_readahead(buddy_allocator_t *allocator, int max_window);
+void _readahead(buddy_allocator_t *allocator, seq_entry_t *entry);
+void _readahead_hit(buddy_allocator_t *allocator, seq_entry_t *entry);
+void _readahead_unused(buddy_allocator_t *allocator, seq_entry_t *entry);
+
+// checkpoint methods
+int save_allocator(buddy_allocator_t *allocator, const char *path);
+buddy_allocator_t *load_allocator(const char *path);
+void checkpoint_write(checkpoint_t *checkpoint, const void *data, size_t size);
+int checkpoint_read(checkpoint_t *checkpoint, void *data, size_t size);
+void checkpoint_write_node(checkpoint_t *checkpoint, lru_node_t *node);
+lru_node_t *checkpoint_read_node(checkpoint_t *checkpoint, lru_cache_t *owner);
+
+// background reclaim methods
+void set_watermarks(buddy_allocator_t *allocator, int min, int low, int high);
+long free_page_count(buddy_allocator_t *allocator);
+int start_kswapd(buddy_allocator_t *allocator);
+void stop_kswapd(buddy_allocator_t *allocator);
+void wakeup_kswapd(buddy_allocator_t *allocator);
+
+// lock-free free list methods
+void init_lf_free_lists(buddy_allocator_t *allocator);
+block_descriptor_t *lf_alloc_block(buddy_allocator_t *allocator, int req_order);
+void lf_free_block(buddy_allocator_t *allocator, block_descriptor_t *block);
+int lf_free_blocks(buddy_allocator_t *allocator, int order);
+int lf_free_pages(buddy_allocator_t *allocator);
+void _destroy_lf_free_lists(buddy_allocator_t *allocator);
+
+// statistics methods
+int free_blocks(buddy_allocator_t *allocator, int order);
+void get_allocator_stats(buddy_allocator_t *allocator, allocator_stats_t *stats);
+void free_allocator_stats(allocator_stats_t *stats);
+int fragmentation_index(buddy_allocator_t *allocator, int order);
+int _fragmentation_index(const int *free_blocks, int max_order, int order);
+void dump_buddyinfo(buddy_allocator_t *allocator, FILE *out);
+void dump_slabinfo(buddy_allocator_t *allocator, FILE *out);
+void dump_allocator_stats(buddy_allocator_t *allocator, FILE *out);
 
 
 
 // free list manipulation methods
+free_list_t *new_free_list(int order, int total_pages);
+void destroy_free_list(free_list_t *list);
+block_descriptor_t *find_free_block(free_list_t *list, int address);
 block_descriptor_t*  remove_head(free_list_t *list);
 void remove_node(free_list_t *list, block_descriptor_t *node_to_remove);
 void push_back(free_list_t *list, block_descriptor_t *block_descriptor);
 void dump_free_list(free_list_t *list, int order);
+void snapshot_allocator(buddy_allocator_t *allocator, FILE *out, unsigned long long request_no);
 
 
 // block_descriptor methods
-block_descriptor_t *new_block_descriptor(int order, int address);
+block_descriptor_t *init_block_descriptor(block_descriptor_t *block, int order, int address);
 
 // lru list methods
-lru_node_t* new_lru_node(block_descriptor_t *block);
-lru_cache_t* new_lru_cache(int capacity);
+lru_node_t* new_lru_node(lru_cache_t* lru_cache, block_descriptor_t *block);
+void free_lru_node(lru_cache_t* lru_cache, lru_node_t *node);
+lru_cache_t* new_lru_cache(int capacity, object_pool_t *node_pool, seq_map_t *seq_map);
 int is_lru_cache_full(lru_cache_t* lru_cache);
 int is_lru_cache_empty(lru_cache_t* lru_cache);
 lru_node_t *lru_insert(lru_cache_t* lru_cache, block_descriptor_t *block);
-lru_node_t *lru_remove(lru_cache_t* lru_cache, int seq_no); 
+lru_node_t *lru_remove(lru_cache_t* lru_cache, long long seq_no); 
 lru_node_t *lru_evict(lru_cache_t* lru_cache);
-void dump_lru_cache(lru_cache_t *lru_cache);
\ No newline at end of file
+void lru_move_front(lru_cache_t* lru_cache, lru_node_t *node);
+void lru_rotate(lru_cache_t* lru_cache);
+void dump_lru_cache(lru_cache_t *lru_cache);
+void save_lru_cache(lru_cache_t *lru_cache, checkpoint_t *checkpoint);
+int load_lru_cache(lru_cache_t *lru_cache, checkpoint_t *checkpoint);
\ No newline at end of file
@@ -0,0 +1,206 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "allocator.h"
+
+// ARC (Megiddo, Modha, FAST 2003) splits the blocks in memory between t1,
+// seen once recently, and t2, seen at least twice. b1 and b2 remember blocks
+// evicted from t1 and t2. A refault found in b1 means t1 was too small and
+// grows its target size, one found in b2 shrinks it. Ghost nodes point at the
+// evicted record of their block.
+typedef struct arc_policy {
+    buddy_allocator_t *allocator;
+    unsigned capacity; // blocks in memory, t1 + t2
+    unsigned target; // wanted size of t1
+    lru_cache_t *t1;
+    lru_cache_t *t2;
+    lru_cache_t *b1;
+    lru_cache_t *b2;
+    lru_cache_t *pending_ghost; // where the block being evicted is remembered, if anywhere
+} arc_policy_t;
+
+static void *_arc_create(buddy_allocator_t *allocator, unsigned capacity) {
+    arc_policy_t *arc = (arc_policy_t*)malloc(sizeof(arc_policy_t));
+    arc->allocator = allocator;
+    arc->capacity = capacity;
+    arc->target = 0;
+    // the lists are bounded by the policy itself, never by lru_insert
+    arc->t1 = new_lru_cache(2 * capacity + 1, allocator->lru_node_pool, allocator->seq_map);
+    arc->t2 = new_lru_cache(2 * capacity + 1, allocator->lru_node_pool, allocator->seq_map);
+    arc->b1 = new_lru_cache(2 * capacity + 1, allocator->lru_node_pool, allocator->seq_map);
+    arc->b2 = new_lru_cache(2 * capacity + 1, allocator->lru_node_pool, allocator->seq_map);
+    arc->pending_ghost = NULL;
+    return arc;
+}
+
+static void _arc_destroy(void *policy) {
+    arc_policy_t *arc = (arc_policy_t*)policy;
+    free(arc->t1);
+    free(arc->t2);
+    free(arc->b1);
+    free(arc->b2);
+    free(arc);
+}
+
+// _arc_take returns the block of a node taken off a list and frees the node
+static block_descriptor_t *_arc_take(lru_cache_t *list, lru_node_t *node) {
+    if (node == NULL)
+        return NULL;
+    block_descriptor_t *block = node->block;
+    free_lru_node(list, node);
+    return block;
+}
+
+// _arc_replace picks the block to evict from t1 or t2 and notes which ghost
+// list will remember it
+static block_descriptor_t *_arc_replace(arc_policy_t *arc, int hit_in_b2) {
+    unsigned t1_size = arc->t1->count;
+    if (t1_size > 0 && (t1_size > arc->target || (hit_in_b2 && t1_size == arc->target) || arc->t2->count == 0)) {
+        arc->pending_ghost = arc->b1;
+        return _arc_take(arc->t1, lru_evict(arc->t1));
+    }
+    arc->pending_ghost = arc->b2;
+    return _arc_take(arc->t2, lru_evict(arc->t2));
+}
+
+static block_descriptor_t *_arc_admit(void *policy, seq_entry_t *entry, int refault) {
+    (void)refault; // a refault is told by the ghost list holding the entry
+    arc_policy_t *arc = (arc_policy_t*)policy;
+    lru_node_t *ghost = entry->lru_node;
+    unsigned resident = arc->t1->count + arc->t2->count;
+    block_descriptor_t *victim = NULL;
+    arc->pending_ghost = NULL;
+
+    if (ghost != NULL) {
+        int hit_in_b2 = ghost->owner == arc->b2;
+        unsigned b1_size = arc->b1->count, b2_size = arc->b2->count;
+        if (hit_in_b2) {
+            unsigned delta = b2_size >= b1_size ? 1 : b1_size / b2_size;
+            arc->target = arc->target > delta ? arc->target - delta : 0;
+        } else {
+            unsigned delta = b1_size >= b2_size ? 1 : b2_size / b1_size;
+            arc->target = arc->target + delta < arc->capacity ? arc->target + delta : arc->capacity;
+        }
+        _arc_take(ghost->owner, lru_remove(ghost->owner, entry->seq_no));
+
+        if (resident >= arc->capacity)
+            victim = _arc_replace(arc, hit_in_b2);
+        lru_insert(arc->t2, entry->allocated_block);
+        count_event(arc->allocator, promotions);
+        return victim;
+    }
+
+    // not remembered at all
+    unsigned directory = resident + arc->b1->count + arc->b2->count;
+    if (arc->t1->count + arc->b1->count >= arc->capacity) {
+        if (arc->t1->count < arc->capacity) {
+            _arc_take(arc->b1, lru_evict(arc->b1));
+            if (resident >= arc->capacity)
+                victim = _arc_replace(arc, 0);
+        } else {
+            // t1 alone fills memory, its oldest block is dropped unremembered
+            victim = _arc_take(arc->t1, lru_evict(arc->t1));
+        }
+    } else if (directory >= arc->capacity) {
+        if (directory >= 2 * arc->capacity)
+            _arc_take(arc->b2, lru_evict(arc->b2));
+        if (resident >= arc->capacity)
+            victim = _arc_replace(arc, 0);
+    }
+
+    lru_insert(arc->t1, entry->allocated_block);
+    return victim;
+}
+
+static void _arc_access(void *policy, seq_entry_t *entry) {
+    arc_policy_t *arc = (arc_policy_t*)policy;
+    lru_node_t *node = entry->lru_node;
+    if (node == NULL)
+        return;
+
+    if (node->owner == arc->t1)
+        count_event(arc->allocator, promotions);
+    lru_cache_t *list = node->owner;
+    block_descriptor_t *block = _arc_take(list, lru_remove(list, entry->seq_no));
+    lru_insert(arc->t2, block);
+}
+
+static block_descriptor_t *_arc_reclaim(void *policy) {
+    arc_policy_t *arc = (arc_policy_t*)policy;
+    if (arc->t1->count + arc->t2->count == 0)
+        return NULL;
+    return _arc_replace(arc, 0);
+}
+
+static void _arc_evicted(void *policy, seq_entry_t *entry) {
+    arc_policy_t *arc = (arc_policy_t*)policy;
+    if (arc->pending_ghost == NULL)
+        return;
+    _arc_take(arc->pending_ghost, lru_insert(arc->pending_ghost, entry->evicted_block));
+    arc->pending_ghost = NULL;
+
+    // evictions under memory pressure do not go through admit, keep the
+    // directory within its bounds here
+    while (arc->t1->count + arc->b1->count > arc->capacity && arc->b1->count > 0)
+        _arc_take(arc->b1, lru_evict(arc->b1));
+    while (arc->t1->count + arc->t2->count + arc->b1->count + arc->b2->count > 2 * arc->capacity && arc->b2->count > 0)
+        _arc_take(arc->b2, lru_evict(arc->b2));
+}
+
+static void _arc_forget(void *policy, seq_entry_t *entry) {
+    (void)policy;
+    lru_node_t *node = entry->lru_node;
+    if (node != NULL)
+        _arc_take(node->owner, lru_remove(node->owner, entry->seq_no));
+}
+
+static void _arc_sizes(void *policy, unsigned *active, unsigned *inactive) {
+    arc_policy_t *arc = (arc_policy_t*)policy;
+    *active = arc->t2->count;
+    *inactive = arc->t1->count;
+}
+
+static void _arc_dump(void *policy) {
+    arc_policy_t *arc = (arc_policy_t*)policy;
+    printf("[ARC t1, target %u]->", arc->target);
+    dump_lru_cache(arc->t1);
+    printf("[ARC t2]->");
+    dump_lru_cache(arc->t2);
+    printf("[ARC b1]->");
+    dump_lru_cache(arc->b1);
+    printf("[ARC b2]->");
+    dump_lru_cache(arc->b2);
+}
+
+static void _arc_save(void *policy, checkpoint_t *checkpoint) {
+    arc_policy_t *arc = (arc_policy_t*)policy;
+    checkpoint_write(checkpoint, &arc->target, sizeof(arc->target));
+    save_lru_cache(arc->t1, checkpoint);
+    save_lru_cache(arc->t2, checkpoint);
+    save_lru_cache(arc->b1, checkpoint);
+    save_lru_cache(arc->b2, checkpoint);
+}
+
+static int _arc_load(void *policy, checkpoint_t *checkpoint) {
+    arc_policy_t *arc = (arc_policy_t*)policy;
+    if (checkpoint_read(checkpoint, &arc->target, sizeof(arc->target)) != 0 || arc->target > arc->capacity ||
+        load_lru_cache(arc->t1, checkpoint) != 0 || load_lru_cache(arc->t2, checkpoint) != 0 ||
+        load_lru_cache(arc->b1, checkpoint) != 0 || load_lru_cache(arc->b2, checkpoint) != 0)
+        return -1;
+    return arc->t1->count + arc->t2->count > arc->capacity ? -1 : 0;
+}
+
+const replacement_policy_ops_t arc_policy_ops = {
+    .name = "arc",
+    .create = _arc_create,
+    .destroy = _arc_destroy,
+    .admit = _arc_admit,
+    .access = _arc_access,
+    .reclaim = _arc_reclaim,
+    .evicted = _arc_evicted,
+    .forget = _arc_forget,
+    .sizes = _arc_sizes,
+    .dump = _arc_dump,
+    .drain = NULL,
+    .save = _arc_save,
+    .load = _arc_load,
+};
@@ -0,0 +1,189 @@
+#include <stdlib.h>
+#include <string.h>
+#include "allocator.h"
+#include "util.h"
+
+// The batch calls do what a loop of allocate_pages, access_pages or
+// free_pages calls would, for requests a front end has queued, with the
+// work those calls would each redo done once per batch: lru_lock is taken
+// once, allocations of the same order are split off the same larger
+// blocks, reclaim runs once for what the whole batch lacks, and freed
+// buddies are merged with each other before reaching the free lists.
+
+typedef struct batch_item {
+    long long seq_no;
+    int order;
+} batch_item_t;
+
+static int _compare_address(const void *a, const void *b) {
+    return (*(block_descriptor_t* const*)a)->first_page_address - (*(block_descriptor_t* const*)b)->first_page_address;
+}
+
+// _reclaim_batch reclaims once for a whole batch of nr_pages pages, until
+// that many are free, plus the min watermark while kswapd is running.
+// Fragmentation is left to each allocation to deal with.
+static void _reclaim_batch(buddy_allocator_t *allocator, long nr_pages) {
+    long target = nr_pages;
+    if (allocator->kswapd_running) {
+        if (free_page_count(allocator) - nr_pages < allocator->watermark[WMARK_LOW])
+            wakeup_kswapd(allocator);
+        target += allocator->watermark[WMARK_MIN];
+    }
+    while (free_page_count(allocator) < target && reclaim(allocator) == 0)
+        count_event(allocator, direct_reclaims);
+}
+
+// _get_batch_block takes a block of order once the batch's own share of
+// free blocks ran out, compacting or reclaiming as allocate_pages does.
+static block_descriptor_t *_get_batch_block(buddy_allocator_t *allocator, int order) {
+    block_descriptor_t *block = _get_block(allocator, order);
+    while (block == NULL) {
+        int compacted = cma_evacuate(allocator, order) == 0 || try_compaction(allocator, order) == 0;
+        if (!compacted && reclaim(allocator) != 0) {
+            count_event(allocator, failed_allocations);
+            alloc_log("Sorry, failed to allocate memory \n");
+            return NULL;
+        }
+        if (!compacted)
+            count_event(allocator, direct_reclaims);
+        block = _get_block(allocator, order);
+    }
+    return block;
+}
+
+// _allocate_chunk is allocate_pages_batch for up to BATCH_CHUNK requests.
+// Called with lru_lock held.
+static int _allocate_chunk(buddy_allocator_t *allocator, const alloc_request_t *requests, int nr_requests) {
+    batch_item_t items[BATCH_CHUNK], sorted[BATCH_CHUNK];
+    block_descriptor_t *blocks[BATCH_CHUNK];
+    int count[allocator->max_order + 2];
+    int nr_items = 0;
+    long nr_pages = 0;
+
+    memset(count, 0, sizeof(count));
+    for (int i = 0; i < nr_requests; i++) {
+        int order = get_order(requests[i].page_size);
+        if (order > allocator->max_order) {
+            alloc_log("Sorry, request of %d pages exceeds max order %d \n", requests[i].page_size, allocator->max_order);
+        } else if (seq_map_find(allocator->seq_map, requests[i].seq_no) != NULL) {
+            alloc_log("Sorry, already allocated \n");
+        } else {
+            items[nr_items].seq_no = requests[i].seq_no;
+            items[nr_items++].order = order;
+            count[allocator->max_order - order + 1]++;
+            nr_pages += 1L << order;
+        }
+    }
+    // counting sort, largest order first: they are the hardest to find, so
+    // they go before smaller ones take up what they could have used
+    for (int i = 1; i <= allocator->max_order + 1; i++)
+        count[i] += count[i - 1];
+    for (int i = 0; i < nr_items; i++)
+        sorted[count[allocator->max_order - items[i].order]++] = items[i];
+
+    _reclaim_batch(allocator, nr_pages);
+
+    int nr_allocated = 0;
+    for (int first = 0, last; first < nr_items; first = last) {
+        int order = sorted[first].order;
+        for (last = first; last < nr_items && sorted[last].order == order; last++)
+            ;
+        int nr_taken = _get_blocks(allocator, order, last - first, blocks + first);
+        for (int i = first + nr_taken; i < last; i++)
+            blocks[i] = _get_batch_block(allocator, order);
+
+        for (int i = first; i < last; i++) {
+            if (blocks[i] == NULL)
+                continue;
+            seq_entry_t *entry = seq_map_insert(allocator->seq_map, sorted[i].seq_no);
+            // a seq_no queued twice is allocated once
+            if (entry->allocated_block != NULL || entry->evicted_block != NULL || entry->sparse != NULL) {
+                alloc_log("Sorry, already allocated \n");
+                _put_block(allocator, blocks[i]);
+                continue;
+            }
+            entry->allocated_block = blocks[i];
+            blocks[i]->seq_no = sorted[i].seq_no;
+            if (allocator->partial_eviction)
+                _clear_page_flags(allocator, blocks[i]);
+            block_descriptor_t *victim = allocator->policy_ops->admit(allocator->policy, entry, 0);
+            if (victim != NULL)
+                _evict_block(allocator, victim);
+            nr_allocated++;
+        }
+    }
+    return nr_allocated;
+}
+
+// allocate_pages_batch allocates a block for each of nr_requests requests,
+// skipping those allocate_pages would, and returns how many it allocated.
+// Every BATCH_CHUNK requests are served largest order first, each order's
+// blocks taken together.
+int allocate_pages_batch(buddy_allocator_t *allocator, const alloc_request_t *requests, int nr_requests) {
+    int nr_allocated = 0;
+    _lock_lru(allocator);
+    for (int i = 0; i < nr_requests; i += BATCH_CHUNK)
+        nr_allocated += _allocate_chunk(allocator, requests + i, nr_requests - i < BATCH_CHUNK ? nr_requests - i : BATCH_CHUNK);
+    _unlock_lru(allocator);
+    return nr_allocated;
+}
+
+// access_pages_batch accesses each of nr_seq_nos seq_nos in turn, page
+// pages[i] of the i-th as access_page would, or with pages NULL the whole
+// block as access_pages would.
+void access_pages_batch(buddy_allocator_t *allocator, const long long *seq_nos, const int *pages, int nr_seq_nos) {
+    _lock_lru(allocator);
+    for (int i = 0; i < nr_seq_nos; i++)
+        _access_page(allocator, seq_nos[i], pages != NULL ? pages[i] : 0);
+    _unlock_lru(allocator);
+}
+
+// _merge_blocks merges buddies among blocks being freed together, which
+// would otherwise each be pushed onto a free list only to be unlinked again
+// to merge. Returns how many blocks are left in blocks.
+static int _merge_blocks(buddy_allocator_t *allocator, block_descriptor_t **blocks, int nr_blocks) {
+    qsort(blocks, nr_blocks, sizeof(block_descriptor_t*), _compare_address);
+    int nr_merged = 0;
+    for (int i = 0; i < nr_blocks; i++) {
+        block_descriptor_t *block = blocks[i];
+        // in address order a block's buddy is the block before it, and so
+        // is the buddy of the block they merge into
+        while (nr_merged > 0) {
+            block_descriptor_t *left = blocks[nr_merged - 1];
+            int order = block->order;
+            if (left->order != order || order >= allocator->max_order ||
+                (left->first_page_address & ((2 << order) - 1)) != 0 ||
+                left->first_page_address + (1 << order) != block->first_page_address ||
+                in_cma_region(allocator, left->first_page_address) != in_cma_region(allocator, block->first_page_address))
+                break;
+            count_event(allocator, merges[order]);
+            left->order = order + 1;
+            block = left;
+            nr_merged--;
+        }
+        blocks[nr_merged++] = block;
+    }
+    return nr_merged;
+}
+
+// free_pages_batch frees each of nr_seq_nos seq_nos, as free_pages would,
+// BATCH_CHUNK at a time.
+void free_pages_batch(buddy_allocator_t *allocator, const long long *seq_nos, int nr_seq_nos) {
+    block_descriptor_t *blocks[BATCH_CHUNK];
+    for (int first = 0; first < nr_seq_nos; first += BATCH_CHUNK) {
+        int last = nr_seq_nos - first < BATCH_CHUNK ? nr_seq_nos : first + BATCH_CHUNK;
+        int nr_blocks = 0;
+
+        _lock_lru(allocator);
+        for (int i = first; i < last; i++) {
+            block_descriptor_t *block = _forget_seq(allocator, seq_nos[i]);
+            if (block != NULL)
+                blocks[nr_blocks++] = block;
+        }
+        // compaction reads the descriptors of blocks being freed under lru_lock
+        nr_blocks = _merge_blocks(allocator, blocks, nr_blocks);
+        _unlock_lru(allocator);
+
+        _put_blocks(allocator, blocks, nr_blocks);
+    }
+}
@@ -0,0 +1,1015 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "allocator.h"
+#include "util.h"
+
+// Latencies are kept in a log-linear histogram: exact below 64ns, then 32
+// sub-buckets per power of two (about 3% resolution).
+#define HIST_SUB_BITS 5
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (2 * HIST_SUB_BUCKETS + 58 * HIST_SUB_BUCKETS)
+
+#define LF_STRESS_ROUND 64 // operations per thread between lf_stress merge checks
+
+typedef struct histogram {
+    unsigned long long count;
+    unsigned long long total_ns;
+    unsigned long long max_ns;
+    unsigned long long buckets[HIST_BUCKETS];
+} histogram_t;
+
+enum op_class { OP_ALLOC, OP_ACCESS_HIT, OP_ACCESS_FAULT, OP_FREE, OP_ALLOC_BURST, NR_OP_CLASSES };
+static const char *op_names[NR_OP_CLASSES] = { "allocate", "access(hit)", "access(fault)", "free", "alloc(burst)" };
+
+typedef struct bench_config {
+    unsigned long long nr_ops;
+    int total_pages;
+    int max_order;
+    int max_threads;
+    replacement_policy_t policy;
+    int concurrent; // use a CONCURRENT_PCP allocator
+    int kswapd; // with a background reclaimer, implies concurrent
+    int deferred_high; // > 0 for deferred coalescing
+    int extfrag_threshold; // compaction runs above this fragmentation index
+    const char *swap_path; // backing memory and this swap file, if set
+    int zswap_percent; // > 0 for a compressed pool of this share of memory in front of swap
+    int partial_eviction; // split partly used blocks and evict their idle pages
+    int readahead; // > 0 to swap in up to this many blocks predicted to fault next
+    int cma_order; // > 0 for a region of this order reserved for requests of this order
+    double order_mix[MAX_ORDER_LIMIT + 1]; // relative weight of each order in churn
+} bench_config_t;
+
+static int _bucket(unsigned long long ns) {
+    if (ns < 2 * HIST_SUB_BUCKETS)
+        return (int)ns;
+    int msb = 63 - __builtin_clzll(ns);
+    int shift = msb - HIST_SUB_BITS;
+    return 2 * HIST_SUB_BUCKETS + (shift - 1) * HIST_SUB_BUCKETS + (int)((ns >> shift) - HIST_SUB_BUCKETS);
+}
+
+static unsigned long long _bucket_value(int bucket) {
+    if (bucket < 2 * HIST_SUB_BUCKETS)
+        return bucket;
+    int shift = (bucket - 2 * HIST_SUB_BUCKETS) / HIST_SUB_BUCKETS + 1;
+    return (unsigned long long)((bucket - 2 * HIST_SUB_BUCKETS) % HIST_SUB_BUCKETS + HIST_SUB_BUCKETS) << shift;
+}
+
+static void hist_record(histogram_t *hist, unsigned long long ns) {
+    hist->count++;
+    hist->total_ns += ns;
+    if (ns > hist->max_ns)
+        hist->max_ns = ns;
+    hist->buckets[_bucket(ns)]++;
+}
+
+// hist_record_batch records nr operations that took ns together, each as
+// taking its share
+static void hist_record_batch(histogram_t *hist, unsigned long long ns, int nr) {
+    unsigned long long each = ns / nr;
+    hist->count += nr;
+    hist->total_ns += ns;
+    if (each > hist->max_ns)
+        hist->max_ns = each;
+    hist->buckets[_bucket(each)] += nr;
+}
+
+static unsigned long long hist_percentile(histogram_t *hist, double percentile) {
+    unsigned long long rank = (unsigned long long)ceil(hist->count * percentile / 100.0);
+    unsigned long long seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen >= rank && seen > 0)
+            return _bucket_value(i);
+    }
+    return hist->max_ns;
+}
+
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// xorshift64*, one state per thread
+static unsigned long long next_random(unsigned long long *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static double next_uniform(unsigned long long *state) {
+    return (next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// zipf draws ranks in [0, n) with P(k) proportional to 1/(k+1)^s
+typedef struct zipf {
+    int n;
+    double *cdf;
+} zipf_t;
+
+static zipf_t *new_zipf(int n, double s) {
+    zipf_t *zipf = (zipf_t*)malloc(sizeof(zipf_t));
+    zipf->n = n;
+    zipf->cdf = (double*)malloc(n * sizeof(double));
+
+    double sum = 0;
+    for (int k = 0; k < n; k++) {
+        sum += 1.0 / pow(k + 1, s);
+        zipf->cdf[k] = sum;
+    }
+    for (int k = 0; k < n; k++)
+        zipf->cdf[k] /= sum;
+    return zipf;
+}
+
+static int zipf_draw(zipf_t *zipf, unsigned long long *state) {
+    double u = next_uniform(state);
+    int lo = 0, hi = zipf->n - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (zipf->cdf[mid] < u)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static int draw_order(bench_config_t *config, unsigned long long *state) {
+    double total = 0;
+    for (int i = 0; i <= config->max_order; i++)
+        total += config->order_mix[i];
+
+    double u = next_uniform(state) * total;
+    for (int i = 0; i <= config->max_order; i++) {
+        if (u < config->order_mix[i])
+            return i;
+        u -= config->order_mix[i];
+    }
+    return 0;
+}
+
+static void timed_allocate(buddy_allocator_t *allocator, histogram_t *hists, long long seq_no, int pages) {
+    unsigned long long start = now_ns();
+    allocate_pages(allocator, seq_no, pages);
+    hist_record(&hists[OP_ALLOC], now_ns() - start);
+}
+
+static void timed_access(buddy_allocator_t *allocator, histogram_t *hists, long long seq_no) {
+    seq_entry_t *entry = seq_map_find(allocator->seq_map, seq_no);
+    if (entry == NULL)
+        return;
+    int fault = entry->allocated_block == NULL;
+
+    unsigned long long start = now_ns();
+    access_pages(allocator, seq_no);
+    hist_record(&hists[fault ? OP_ACCESS_FAULT : OP_ACCESS_HIT], now_ns() - start);
+}
+
+static void timed_access_page(buddy_allocator_t *allocator, histogram_t *hists, long long seq_no, int page) {
+    seq_entry_t *entry = seq_map_find(allocator->seq_map, seq_no);
+    if (entry == NULL)
+        return;
+    int fault = entry->allocated_block == NULL || (entry->sparse != NULL && entry->sparse->pages[page] == NULL);
+
+    unsigned long long start = now_ns();
+    access_page(allocator, seq_no, page);
+    hist_record(&hists[fault ? OP_ACCESS_FAULT : OP_ACCESS_HIT], now_ns() - start);
+}
+
+static void timed_free(buddy_allocator_t *allocator, histogram_t *hists, long long seq_no) {
+    unsigned long long start = now_ns();
+    free_pages(allocator, seq_no);
+    hist_record(&hists[OP_FREE], now_ns() - start);
+}
+
+static void report(const char *workload, histogram_t *hists) {
+    for (int i = 0; i < NR_OP_CLASSES; i++) {
+        histogram_t *hist = &hists[i];
+        if (hist->count == 0)
+            continue;
+        printf("%-16s %-14s %10llu %10.3f %8llu %8llu %8llu %10llu\n", workload, op_names[i], hist->count,
+               hist->count * 1000.0 / hist->total_ns, hist_percentile(hist, 50), hist_percentile(hist, 99),
+               hist_percentile(hist, 99.9), hist->max_ns);
+    }
+}
+
+static buddy_allocator_t *new_bench_allocator(bench_config_t *config) {
+    buddy_allocator_t *allocator = config->concurrent || config->kswapd
+                                       ? new_concurrent_buddy_allocator(config->total_pages, config->max_order)
+                                       : new_buddy_allocator(config->total_pages, config->max_order);
+    set_replacement_policy(allocator, config->policy);
+    set_deferred_coalescing(allocator, config->deferred_high);
+    set_partial_eviction(allocator, config->partial_eviction);
+    set_readahead(allocator, config->readahead);
+    allocator->extfrag_threshold = config->extfrag_threshold;
+    if (config->cma_order > 0)
+        set_cma_region(allocator, config->cma_order, config->cma_order);
+    if (config->swap_path != NULL && enable_swap(allocator, config->swap_path, 2) != 0) {
+        fprintf(stderr, "Cannot set up swap at %s\n", config->swap_path);
+        exit(EXIT_FAILURE);
+    }
+    if (config->zswap_percent > 0 && enable_zswap(allocator, config->zswap_percent) != 0) {
+        fprintf(stderr, "Cannot set up zswap\n");
+        exit(EXIT_FAILURE);
+    }
+    if (config->kswapd)
+        start_kswapd(allocator);
+    return allocator;
+}
+
+static void report_reclaim(const char *workload, buddy_allocator_t *allocator) {
+    allocator_stats_t stats;
+    get_allocator_stats(allocator, &stats);
+    unsigned long long reclaims = stats.direct_reclaims + stats.kswapd_reclaims;
+    printf("%-16s %-14s %10llu %9.2f%%\n", workload, "kswapd share", reclaims,
+           reclaims > 0 ? 100.0 * stats.kswapd_reclaims / reclaims : 0);
+    free_allocator_stats(&stats);
+}
+
+// access_workload allocates nr_seqs blocks, then accesses them nr_ops times
+// with ranks drawn uniformly or from a zipf distribution
+static void access_workload(bench_config_t *config, const char *name, int nr_seqs, double zipf_s) {
+    histogram_t *hists = (histogram_t*)calloc(NR_OP_CLASSES, sizeof(histogram_t));
+    buddy_allocator_t *allocator = new_bench_allocator(config);
+    unsigned long long state = 0x9E3779B97F4A7C15ULL;
+    zipf_t *zipf = zipf_s > 0 ? new_zipf(nr_seqs, zipf_s) : NULL;
+    unsigned long long fill_state = state;
+
+    for (int i = 0; i < nr_seqs; i++) {
+        timed_allocate(allocator, hists, i, 1 << draw_order(config, &state));
+        // give swap something to write: a quarter of each page of text-like
+        // bytes, the rest zero, which compresses about 3:1
+        char *pages = (char*)seq_address(allocator, i);
+        seq_entry_t *entry = seq_map_find(allocator->seq_map, i);
+        for (int page = 0; pages != NULL && page < 1 << entry->allocated_block->order; page++)
+            for (int byte = 0; byte < PAGE_SIZE / 4; byte++)
+                pages[(size_t)page * PAGE_SIZE + byte] = (char)('a' + next_random(&fill_state) % 16);
+    }
+
+    for (unsigned long long i = 0; i < config->nr_ops; i++) {
+        int seq_no = zipf != NULL ? zipf_draw(zipf, &state) : (int)(next_random(&state) % nr_seqs);
+        timed_access(allocator, hists, seq_no);
+    }
+
+    allocator_stats_t stats;
+    get_allocator_stats(allocator, &stats);
+
+    for (int i = 0; i < nr_seqs; i++)
+        timed_free(allocator, hists, i);
+
+    report(name, hists);
+    printf("%-16s %-14s %10llu %9.2f%%\n", name, "fault rate", stats.accesses,
+           stats.accesses > 0 ? 100.0 * stats.page_faults / stats.accesses : 0);
+    if (config->swap_path != NULL) {
+        printf("%-16s %-14s %10llu %9.2f%%\n", name, "swap cache hit", stats.swap_ins,
+               stats.swap_ins > 0 ? 100.0 * stats.swap_cache_hits / stats.swap_ins : 0);
+        if (config->zswap_percent > 0) {
+            unsigned long long refaults = stats.zswap_hits + stats.zswap_misses;
+            printf("%-16s %-14s %10llu %9.2f%%\n", name, "zswap hit", refaults,
+                   refaults > 0 ? 100.0 * stats.zswap_hits / refaults : 0);
+            printf("%-16s %-14s %10llu %9.2fx\n", name, "zswap ratio", stats.zswap_stored_pages,
+                   stats.zswap_pool_bytes > 0 ? (double)stats.zswap_stored_pages * PAGE_SIZE / stats.zswap_pool_bytes : 0);
+        }
+        close_swap(allocator);
+        unlink(config->swap_path);
+    }
+    destroy_buddy_allocator(allocator);
+    if (zipf != NULL) {
+        free(zipf->cdf);
+        free(zipf);
+    }
+    free_allocator_stats(&stats);
+    free(hists);
+}
+
+// sparse_workload allocates nr_seqs blocks of 1 << order pages, then
+// accesses one page of a uniformly drawn block nr_ops times: its first page
+// nine times out of ten, any other page otherwise
+static void sparse_workload(bench_config_t *config, const char *name, int nr_seqs, int order) {
+    histogram_t *hists = (histogram_t*)calloc(NR_OP_CLASSES, sizeof(histogram_t));
+    buddy_allocator_t *allocator = new_bench_allocator(config);
+    unsigned long long state = 0x9E3779B97F4A7C15ULL;
+
+    for (int i = 0; i < nr_seqs; i++)
+        timed_allocate(allocator, hists, i, 1 << order);
+    for (unsigned long long i = 0; i < config->nr_ops; i++) {
+        int seq_no = (int)(next_random(&state) % nr_seqs);
+        int page = next_random(&state) % 10 == 0 ? (int)(next_random(&state) % (1 << order)) : 0;
+        timed_access_page(allocator, hists, seq_no, page);
+    }
+
+    allocator_stats_t stats;
+    get_allocator_stats(allocator, &stats);
+
+    for (int i = 0; i < nr_seqs; i++)
+        timed_free(allocator, hists, i);
+
+    report(name, hists);
+    printf("%-16s %-14s %10llu %9.2f%%\n", name, "fault rate", stats.accesses,
+           stats.accesses > 0 ? 100.0 * stats.page_faults / stats.accesses : 0);
+    printf("%-16s %-14s %10llu %10llu\n", name, "split/evicted", stats.sparse_splits, stats.sparse_evictions);
+    destroy_buddy_allocator(allocator);
+    free_allocator_stats(&stats);
+    free(hists);
+}
+
+// scan_workload allocates nr_seqs blocks, then accesses them nr_ops times in
+// scans, every third of which visits them in steps of stride
+static void scan_workload(bench_config_t *config, const char *name, int nr_seqs, int stride) {
+    histogram_t *hists = (histogram_t*)calloc(NR_OP_CLASSES, sizeof(histogram_t));
+    buddy_allocator_t *allocator = new_bench_allocator(config);
+    unsigned long long state = 0x9E3779B97F4A7C15ULL;
+
+    for (int i = 0; i < nr_seqs; i++)
+        timed_allocate(allocator, hists, i, 1 << draw_order(config, &state));
+    for (unsigned long long i = 0; i < config->nr_ops; i++) {
+        unsigned long long scan = i / nr_seqs, step = i % nr_seqs;
+        int seq_no = scan % 3 == 2 ? (int)(step * stride % nr_seqs) : (int)step;
+        timed_access(allocator, hists, seq_no);
+    }
+
+    allocator_stats_t stats;
+    get_allocator_stats(allocator, &stats);
+
+    for (int i = 0; i < nr_seqs; i++)
+        timed_free(allocator, hists, i);
+
+    report(name, hists);
+    printf("%-16s %-14s %10llu %9.2f%%\n", name, "fault rate", stats.accesses,
+           stats.accesses > 0 ? 100.0 * stats.page_faults / stats.accesses : 0);
+    printf("%-16s %-14s %10llu %9.2f%%\n", name, "ra accuracy", stats.readahead_blocks,
+           stats.readahead_blocks > 0 ? 100.0 * stats.readahead_hits / stats.readahead_blocks : 0);
+    printf("%-16s %-14s %10llu\n", name, "ra wasted", stats.readahead_wasted);
+    destroy_buddy_allocator(allocator);
+    free_allocator_stats(&stats);
+    free(hists);
+}
+
+// queue_workload allocates, accesses and frees blocks in rounds of
+// batch_size requests, as a front end draining its queue would, keeping
+// about live_target blocks allocated. A batch_size of 1 makes one call per
+// request, larger ones go through the batch calls.
+static void queue_workload(bench_config_t *config, const char *name, int live_target, int batch_size) {
+    histogram_t *hists = (histogram_t*)calloc(NR_OP_CLASSES, sizeof(histogram_t));
+    buddy_allocator_t *allocator = new_bench_allocator(config);
+    unsigned long long state = 0xD1B54A32D192ED03ULL;
+    int nr_rounds = live_target / batch_size > 0 ? live_target / batch_size : 1;
+    alloc_request_t *requests = (alloc_request_t*)malloc(batch_size * sizeof(alloc_request_t));
+    long long *seq_nos = (long long*)malloc(batch_size * sizeof(long long));
+
+    for (unsigned long long round = 0; round * batch_size < config->nr_ops; round++) {
+        for (int i = 0; i < batch_size; i++) {
+            requests[i].seq_no = seq_nos[i] = (long long)(round * batch_size + i);
+            requests[i].page_size = 1 << draw_order(config, &state);
+        }
+        if (batch_size == 1) {
+            timed_allocate(allocator, hists, seq_nos[0], requests[0].page_size);
+            timed_access(allocator, hists, seq_nos[0]);
+        } else {
+            unsigned long long start = now_ns();
+            allocate_pages_batch(allocator, requests, batch_size);
+            hist_record_batch(&hists[OP_ALLOC], now_ns() - start, batch_size);
+            start = now_ns();
+            access_pages_batch(allocator, seq_nos, NULL, batch_size);
+            hist_record_batch(&hists[OP_ACCESS_HIT], now_ns() - start, batch_size);
+        }
+
+        // the round allocated nr_rounds ago goes
+        if (round < (unsigned long long)nr_rounds)
+            continue;
+        for (int i = 0; i < batch_size; i++)
+            seq_nos[i] = (long long)((round - nr_rounds) * batch_size + i);
+        if (batch_size == 1) {
+            timed_free(allocator, hists, seq_nos[0]);
+        } else {
+            unsigned long long start = now_ns();
+            free_pages_batch(allocator, seq_nos, batch_size);
+            hist_record_batch(&hists[OP_FREE], now_ns() - start, batch_size);
+        }
+    }
+
+    report(name, hists);
+    destroy_buddy_allocator(allocator);
+    free(requests);
+    free(seq_nos);
+    free(hists);
+}
+
+// batch_comparison runs the queue workload with one call per request, then
+// with batches of growing size
+static void batch_comparison(bench_config_t *config) {
+    static const int batch_sizes[] = { 1, 8, 32, 128 };
+    for (int i = 0; i < (int)(sizeof(batch_sizes) / sizeof(batch_sizes[0])); i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "queue/%d", batch_sizes[i]);
+        queue_workload(config, name, MAX_LRU_ENTRIES / 2, batch_sizes[i]);
+    }
+}
+
+// buddy_ops returns the splits and merges done so far
+static unsigned long long buddy_ops(buddy_allocator_t *allocator) {
+    allocator_stats_t stats;
+    get_allocator_stats(allocator, &stats);
+    unsigned long long ops = 0;
+    for (int i = 0; i <= allocator->max_order; i++)
+        ops += stats.splits[i] + stats.merges[i];
+    free_allocator_stats(&stats);
+    return ops;
+}
+
+// churn_workload keeps about live_target blocks allocated, freeing a random
+// one or allocating a new one at each step. Returns the splits and merges it
+// caused.
+static unsigned long long churn_workload(bench_config_t *config, const char *name, int live_target, int burst_order, unsigned long long burst_every) {
+    histogram_t *hists = (histogram_t*)calloc(NR_OP_CLASSES, sizeof(histogram_t));
+    buddy_allocator_t *allocator = new_bench_allocator(config);
+    unsigned long long state = 0xD1B54A32D192ED03ULL;
+    long long *live = (long long*)malloc(live_target * sizeof(long long));
+    int nr_live = 0;
+    long long next_seq_no = 0;
+
+    for (unsigned long long i = 0; i < config->nr_ops; i++) {
+        if (burst_every > 0 && i % burst_every == burst_every - 1) {
+            // a large allocation that is accessed once and dropped
+            long long seq_no = next_seq_no++;
+            unsigned long long start = now_ns();
+            allocate_pages(allocator, seq_no, 1 << burst_order);
+            hist_record(&hists[OP_ALLOC_BURST], now_ns() - start);
+            timed_access(allocator, hists, seq_no);
+            timed_free(allocator, hists, seq_no);
+            continue;
+        }
+
+        if (nr_live < live_target && (nr_live == 0 || next_random(&state) % 2 == 0)) {
+            live[nr_live] = next_seq_no++;
+            timed_allocate(allocator, hists, live[nr_live], 1 << draw_order(config, &state));
+            nr_live++;
+        } else {
+            int victim = (int)(next_random(&state) % nr_live);
+            timed_free(allocator, hists, live[victim]);
+            live[victim] = live[--nr_live];
+        }
+    }
+
+    stop_kswapd(allocator);
+    report(name, hists);
+    if (config->concurrent || config->kswapd)
+        report_reclaim(name, allocator);
+    unsigned long long ops = buddy_ops(allocator);
+    destroy_buddy_allocator(allocator);
+    free(live);
+    free(hists);
+    return ops;
+}
+
+// slab_workload keeps about live_target objects of 32 to 1024 bytes
+// allocated, freeing a random one or allocating a new one at each step, from
+// a slab cache per size or as a page each without slabs. Reports the most
+// pages held at once and the splits and merges caused.
+static void slab_workload(bench_config_t *config, const char *name, int live_target, int use_slabs) {
+    histogram_t *hists = (histogram_t*)calloc(NR_OP_CLASSES, sizeof(histogram_t));
+    buddy_allocator_t *allocator = new_bench_allocator(config);
+    unsigned long long state = 0xD1B54A32D192ED03ULL;
+    slab_cache_t *caches[6];
+    for (int i = 0; i < 6; i++) {
+        char cache_name[SLAB_NAME_LEN];
+        snprintf(cache_name, sizeof(cache_name), "bench-%d", 32 << i);
+        caches[i] = new_slab_cache(allocator, cache_name, 32 << i);
+    }
+    long *live = (long*)malloc(live_target * sizeof(long));
+    int *live_cache = (int*)malloc(live_target * sizeof(int));
+    int nr_live = 0;
+    long long next_seq_no = 0;
+    long peak_pages = 0;
+
+    for (unsigned long long i = 0; i < config->nr_ops; i++) {
+        unsigned long long start;
+        if (nr_live < live_target && (nr_live == 0 || next_random(&state) % 2 == 0)) {
+            int cache = (int)(next_random(&state) % 6);
+            start = now_ns();
+            if (use_slabs) {
+                live[nr_live] = slab_alloc(caches[cache]);
+            } else {
+                live[nr_live] = next_seq_no++;
+                allocate_pages(allocator, live[nr_live], 1);
+            }
+            hist_record(&hists[OP_ALLOC], now_ns() - start);
+            live_cache[nr_live++] = cache;
+            if (allocator->total_pages - free_page_count(allocator) > peak_pages)
+                peak_pages = allocator->total_pages - free_page_count(allocator);
+        } else {
+            int victim = (int)(next_random(&state) % nr_live);
+            start = now_ns();
+            if (use_slabs)
+                slab_free(caches[live_cache[victim]], live[victim]);
+            else
+                free_pages(allocator, live[victim]);
+            hist_record(&hists[OP_FREE], now_ns() - start);
+            live_cache[victim] = live_cache[nr_live - 1];
+            live[victim] = live[--nr_live];
+        }
+    }
+
+    stop_kswapd(allocator);
+    report(name, hists);
+    printf("%-16s %-14s %10ld\n", name, "peak pages", peak_pages);
+    printf("%-16s %-14s %10llu\n", name, "split+merge", buddy_ops(allocator));
+    for (int i = 0; use_slabs && i < nr_live; i++)
+        slab_free(caches[live_cache[i]], live[i]);
+    for (int i = 0; i < 6; i++)
+        destroy_slab_cache(caches[i]);
+    destroy_buddy_allocator(allocator);
+    free(live_cache);
+    free(live);
+    free(hists);
+}
+
+typedef struct thread_args {
+    buddy_allocator_t *allocator;
+    bench_config_t *config;
+    int thread_no;
+    unsigned long long nr_ops;
+    slab_cache_t *cache; // objects come from it instead, if set
+    int *owners; // thread holding each page, for lf_stress
+    pthread_barrier_t *barrier; // between lf_stress rounds
+    long nr_overlaps; // pages found held by another thread, for lf_stress
+    long nr_unmerged; // lf_stress rounds that ended with free buddies unmerged
+} thread_args_t;
+
+static void *_thread_churn(void *arg) {
+    thread_args_t *args = (thread_args_t*)arg;
+    unsigned long long state = 0x9E3779B97F4A7C15ULL * (args->thread_no + 1);
+    long long base = (long long)args->thread_no << 40;
+    long long live[32];
+    int nr_live = 0;
+    long long next_seq_no = base;
+
+    for (unsigned long long i = 0; i < args->nr_ops; i++) {
+        if (nr_live < 32 && (nr_live == 0 || next_random(&state) % 2 == 0)) {
+            live[nr_live] = next_seq_no++;
+            allocate_pages(args->allocator, live[nr_live++], 1 << (next_random(&state) % (PCP_MAX_ORDER + 1)));
+        } else {
+            int victim = (int)(next_random(&state) % nr_live);
+            free_pages(args->allocator, live[victim]);
+            live[victim] = live[--nr_live];
+        }
+    }
+    for (int i = 0; i < nr_live; i++)
+        free_pages(args->allocator, live[i]);
+    return NULL;
+}
+
+static void *_thread_slab_churn(void *arg) {
+    thread_args_t *args = (thread_args_t*)arg;
+    unsigned long long state = 0x9E3779B97F4A7C15ULL * (args->thread_no + 1);
+    long live[32];
+    int nr_live = 0;
+
+    for (unsigned long long i = 0; i < args->nr_ops; i++) {
+        if (nr_live < 32 && (nr_live == 0 || next_random(&state) % 2 == 0)) {
+            live[nr_live++] = slab_alloc(args->cache);
+        } else {
+            int victim = (int)(next_random(&state) % nr_live);
+            slab_free(args->cache, live[victim]);
+            live[victim] = live[--nr_live];
+        }
+    }
+    for (int i = 0; i < nr_live; i++)
+        slab_free(args->cache, live[i]);
+    return NULL;
+}
+
+// thread_scaling runs a small-order churn on 1..max_threads threads against
+// each concurrent mode, then a churn of 64 byte objects from a slab cache
+static void thread_scaling(bench_config_t *config) {
+    const char *mode_names[] = { "pcp", "lock-free", "pcp+slab" };
+    printf("\n%-16s %-14s %10s %10s\n", "workload", "mode", "threads", "Mops/s");
+    for (int mode = 0; mode < 3; mode++) {
+        for (int nr_threads = 1; nr_threads <= config->max_threads; nr_threads *= 2) {
+            // room for every thread's live blocks at the largest order used
+            int total_pages = nr_threads * 32 * (1 << PCP_MAX_ORDER) * 2;
+            buddy_allocator_t *allocator = mode != 1 ? new_concurrent_buddy_allocator(total_pages, config->max_order)
+                                                     : new_lock_free_buddy_allocator(total_pages, config->max_order);
+            slab_cache_t *cache = mode == 2 ? new_slab_cache(allocator, "bench-64", 64) : NULL;
+            pthread_t threads[nr_threads];
+            thread_args_t args[nr_threads];
+
+            unsigned long long start = now_ns();
+            for (int i = 0; i < nr_threads; i++) {
+                args[i] = (thread_args_t){ allocator, config, i, config->nr_ops / nr_threads, cache, NULL, NULL, 0, 0 };
+                pthread_create(&threads[i], NULL, cache != NULL ? _thread_slab_churn : _thread_churn, &args[i]);
+            }
+            for (int i = 0; i < nr_threads; i++)
+                pthread_join(threads[i], NULL);
+            unsigned long long elapsed = now_ns() - start;
+
+            printf("%-16s %-14s %10d %10.3f\n", "threads", mode_names[mode], nr_threads,
+                   (config->nr_ops / nr_threads) * nr_threads * 1000.0 / elapsed);
+            if (cache != NULL)
+                destroy_slab_cache(cache);
+            destroy_buddy_allocator(allocator);
+        }
+    }
+}
+
+// _lf_stress_release frees a block taken by _thread_lf_stress
+static void _lf_stress_release(thread_args_t *args, block_descriptor_t *block) {
+    for (int page = block->first_page_address; page < block->first_page_address + (1 << block->order); page++)
+        __atomic_store_n(&args->owners[page], 0, __ATOMIC_RELAXED);
+    lf_free_block(args->allocator, block);
+}
+
+// _thread_lf_stress takes and releases blocks of random order straight from
+// the lock-free free lists, marking each page with the thread holding it. A
+// page already marked has been handed out twice. Every LF_STRESS_ROUND
+// operations all threads free what they hold at once, racing to merge
+// buddies, and the first one checks the arena is a single block again.
+static void *_thread_lf_stress(void *arg) {
+    thread_args_t *args = (thread_args_t*)arg;
+    buddy_allocator_t *allocator = args->allocator;
+    unsigned long long state = 0x9E3779B97F4A7C15ULL * (args->thread_no + 1);
+    block_descriptor_t *live[8];
+    int nr_live = 0;
+
+    for (unsigned long long i = 0; i < args->nr_ops; i++) {
+        if (nr_live < 8 && (nr_live == 0 || next_random(&state) % 2 == 0)) {
+            block_descriptor_t *block = lf_alloc_block(allocator, (int)(next_random(&state) % (PCP_MAX_ORDER + 1)));
+            if (block != NULL) {
+                for (int page = block->first_page_address; page < block->first_page_address + (1 << block->order); page++) {
+                    int expected = 0;
+                    if (!__atomic_compare_exchange_n(&args->owners[page], &expected, args->thread_no + 1, 0,
+                                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                        args->nr_overlaps++;
+                }
+                live[nr_live++] = block;
+            }
+        } else {
+            int victim = (int)(next_random(&state) % nr_live);
+            _lf_stress_release(args, live[victim]);
+            live[victim] = live[--nr_live];
+        }
+
+        if ((i + 1) % LF_STRESS_ROUND != 0 && i + 1 != args->nr_ops)
+            continue;
+        pthread_barrier_wait(args->barrier);
+        while (nr_live > 0)
+            _lf_stress_release(args, live[--nr_live]);
+        pthread_barrier_wait(args->barrier);
+        if (args->thread_no == 0 && (lf_free_blocks(allocator, allocator->max_order) != 1 ||
+                                     lf_free_pages(allocator) != allocator->total_pages))
+            args->nr_unmerged++;
+        pthread_barrier_wait(args->barrier);
+    }
+    return NULL;
+}
+
+// lf_stress runs nr_ops random allocations and frees per thread against the
+// lock-free free lists of an arena of one max_order block, on 2..max_threads
+// threads. No page may be handed out twice, and whenever every block has
+// been freed the concurrent merges must have rebuilt the max_order block.
+// Returns -1 if either check failed.
+static int lf_stress(bench_config_t *config) {
+    int failed = 0;
+    printf("\n%-16s %-14s %10s %10s\n", "workload", "check", "threads", "Mops/s");
+    for (int nr_threads = 2; nr_threads <= config->max_threads; nr_threads *= 2) {
+        int total_pages = 1 << config->max_order;
+        buddy_allocator_t *allocator = new_lock_free_buddy_allocator(total_pages, config->max_order);
+        int *owners = (int*)calloc(total_pages, sizeof(int));
+        pthread_barrier_t barrier;
+        pthread_barrier_init(&barrier, NULL, nr_threads);
+        pthread_t threads[nr_threads];
+        thread_args_t args[nr_threads];
+
+        unsigned long long start = now_ns();
+        for (int i = 0; i < nr_threads; i++) {
+            args[i] = (thread_args_t){ allocator, config, i, config->nr_ops, NULL, owners, &barrier, 0, 0 };
+            pthread_create(&threads[i], NULL, _thread_lf_stress, &args[i]);
+        }
+        long nr_overlaps = 0;
+        for (int i = 0; i < nr_threads; i++) {
+            pthread_join(threads[i], NULL);
+            nr_overlaps += args[i].nr_overlaps;
+        }
+        unsigned long long elapsed = now_ns() - start;
+
+        long nr_unmerged = args[0].nr_unmerged;
+        printf("%-16s %-14s %10d %10.3f\n", "lf-stress", nr_overlaps == 0 && nr_unmerged == 0 ? "ok" : "FAILED",
+               nr_threads, config->nr_ops * nr_threads * 1000.0 / elapsed);
+        if (nr_overlaps != 0)
+            fprintf(stderr, "lf-stress: %ld pages handed out twice\n", nr_overlaps);
+        if (nr_unmerged != 0)
+            fprintf(stderr, "lf-stress: %ld rounds left free buddies unmerged\n", nr_unmerged);
+        if (nr_overlaps != 0 || nr_unmerged != 0)
+            failed = -1;
+        pthread_barrier_destroy(&barrier);
+        destroy_buddy_allocator(allocator);
+        free(owners);
+    }
+    return failed;
+}
+
+// reclaim_comparison runs a churn whose live blocks outgrow memory on a
+// concurrent allocator, reclaiming in the allocating thread only or with the
+// background reclaimer
+static void reclaim_comparison(bench_config_t *config) {
+    bench_config_t pressure = *config;
+    pressure.concurrent = 1;
+    pressure.kswapd = 0;
+    churn_workload(&pressure, "pressure/direct", 2 * MAX_LRU_ENTRIES - 100, 0, 0);
+    pressure.kswapd = 1;
+    churn_workload(&pressure, "pressure/kswapd", 2 * MAX_LRU_ENTRIES - 100, 0, 0);
+}
+
+// coalesce_comparison runs the churn and burst workloads with eager and
+// deferred coalescing, reporting the splits and merges left with deferring
+// and the share of eager ones it avoided
+static void coalesce_comparison(bench_config_t *config) {
+    bench_config_t eager = *config, deferred = *config;
+    eager.deferred_high = 0;
+    if (deferred.deferred_high == 0)
+        deferred.deferred_high = PCP_BATCH;
+
+    for (int burst = 0; burst < 2; burst++) {
+        const char *workload = burst ? "burst" : "churn";
+        int burst_every = burst ? 1000 : 0;
+        char name[32];
+        snprintf(name, sizeof(name), "%s/eager", workload);
+        unsigned long long eager_ops = churn_workload(&eager, name, MAX_LRU_ENTRIES / 2, config->max_order - 1, burst_every);
+        snprintf(name, sizeof(name), "%s/deferred", workload);
+        unsigned long long deferred_ops = churn_workload(&deferred, name, MAX_LRU_ENTRIES / 2, config->max_order - 1, burst_every);
+        printf("%-16s %-14s %10llu %9.2f%%\n", name, "split+merge", deferred_ops,
+               eager_ops > 0 ? 100.0 * ((double)eager_ops - deferred_ops) / eager_ops : 0);
+    }
+}
+
+// swap_comparison runs the oversized working set workload without and with
+// backing memory and a swap file, then with a zswap pool in front of it, to
+// show what faults really cost. It uses
+// CLOCK: memory, not the lru lists, is what runs out here, and lru only
+// reclaims from its inactive list, which this workload empties.
+static void swap_comparison(bench_config_t *config, const char *swap_path) {
+    bench_config_t swap = *config;
+    swap.policy = POLICY_CLOCK;
+    swap.swap_path = NULL;
+    access_workload(&swap, "bigws/noswap", 4 * MAX_LRU_ENTRIES, 0);
+    swap.swap_path = swap_path;
+    access_workload(&swap, "bigws/swap", 4 * MAX_LRU_ENTRIES, 0);
+    swap.zswap_percent = 20; // Linux's default max_pool_percent
+    access_workload(&swap, "bigws/zswap", 4 * MAX_LRU_ENTRIES, 0);
+}
+
+// compaction_comparison runs a zipf workload over blocks of up to
+// max_order - 3 that do not all fit in memory, with and without compaction
+static void compaction_comparison(bench_config_t *config) {
+    bench_config_t large = *config;
+    memset(large.order_mix, 0, sizeof(large.order_mix));
+    for (int i = 0; i <= config->max_order - 3; i++)
+        large.order_mix[i] = 1 << (config->max_order - 3 - i);
+
+    large.extfrag_threshold = 1000;
+    access_workload(&large, "large/reclaim", 4 * MAX_LRU_ENTRIES / 5, 1.0);
+    large.extfrag_threshold = config->extfrag_threshold;
+    access_workload(&large, "large/compact", 4 * MAX_LRU_ENTRIES / 5, 1.0);
+}
+
+// cma_comparison runs the burst workload with more small blocks live than
+// memory holds, the bursts of max_order - 1 getting their pages by reclaim,
+// by compaction as well, then from a region reserved for them
+static void cma_comparison(bench_config_t *config) {
+    bench_config_t burst = *config;
+    burst.extfrag_threshold = 1000;
+    churn_workload(&burst, "cma/reclaim", config->total_pages / 2, config->max_order - 1, 100);
+    burst.extfrag_threshold = config->extfrag_threshold;
+    churn_workload(&burst, "cma/compact", config->total_pages / 2, config->max_order - 1, 100);
+    burst.cma_order = config->max_order - 1;
+    churn_workload(&burst, "cma/reserved", config->total_pages / 2, config->max_order - 1, 100);
+}
+
+// slab_comparison runs the small object workload with half as many objects
+// live as memory has pages, a page each and then from slab caches
+static void slab_comparison(bench_config_t *config) {
+    slab_workload(config, "objects/pages", config->total_pages / 2, 0);
+    slab_workload(config, "objects/slab", config->total_pages / 2, 1);
+}
+
+// sparse_comparison runs the sparse workload over twice as many order 3
+// blocks as memory holds, evicting blocks whole and then partially
+static void sparse_comparison(bench_config_t *config) {
+    bench_config_t sparse = *config;
+    int nr_seqs = 2 * (config->total_pages >> 3);
+    sparse.partial_eviction = 0;
+    sparse_workload(&sparse, "sparse/whole", nr_seqs, 3);
+    sparse.partial_eviction = 1;
+    sparse_workload(&sparse, "sparse/partial", nr_seqs, 3);
+}
+
+// readahead_comparison runs scans over twice as many blocks as the lru
+// lists hold, without and with readahead, under every replacement policy
+static void readahead_comparison(bench_config_t *config) {
+    bench_config_t scan = *config;
+    for (int i = 0; i < NR_POLICIES; i++) {
+        char name[32];
+        scan.policy = i;
+        scan.readahead = 0;
+        snprintf(name, sizeof(name), "scan/%s", replacement_policy_name(i));
+        scan_workload(&scan, name, 2 * MAX_LRU_ENTRIES, 7);
+        scan.readahead = 8;
+        snprintf(name, sizeof(name), "scan-ra/%s", replacement_policy_name(i));
+        scan_workload(&scan, name, 2 * MAX_LRU_ENTRIES, 7);
+    }
+}
+
+// churn_history takes allocator through nr_ops steps of churn over about
+// live_target blocks, more than memory holds, each step allocating or
+// freeing a block and accessing a random live one
+static void churn_history(bench_config_t *config, buddy_allocator_t *allocator, unsigned long long nr_ops, int live_target) {
+    unsigned long long state = 0xD1B54A32D192ED03ULL;
+    long long *live = (long long*)malloc(live_target * sizeof(long long));
+    int nr_live = 0;
+    long long next_seq_no = 0;
+
+    for (unsigned long long i = 0; i < nr_ops; i++) {
+        if (nr_live < live_target && (nr_live == 0 || next_random(&state) % 2 == 0)) {
+            live[nr_live] = next_seq_no++;
+            allocate_pages(allocator, live[nr_live++], 1 << draw_order(config, &state));
+        } else {
+            int victim = (int)(next_random(&state) % nr_live);
+            free_pages(allocator, live[victim]);
+            live[victim] = live[--nr_live];
+        }
+        if (nr_live > 0)
+            access_pages(allocator, live[next_random(&state) % nr_live]);
+    }
+    free(live);
+}
+
+// checkpoint_comparison builds up allocator state over histories of growing
+// length, then times getting it back after a restart by replaying the
+// history, and by loading a checkpoint saved to path
+static void checkpoint_comparison(bench_config_t *config, const char *path) {
+    for (unsigned long long nr_ops = config->nr_ops / 100; nr_ops <= config->nr_ops; nr_ops *= 10) {
+        char name[32];
+        snprintf(name, sizeof(name), "restart/%llu", nr_ops);
+        buddy_allocator_t *allocator = new_bench_allocator(config);
+        unsigned long long start = now_ns();
+        churn_history(config, allocator, nr_ops, 2 * MAX_LRU_ENTRIES);
+        unsigned long long replay_ns = now_ns() - start;
+        stop_kswapd(allocator);
+
+        start = now_ns();
+        if (save_allocator(allocator, path) != 0) {
+            fprintf(stderr, "Cannot save a checkpoint to %s\n", path);
+            destroy_buddy_allocator(allocator);
+            return;
+        }
+        unsigned long long save_ns = now_ns() - start;
+        start = now_ns();
+        buddy_allocator_t *restored = load_allocator(path);
+        unsigned long long load_ns = now_ns() - start;
+        struct stat st;
+        stat(path, &st);
+        unlink(path);
+
+        printf("%-16s %-14s %10llu %9.3fms\n", name, "replay", nr_ops, replay_ns / 1e6);
+        printf("%-16s %-14s %10lld %9.3fms\n", name, "save(bytes)", (long long)st.st_size, save_ns / 1e6);
+        printf("%-16s %-14s %10lld %9.3fms%s\n", name, "load(bytes)", (long long)st.st_size, load_ns / 1e6,
+               restored == NULL ? " failed" : "");
+        destroy_buddy_allocator(allocator);
+        if (restored != NULL)
+            destroy_buddy_allocator(restored);
+    }
+}
+
+// policy_comparison runs the zipf and oversized working set workloads under
+// every replacement policy
+static void policy_comparison(bench_config_t *config) {
+    replacement_policy_t policy = config->policy;
+    for (int i = 0; i < NR_POLICIES; i++) {
+        char name[32];
+        config->policy = i;
+        snprintf(name, sizeof(name), "zipf/%s", replacement_policy_name(i));
+        access_workload(config, name, 4 * MAX_LRU_ENTRIES, 1.0);
+        snprintf(name, sizeof(name), "bigws/%s", replacement_policy_name(i));
+        access_workload(config, name, 4 * MAX_LRU_ENTRIES, 0);
+    }
+    config->policy = policy;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-n ops] [-p pages] [-o max_order] [-t max_threads] [-m w0,w1,...] [-r policy] [-d high] [-c index] [-s swapfile] [-k checkpoint] [-w workload]\n", prog);
+    fprintf(stderr, "  -m  relative weight of each order for allocations, default 8,4,2,1\n");
+    fprintf(stderr, "  -r  replacement policy: lru (default), lru-workingset, clock, clock-pro or arc\n");
+    fprintf(stderr, "  -d  deferred coalescing, up to high unmerged blocks per order (default off)\n");
+    fprintf(stderr, "  -c  compact above this fragmentation index, default 500, 1000 for never\n");
+    fprintf(stderr, "  -s  swap file for the swap workload, default ./bench.swap\n");
+    fprintf(stderr, "  -k  checkpoint file for the restart workload, default ./bench.ckpt\n");
+    fprintf(stderr, "  -w  uniform, zipf, churn, burst, bigws, reclaim, coalesce, compact, swap, sparse, readahead, cma, slab, batch, restart, policies, threads, stress or all (default)\n");
+}
+
+int main(int argc, char **argv) {
+    bench_config_t config;
+    memset(&config, 0, sizeof(config));
+    config.nr_ops = 1000000;
+    config.total_pages = TOTAL_PAGES;
+    config.max_order = MAX_ORDER;
+    config.max_threads = 4;
+    config.extfrag_threshold = EXTFRAG_THRESHOLD;
+    config.order_mix[0] = 8;
+    config.order_mix[1] = 4;
+    config.order_mix[2] = 2;
+    config.order_mix[3] = 1;
+    const char *workload = "all";
+    const char *swap_path = "bench.swap";
+    const char *checkpoint_path = "bench.ckpt";
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:p:o:t:m:r:d:c:s:k:w:")) != -1) {
+        switch (opt) {
+            case 'n': config.nr_ops = strtoull(optarg, NULL, 10); break;
+            case 'p': config.total_pages = atoi(optarg); break;
+            case 'o': config.max_order = atoi(optarg); break;
+            case 't': config.max_threads = atoi(optarg); break;
+            case 'w': workload = optarg; break;
+            case 'd': config.deferred_high = atoi(optarg); break;
+            case 'c': config.extfrag_threshold = atoi(optarg); break;
+            case 's': swap_path = optarg; break;
+            case 'k': checkpoint_path = optarg; break;
+            case 'r': {
+                int policy = find_replacement_policy(optarg);
+                if (policy < 0) {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                config.policy = policy;
+                break;
+            }
+            case 'm': {
+                memset(config.order_mix, 0, sizeof(config.order_mix));
+                char *weight = strtok(optarg, ",");
+                for (int i = 0; weight != NULL && i <= MAX_ORDER_LIMIT; i++, weight = strtok(NULL, ","))
+                    config.order_mix[i] = atof(weight);
+                break;
+            }
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (config.max_order < 0 || config.max_order > MAX_ORDER_LIMIT || config.total_pages < (1 << config.max_order)) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    log_enabled = 0;
+    int all = strcmp(workload, "all") == 0;
+
+    printf("%-16s %-14s %10s %10s %8s %8s %8s %10s\n", "workload", "op", "count", "Mops/s", "p50(ns)", "p99(ns)", "p999(ns)", "max(ns)");
+    // working sets within what the lru lists hold
+    if (all || strcmp(workload, "uniform") == 0)
+        access_workload(&config, "uniform", MAX_LRU_ENTRIES, 0);
+    if (all || strcmp(workload, "zipf") == 0)
+        access_workload(&config, "zipf", MAX_LRU_ENTRIES, 1.0);
+    if (all || strcmp(workload, "churn") == 0)
+        churn_workload(&config, "churn", MAX_LRU_ENTRIES / 2, 0, 0);
+    if (all || strcmp(workload, "burst") == 0)
+        churn_workload(&config, "burst", MAX_LRU_ENTRIES / 2, config.max_order - 1, 1000);
+    // four times more blocks than the lru lists hold, so accesses fault
+    if (all || strcmp(workload, "bigws") == 0)
+        access_workload(&config, "bigws", 4 * MAX_LRU_ENTRIES, 0);
+    if (all || strcmp(workload, "reclaim") == 0)
+        reclaim_comparison(&config);
+    if (all || strcmp(workload, "coalesce") == 0)
+        coalesce_comparison(&config);
+    if (all || strcmp(workload, "compact") == 0)
+        compaction_comparison(&config);
+    if (all || strcmp(workload, "swap") == 0)
+        swap_comparison(&config, swap_path);
+    if (all || strcmp(workload, "sparse") == 0)
+        sparse_comparison(&config);
+    if (all || strcmp(workload, "readahead") == 0)
+        readahead_comparison(&config);
+    if (all || strcmp(workload, "cma") == 0)
+        cma_comparison(&config);
+    if (all || strcmp(workload, "slab") == 0)
+        slab_comparison(&config);
+    if (all || strcmp(workload, "batch") == 0)
+        batch_comparison(&config);
+    if (all || strcmp(workload, "restart") == 0)
+        checkpoint_comparison(&config, checkpoint_path);
+    if (all || strcmp(workload, "policies") == 0)
+        policy_comparison(&config);
+    if (all || strcmp(workload, "threads") == 0)
+        thread_scaling(&config);
+    if ((all || strcmp(workload, "stress") == 0) && lf_stress(&config) != 0)
+        return EXIT_FAILURE;
+
+    return EXIT_SUCCESS;
+}
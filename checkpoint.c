@@ -0,0 +1,472 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "allocator.h"
+
+// A checkpoint holds an allocator's whole state, so that a restarted process
+// can pick up where the last one left off without replaying its history.
+// After a checkpoint_header come, in host byte order:
+// - a checkpoint_config with the settings and counters,
+// - the splits and merges of each order, max_order + 1 of each,
+// - each free list, then each deferred list, then each free list of the
+//   reserved region: its number of blocks, then their addresses head to tail,
+// - a checkpoint_entry per seq_no, followed for a split block by the address
+//   of each of its pages in memory, -1 for those evicted,
+// - the flags of every page,
+// - the replacement policy's state, see replacement_policy_ops.save.
+// Loading maps the file and rebuilds the allocator in one pass over it, so
+// it takes time in proportion to the checkpoint, not to the history.
+//
+// Blocks have no contents without swap; an allocator with swap keeps them
+// in memory and in a swap file that don't outlive it, and can't be saved.
+
+#define CHECKPOINT_MAGIC "BCKP"
+#define CHECKPOINT_VERSION 4
+
+typedef struct checkpoint_header {
+    char magic[4];
+    uint32_t version;
+    uint64_t length; // bytes after the header
+    uint64_t checksum; // FNV-1a of those bytes
+} checkpoint_header_t;
+
+typedef struct checkpoint_config {
+    int32_t total_pages;
+    int32_t max_order;
+    int32_t concurrency;
+    int32_t policy;
+    int32_t lru_entries;
+    int32_t deferred_high;
+    int32_t extfrag_threshold;
+    int32_t cma_order; // -1 without a reserved region
+    int32_t cma_min_order;
+    int32_t partial_eviction;
+    int32_t idle_hand;
+    int32_t readahead_max;
+    int32_t readahead_window;
+    int32_t readahead_predicted;
+    int32_t watermark[NR_WMARK];
+    int64_t readahead_history[2];
+    uint32_t stats_size; // sizeof(allocator_stats_t) when saved
+    uint64_t nr_entries;
+    allocator_stats_t stats; // without its per-order arrays
+} checkpoint_config_t;
+
+#define CKPT_EVICTED 0x1 // address and order are those of the evicted record
+#define CKPT_SPARSE 0x2 // page addresses follow
+#define CKPT_READAHEAD 0x4
+
+typedef struct checkpoint_entry {
+    int64_t seq_no;
+    int64_t next_fault;
+    uint64_t shadow;
+    int32_t address; // of the block in memory, of a page still in memory if split
+    int32_t order; // of the block, before it was split if it was
+    uint32_t flags; // CKPT_ bits
+    uint32_t pad;
+} checkpoint_entry_t;
+
+typedef struct checkpoint_node {
+    int64_t seq_no;
+    uint32_t flags;
+    uint32_t pad;
+} checkpoint_node_t;
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+static uint64_t _checksum(uint64_t checksum, const void *data, size_t size) {
+    const unsigned char *bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < size; i++)
+        checksum = (checksum ^ bytes[i]) * FNV_PRIME;
+    return checksum;
+}
+
+void checkpoint_write(checkpoint_t *checkpoint, const void *data, size_t size) {
+    fwrite(data, size, 1, checkpoint->out);
+    checkpoint->checksum = _checksum(checkpoint->checksum, data, size);
+    checkpoint->length += size;
+}
+
+// checkpoint_read copies the next size bytes to data. Returns -1 if the
+// checkpoint ends before.
+int checkpoint_read(checkpoint_t *checkpoint, void *data, size_t size) {
+    if ((size_t)(checkpoint->end - checkpoint->next) < size)
+        return -1;
+    memcpy(data, checkpoint->next, size);
+    checkpoint->next += size;
+    checkpoint->length += size;
+    return 0;
+}
+
+// checkpoint_write_node writes which seq_no node tracks and its flags
+void checkpoint_write_node(checkpoint_t *checkpoint, lru_node_t *node) {
+    checkpoint_node_t record = { node->block->seq_no, node->flags, 0 };
+    checkpoint_write(checkpoint, &record, sizeof(record));
+}
+
+// checkpoint_read_node reads back a node written by checkpoint_write_node,
+// pointing at its seq_no's block in memory, or at the evicted record for a
+// ghost. The policy links it in. Returns NULL if the seq_no is not restored
+// or already has a node.
+lru_node_t *checkpoint_read_node(checkpoint_t *checkpoint, lru_cache_t *owner) {
+    checkpoint_node_t record;
+    if (checkpoint_read(checkpoint, &record, sizeof(record)) != 0)
+        return NULL;
+    seq_entry_t *entry = seq_map_find(checkpoint->allocator->seq_map, record.seq_no);
+    if (entry == NULL || entry->lru_node != NULL)
+        return NULL;
+
+    lru_node_t *node = (lru_node_t*)pool_alloc(checkpoint->allocator->lru_node_pool);
+    node->prev = NULL;
+    node->next = NULL;
+    node->owner = owner;
+    node->block = entry->allocated_block != NULL ? entry->allocated_block : entry->evicted_block;
+    node->flags = record.flags;
+    entry->lru_node = node;
+    return node;
+}
+
+static void _save_list(checkpoint_t *checkpoint, free_list_t *list) {
+    uint32_t nr_blocks = list->size;
+    checkpoint_write(checkpoint, &nr_blocks, sizeof(nr_blocks));
+    for (block_descriptor_t *block = list->head; block != NULL; block = block->next) {
+        int32_t address = block->first_page_address;
+        checkpoint_write(checkpoint, &address, sizeof(address));
+    }
+}
+
+static void _save_entry(checkpoint_t *checkpoint, seq_entry_t *entry) {
+    checkpoint_entry_t record = { entry->seq_no, entry->next_fault, entry->shadow, 0, 0, 0, 0 };
+    block_descriptor_t *block = entry->allocated_block;
+    if (block == NULL) {
+        block = entry->evicted_block;
+        record.flags |= CKPT_EVICTED;
+    }
+    record.address = block->first_page_address;
+    record.order = entry->sparse != NULL ? entry->sparse->order : block->order;
+    if (entry->sparse != NULL)
+        record.flags |= CKPT_SPARSE;
+    if (entry->readahead)
+        record.flags |= CKPT_READAHEAD;
+    checkpoint_write(checkpoint, &record, sizeof(record));
+
+    if (entry->sparse == NULL)
+        return;
+    for (int i = 0; i < 1 << entry->sparse->order; i++) {
+        int32_t address = entry->sparse->pages[i] != NULL ? entry->sparse->pages[i]->first_page_address : -1;
+        checkpoint_write(checkpoint, &address, sizeof(address));
+    }
+}
+
+static void _save_sections(buddy_allocator_t *allocator, checkpoint_t *checkpoint) {
+    checkpoint_config_t config;
+    memset(&config, 0, sizeof(config));
+    config.total_pages = allocator->total_pages;
+    config.max_order = allocator->max_order;
+    config.concurrency = allocator->concurrency;
+    config.policy = find_replacement_policy(allocator->policy_ops->name);
+    config.lru_entries = allocator->lru_entries;
+    config.deferred_high = allocator->deferred_high;
+    config.extfrag_threshold = allocator->extfrag_threshold;
+    config.cma_order = allocator->cma_order;
+    config.cma_min_order = allocator->cma_min_order;
+    config.partial_eviction = allocator->partial_eviction;
+    config.idle_hand = allocator->idle_hand;
+    config.readahead_max = allocator->readahead_max;
+    config.readahead_window = allocator->readahead_window;
+    config.readahead_predicted = allocator->readahead_predicted;
+    memcpy(config.watermark, allocator->watermark, sizeof(config.watermark));
+    config.readahead_history[0] = allocator->readahead_history[0];
+    config.readahead_history[1] = allocator->readahead_history[1];
+    config.stats_size = sizeof(allocator_stats_t);
+    config.nr_entries = seq_map_count(allocator->seq_map);
+    // get_allocator_stats would take the allocator lock again, what it adds
+    // is restored from the rest anyway
+    config.stats = allocator->stats;
+    config.stats.splits = NULL;
+    config.stats.merges = NULL;
+    checkpoint_write(checkpoint, &config, sizeof(config));
+    checkpoint_write(checkpoint, allocator->stats.splits, (allocator->max_order + 1) * sizeof(unsigned long long));
+    checkpoint_write(checkpoint, allocator->stats.merges, (allocator->max_order + 1) * sizeof(unsigned long long));
+
+    for (int i = 0; i <= allocator->max_order; i++)
+        _save_list(checkpoint, allocator->free_list[i]);
+    for (int i = 0; i <= DEFERRED_MAX_ORDER; i++)
+        _save_list(checkpoint, allocator->deferred[i]);
+    for (int i = 0; i <= allocator->cma_order; i++)
+        _save_list(checkpoint, allocator->cma_free_list[i]);
+
+    size_t cursor = 0;
+    seq_entry_t *entry;
+    while ((entry = seq_map_next(allocator->seq_map, &cursor)) != NULL)
+        _save_entry(checkpoint, entry);
+
+    for (int i = 0; i < allocator->total_pages; i++) {
+        uint8_t flags = allocator->pages[i].flags;
+        checkpoint_write(checkpoint, &flags, sizeof(flags));
+    }
+    allocator->policy_ops->save(allocator->policy, checkpoint);
+}
+
+// save_allocator writes the state of allocator to a checkpoint at path,
+// through a temporary file renamed over it once complete. A concurrent
+// allocator must not be used by other threads meanwhile, kswapd may run.
+// Returns -1 for an allocator with swap, lock-free free lists or slabs, or
+// if the file can't be written.
+int save_allocator(buddy_allocator_t *allocator, const char *path) {
+    if (allocator->swap != NULL || allocator->concurrency == CONCURRENT_LOCK_FREE || slab_pages(allocator) != 0)
+        return -1;
+
+    char *tmp_path = (char*)malloc(strlen(path) + 5);
+    sprintf(tmp_path, "%s.tmp", path);
+    FILE *out = fopen(tmp_path, "wb");
+    if (out == NULL) {
+        free(tmp_path);
+        return -1;
+    }
+
+    // the checksum is patched in once everything else is written
+    checkpoint_header_t header;
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.version = CHECKPOINT_VERSION;
+    header.length = 0;
+    header.checksum = 0;
+    fwrite(&header, sizeof(header), 1, out);
+
+    checkpoint_t checkpoint = { allocator, out, NULL, NULL, 0, FNV_OFFSET_BASIS };
+    _lock_lru(allocator);
+    // the counters are saved before the policy, which would drain its hits
+    _drain_policy(allocator);
+    if (allocator->concurrency == CONCURRENT_PCP) {
+        // blocks in the threads' caches go back to the free lists
+        drain_all_pcp(allocator);
+        pthread_mutex_lock(&allocator->lock);
+    }
+    _save_sections(allocator, &checkpoint);
+    if (allocator->concurrency == CONCURRENT_PCP)
+        pthread_mutex_unlock(&allocator->lock);
+    _unlock_lru(allocator);
+
+    header.length = checkpoint.length;
+    header.checksum = checkpoint.checksum;
+    fseek(out, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, out);
+    int failed = ferror(out);
+    if (fclose(out) != 0 || failed || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        free(tmp_path);
+        return -1;
+    }
+    free(tmp_path);
+    return 0;
+}
+
+// _claim_pages marks the pages of a block restored at address as taken in
+// owned. Returns -1 if the block is out of the arena or overlaps another.
+static int _claim_pages(buddy_allocator_t *allocator, char *owned, int address, int order) {
+    if (order < 0 || order > allocator->max_order || address < 0 ||
+        (address & ((1 << order) - 1)) != 0 || address + (1 << order) > allocator->total_pages)
+        return -1;
+    for (int i = address; i < address + (1 << order); i++) {
+        if (owned[i])
+            return -1;
+        owned[i] = 1;
+    }
+    return 0;
+}
+
+// _load_list restores the free blocks of list, which holds those in the
+// reserved region if reserved is set, the others otherwise
+static int _load_list(checkpoint_t *checkpoint, char *owned, free_list_t *list, int reserved) {
+    buddy_allocator_t *allocator = checkpoint->allocator;
+    uint32_t nr_blocks;
+    if (checkpoint_read(checkpoint, &nr_blocks, sizeof(nr_blocks)) != 0)
+        return -1;
+    for (uint32_t i = 0; i < nr_blocks; i++) {
+        int32_t address;
+        if (checkpoint_read(checkpoint, &address, sizeof(address)) != 0 ||
+            _claim_pages(allocator, owned, address, list->order) != 0 ||
+            in_cma_region(allocator, address) != reserved)
+            return -1;
+        push_back(list, init_block_descriptor(&allocator->pages[address], list->order, address));
+    }
+    return 0;
+}
+
+// _load_sparse restores the pages of a split block, entry->allocated_block
+// being whichever the checkpoint named
+static int _load_sparse(checkpoint_t *checkpoint, char *owned, seq_entry_t *entry, int order, int address) {
+    buddy_allocator_t *allocator = checkpoint->allocator;
+    sparse_block_t *sparse = _new_sparse_block(order);
+    entry->sparse = sparse;
+    for (int i = 0; i < 1 << order; i++) {
+        int32_t page;
+        if (checkpoint_read(checkpoint, &page, sizeof(page)) != 0)
+            return -1;
+        if (page < 0)
+            continue;
+        if (_claim_pages(allocator, owned, page, 0) != 0)
+            return -1;
+        sparse->pages[i] = init_block_descriptor(&allocator->pages[page], 0, page);
+        sparse->pages[i]->seq_no = entry->seq_no;
+        sparse->nr_resident++;
+        if (page == address && entry->allocated_block == NULL)
+            entry->allocated_block = sparse->pages[i];
+    }
+    // an evicted split block keeps no pages, one in memory at least the one named
+    if ((entry->evicted_block != NULL) != (sparse->nr_resident == 0) ||
+        (entry->evicted_block == NULL && entry->allocated_block == NULL))
+        return -1;
+    return 0;
+}
+
+static int _load_entry(checkpoint_t *checkpoint, char *owned) {
+    buddy_allocator_t *allocator = checkpoint->allocator;
+    checkpoint_entry_t record;
+    if (checkpoint_read(checkpoint, &record, sizeof(record)) != 0 || record.seq_no < 0 ||
+        record.order < 0 || record.order > allocator->max_order ||
+        seq_map_find(allocator->seq_map, record.seq_no) != NULL)
+        return -1;
+
+    seq_entry_t *entry = seq_map_insert(allocator->seq_map, record.seq_no);
+    entry->next_fault = record.next_fault;
+    entry->shadow = record.shadow;
+    entry->readahead = (record.flags & CKPT_READAHEAD) != 0;
+    if (record.flags & CKPT_EVICTED) {
+        entry->evicted_block = (block_descriptor_t*)pool_alloc(allocator->evicted_block_pool);
+        init_block_descriptor(entry->evicted_block, record.order, record.address);
+        entry->evicted_block->seq_no = record.seq_no;
+    }
+    if (record.flags & CKPT_SPARSE)
+        return _load_sparse(checkpoint, owned, entry, record.order, record.address);
+    if (record.flags & CKPT_EVICTED)
+        return 0;
+
+    if (_claim_pages(allocator, owned, record.address, record.order) != 0)
+        return -1;
+    entry->allocated_block = init_block_descriptor(&allocator->pages[record.address], record.order, record.address);
+    entry->allocated_block->seq_no = record.seq_no;
+    return 0;
+}
+
+// _load_sections rebuilds an allocator from the sections after the header.
+// Returns NULL if they don't describe a consistent allocator, with whatever
+// was restored freed.
+static buddy_allocator_t *_load_sections(checkpoint_t *checkpoint) {
+    checkpoint_config_t config;
+    if (checkpoint_read(checkpoint, &config, sizeof(config)) != 0 ||
+        config.stats_size != sizeof(allocator_stats_t) || config.total_pages <= 0 ||
+        config.max_order < 0 || config.max_order > MAX_ORDER_LIMIT ||
+        config.policy < 0 || config.policy >= NR_POLICIES || config.lru_entries <= 0 ||
+        (config.concurrency != SINGLE_THREADED && config.concurrency != CONCURRENT_PCP))
+        return NULL;
+
+    buddy_allocator_t *allocator = config.concurrency == CONCURRENT_PCP
+        ? new_concurrent_buddy_allocator(config.total_pages, config.max_order)
+        : new_buddy_allocator(config.total_pages, config.max_order);
+    checkpoint->allocator = allocator;
+    allocator->lru_entries = config.lru_entries;
+    set_replacement_policy(allocator, config.policy);
+    allocator->deferred_high = config.deferred_high;
+    allocator->extfrag_threshold = config.extfrag_threshold;
+    if (config.cma_order >= 0 && set_cma_region(allocator, config.cma_order, config.cma_min_order) != 0)
+        goto fail;
+    allocator->partial_eviction = config.partial_eviction;
+    allocator->idle_hand = config.idle_hand;
+    allocator->readahead_max = config.readahead_max;
+    allocator->readahead_window = config.readahead_window;
+    allocator->readahead_predicted = config.readahead_predicted;
+    allocator->readahead_history[0] = config.readahead_history[0];
+    allocator->readahead_history[1] = config.readahead_history[1];
+    set_watermarks(allocator, config.watermark[WMARK_MIN], config.watermark[WMARK_LOW], config.watermark[WMARK_HIGH]);
+    unsigned long long *splits = allocator->stats.splits;
+    unsigned long long *merges = allocator->stats.merges;
+    allocator->stats = config.stats;
+    allocator->stats.splits = splits;
+    allocator->stats.merges = merges;
+    allocator->stats.free_blocks = NULL;
+    if (checkpoint_read(checkpoint, splits, (allocator->max_order + 1) * sizeof(unsigned long long)) != 0 ||
+        checkpoint_read(checkpoint, merges, (allocator->max_order + 1) * sizeof(unsigned long long)) != 0)
+        goto fail;
+
+    // the arena is laid out anew, every page is claimed by exactly one block
+    for (int i = 0; i <= allocator->max_order; i++)
+        while (remove_head(allocator->free_list[i]) != NULL)
+            ;
+    for (int i = 0; i <= allocator->cma_order; i++)
+        while (remove_head(allocator->cma_free_list[i]) != NULL)
+            ;
+    char *owned = (char*)calloc(allocator->total_pages, 1);
+    int failed = 0;
+    long nr_free_pages = 0;
+    for (int i = 0; i <= allocator->max_order && !failed; i++) {
+        failed = _load_list(checkpoint, owned, allocator->free_list[i], 0);
+        nr_free_pages += (long)allocator->free_list[i]->size << i;
+    }
+    for (int i = 0; i <= DEFERRED_MAX_ORDER && !failed; i++) {
+        failed = _load_list(checkpoint, owned, allocator->deferred[i], 0);
+        nr_free_pages += (long)allocator->deferred[i]->size << i;
+    }
+    for (int i = 0; i <= allocator->cma_order && !failed; i++) {
+        failed = _load_list(checkpoint, owned, allocator->cma_free_list[i], 1);
+        nr_free_pages += (long)allocator->cma_free_list[i]->size << i;
+    }
+    for (uint64_t i = 0; i < config.nr_entries && !failed; i++)
+        failed = _load_entry(checkpoint, owned);
+    for (int i = 0; i < allocator->total_pages && !failed; i++) {
+        uint8_t flags;
+        failed = !owned[i] || checkpoint_read(checkpoint, &flags, sizeof(flags)) != 0;
+        if (!failed)
+            allocator->pages[i].flags = flags;
+    }
+    free(owned);
+    if (failed || allocator->policy_ops->load(allocator->policy, checkpoint) != 0 || checkpoint->next != checkpoint->end)
+        goto fail;
+    allocator->nr_free_pages = nr_free_pages;
+    return allocator;
+
+fail:
+    destroy_buddy_allocator(allocator);
+    return NULL;
+}
+
+// load_allocator creates an allocator in the state saved to the checkpoint
+// at path, single-threaded or CONCURRENT_PCP as it was, without kswapd.
+// Returns NULL if the file can't be mapped, is not a checkpoint of this
+// version or fails its checksum.
+buddy_allocator_t *load_allocator(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(checkpoint_header_t)) {
+        close(fd);
+        return NULL;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+    // read once front to back, for the checksum and again to rebuild
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    const checkpoint_header_t *header = (const checkpoint_header_t*)map;
+    const unsigned char *sections = (const unsigned char*)map + sizeof(checkpoint_header_t);
+    buddy_allocator_t *allocator = NULL;
+    if (memcmp(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic)) == 0 &&
+        header->version == CHECKPOINT_VERSION &&
+        sizeof(checkpoint_header_t) + header->length == (size_t)st.st_size &&
+        _checksum(FNV_OFFSET_BASIS, sections, header->length) == header->checksum) {
+        checkpoint_t checkpoint = { NULL, NULL, sections, sections + header->length, 0, 0 };
+        allocator = _load_sections(&checkpoint);
+    }
+    munmap(map, st.st_size);
+    return allocator;
+}
@@ -0,0 +1,463 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "allocator.h"
+
+#define CLOCK_REFERENCED 0x1
+
+// clock_policy is second chance replacement: the ring is an lru_cache_t whose
+// rear is under the hand. A hit only sets the referenced bit; the hand clears
+// it and rotates the block to the front instead of evicting it.
+typedef struct clock_policy {
+    buddy_allocator_t *allocator;
+    lru_cache_t *ring;
+    unsigned nr_referenced;
+} clock_policy_t;
+
+static void *_clock_create(buddy_allocator_t *allocator, unsigned capacity) {
+    clock_policy_t *clock = (clock_policy_t*)malloc(sizeof(clock_policy_t));
+    clock->allocator = allocator;
+    clock->ring = new_lru_cache(capacity, allocator->lru_node_pool, allocator->seq_map);
+    clock->nr_referenced = 0;
+    return clock;
+}
+
+static void _clock_destroy(void *policy) {
+    clock_policy_t *clock = (clock_policy_t*)policy;
+    free(clock->ring);
+    free(clock);
+}
+
+static block_descriptor_t *_clock_select(clock_policy_t *clock) {
+    while (clock->ring->rear->flags & CLOCK_REFERENCED) {
+        clock->ring->rear->flags &= ~CLOCK_REFERENCED;
+        clock->nr_referenced--;
+        lru_rotate(clock->ring);
+    }
+
+    lru_node_t *node = lru_evict(clock->ring);
+    block_descriptor_t *victim = node->block;
+    free_lru_node(clock->ring, node);
+    return victim;
+}
+
+static block_descriptor_t *_clock_admit(void *policy, seq_entry_t *entry, int refault) {
+    clock_policy_t *clock = (clock_policy_t*)policy;
+    if (entry->lru_node != NULL)
+        return NULL;
+
+    block_descriptor_t *victim = NULL;
+    if (is_lru_cache_full(clock->ring))
+        victim = _clock_select(clock);
+
+    lru_insert(clock->ring, entry->allocated_block);
+    // a swapped in block was just accessed
+    if (refault) {
+        entry->lru_node->flags |= CLOCK_REFERENCED;
+        clock->nr_referenced++;
+    }
+    return victim;
+}
+
+static void _clock_access(void *policy, seq_entry_t *entry) {
+    clock_policy_t *clock = (clock_policy_t*)policy;
+    lru_node_t *node = entry->lru_node;
+    if (node != NULL && !(node->flags & CLOCK_REFERENCED)) {
+        node->flags |= CLOCK_REFERENCED;
+        clock->nr_referenced++;
+    }
+}
+
+static block_descriptor_t *_clock_reclaim(void *policy) {
+    clock_policy_t *clock = (clock_policy_t*)policy;
+    if (is_lru_cache_empty(clock->ring))
+        return NULL;
+    return _clock_select(clock);
+}
+
+static void _clock_forget(void *policy, seq_entry_t *entry) {
+    clock_policy_t *clock = (clock_policy_t*)policy;
+    lru_node_t *node = lru_remove(clock->ring, entry->seq_no);
+    if (node == NULL)
+        return;
+    if (node->flags & CLOCK_REFERENCED)
+        clock->nr_referenced--;
+    free_lru_node(clock->ring, node);
+}
+
+static void _clock_sizes(void *policy, unsigned *active, unsigned *inactive) {
+    clock_policy_t *clock = (clock_policy_t*)policy;
+    *active = clock->nr_referenced;
+    *inactive = clock->ring->count - clock->nr_referenced;
+}
+
+static void _clock_dump(void *policy) {
+    clock_policy_t *clock = (clock_policy_t*)policy;
+    printf("[Clock ring, referenced %u]->", clock->nr_referenced);
+    dump_lru_cache(clock->ring);
+}
+
+static void _clock_save(void *policy, checkpoint_t *checkpoint) {
+    clock_policy_t *clock = (clock_policy_t*)policy;
+    save_lru_cache(clock->ring, checkpoint);
+}
+
+static int _clock_load(void *policy, checkpoint_t *checkpoint) {
+    clock_policy_t *clock = (clock_policy_t*)policy;
+    if (load_lru_cache(clock->ring, checkpoint) != 0)
+        return -1;
+    for (lru_node_t *node = clock->ring->front; node != NULL; node = node->next)
+        if (node->flags & CLOCK_REFERENCED)
+            clock->nr_referenced++;
+    return 0;
+}
+
+const replacement_policy_ops_t clock_policy_ops = {
+    .name = "clock",
+    .create = _clock_create,
+    .destroy = _clock_destroy,
+    .admit = _clock_admit,
+    .access = _clock_access,
+    .reclaim = _clock_reclaim,
+    .evicted = NULL,
+    .forget = _clock_forget,
+    .sizes = _clock_sizes,
+    .dump = _clock_dump,
+    .drain = NULL,
+    .save = _clock_save,
+    .load = _clock_load,
+};
+
+
+// CLOCK-Pro (Jiang, Chen, Zhang, USENIX ATC 2005) keeps hot and cold blocks
+// and recently evicted cold blocks on one circular list of lru_node_t. A new
+// block starts cold and in its test period; reused during the test period it
+// turns hot. Evicted cold blocks stay on the list until their test period
+// ends, and a refault before that grows the share of memory given to cold
+// blocks. Three hands sweep the list:
+// - hand_cold evicts unreferenced cold blocks and promotes reused ones,
+// - hand_hot demotes unreferenced hot blocks and ends test periods,
+// - hand_test ends test periods so that at most capacity evicted blocks are
+//   remembered.
+// The list head, where blocks are (re)inserted, is right behind hand_hot.
+#define CP_HOT 0x1
+#define CP_REFERENCED 0x2
+#define CP_TEST 0x4
+#define CP_RESIDENT 0x8
+
+typedef struct clock_pro {
+    buddy_allocator_t *allocator;
+    unsigned capacity; // resident blocks
+    unsigned cold_target; // resident cold blocks wanted, adapts within [1, capacity - 1]
+    unsigned nr_hot;
+    unsigned nr_cold; // resident cold blocks
+    unsigned nr_nonresident; // evicted cold blocks still in their test period
+    lru_node_t *hand_hot;
+    lru_node_t *hand_cold;
+    lru_node_t *hand_test;
+} clock_pro_t;
+
+static void *_cp_create(buddy_allocator_t *allocator, unsigned capacity) {
+    clock_pro_t *cp = (clock_pro_t*)calloc(1, sizeof(clock_pro_t));
+    cp->allocator = allocator;
+    cp->capacity = capacity;
+    cp->cold_target = capacity > 100 ? capacity / 100 : 1;
+    return cp;
+}
+
+static void _cp_destroy(void *policy) {
+    free(policy);
+}
+
+// _cp_link inserts node at the list head
+static void _cp_link(clock_pro_t *cp, lru_node_t *node) {
+    if (cp->hand_hot == NULL) {
+        node->prev = node;
+        node->next = node;
+        cp->hand_hot = node;
+        cp->hand_cold = node;
+        cp->hand_test = node;
+        return;
+    }
+    node->next = cp->hand_hot;
+    node->prev = cp->hand_hot->prev;
+    node->prev->next = node;
+    cp->hand_hot->prev = node;
+}
+
+// _cp_unlink takes node off the list, moving any hand on it to the next node
+static void _cp_unlink(clock_pro_t *cp, lru_node_t *node) {
+    if (node->next == node) {
+        cp->hand_hot = NULL;
+        cp->hand_cold = NULL;
+        cp->hand_test = NULL;
+        return;
+    }
+    if (cp->hand_hot == node)
+        cp->hand_hot = node->next;
+    if (cp->hand_cold == node)
+        cp->hand_cold = node->next;
+    if (cp->hand_test == node)
+        cp->hand_test = node->next;
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+}
+
+static void _cp_move_to_head(clock_pro_t *cp, lru_node_t *node) {
+    _cp_unlink(cp, node);
+    _cp_link(cp, node);
+}
+
+// _cp_drop removes node from the list and from its seq_map entry
+static void _cp_drop(clock_pro_t *cp, lru_node_t *node) {
+    _cp_unlink(cp, node);
+    seq_map_find(cp->allocator->seq_map, node->block->seq_no)->lru_node = NULL;
+    pool_free(cp->allocator->lru_node_pool, node);
+}
+
+static void _cp_end_test(clock_pro_t *cp, lru_node_t *node) {
+    node->flags &= ~CP_TEST;
+    if (node->flags & CP_RESIDENT)
+        return;
+    // an evicted block that did not come back in time
+    _cp_drop(cp, node);
+    cp->nr_nonresident--;
+    if (cp->cold_target > 1)
+        cp->cold_target--;
+}
+
+// _cp_run_hand_hot demotes the first unreferenced hot block it reaches,
+// ending the test periods of the cold blocks it passes
+static void _cp_run_hand_hot(clock_pro_t *cp) {
+    while (cp->nr_hot > 0) {
+        lru_node_t *node = cp->hand_hot;
+        cp->hand_hot = node->next;
+
+        if (!(node->flags & CP_HOT)) {
+            if (node->flags & CP_TEST)
+                _cp_end_test(cp, node);
+            continue;
+        }
+        if (node->flags & CP_REFERENCED) {
+            node->flags &= ~CP_REFERENCED;
+            continue;
+        }
+        node->flags &= ~CP_HOT;
+        cp->nr_hot--;
+        cp->nr_cold++;
+        count_event(cp->allocator, demotions);
+        return;
+    }
+}
+
+static void _cp_run_hand_test(clock_pro_t *cp) {
+    while (cp->nr_nonresident > cp->capacity) {
+        lru_node_t *node = cp->hand_test;
+        cp->hand_test = node->next;
+        if ((node->flags & (CP_HOT | CP_TEST)) == CP_TEST)
+            _cp_end_test(cp, node);
+    }
+}
+
+static void _cp_promote(clock_pro_t *cp, lru_node_t *node) {
+    node->flags = (node->flags & ~CP_TEST) | CP_HOT;
+    cp->nr_hot++;
+    count_event(cp->allocator, promotions);
+    _cp_move_to_head(cp, node);
+    if (cp->nr_hot > cp->capacity - cp->cold_target)
+        _cp_run_hand_hot(cp);
+}
+
+// _cp_run_hand_cold returns the next resident cold block to evict
+static block_descriptor_t *_cp_run_hand_cold(clock_pro_t *cp) {
+    for (;;) {
+        if (cp->nr_cold == 0)
+            _cp_run_hand_hot(cp);
+
+        lru_node_t *node = cp->hand_cold;
+        cp->hand_cold = node->next;
+        if ((node->flags & (CP_HOT | CP_RESIDENT)) != CP_RESIDENT)
+            continue;
+
+        if (node->flags & CP_REFERENCED) {
+            node->flags &= ~CP_REFERENCED;
+            if (node->flags & CP_TEST) {
+                cp->nr_cold--;
+                _cp_promote(cp, node);
+            } else {
+                node->flags |= CP_TEST;
+                _cp_move_to_head(cp, node);
+            }
+            continue;
+        }
+
+        block_descriptor_t *victim = node->block;
+        cp->nr_cold--;
+        if (node->flags & CP_TEST) {
+            // remembered until the test period ends, _cp_evicted points the
+            // node at the evicted record
+            node->flags &= ~CP_RESIDENT;
+            cp->nr_nonresident++;
+        } else {
+            _cp_drop(cp, node);
+        }
+        return victim;
+    }
+}
+
+static block_descriptor_t *_cp_admit(void *policy, seq_entry_t *entry, int refault) {
+    (void)refault; // a refault is told by the entry's non-resident node
+    clock_pro_t *cp = (clock_pro_t*)policy;
+    block_descriptor_t *victim = NULL;
+    if (cp->nr_hot + cp->nr_cold >= cp->capacity)
+        victim = _cp_run_hand_cold(cp);
+
+    // the hands may just have ended the test period of this block
+    lru_node_t *node = entry->lru_node;
+    if (node != NULL) {
+        // refault during the test period, more memory for cold blocks
+        if (cp->cold_target < cp->capacity - 1)
+            cp->cold_target++;
+        cp->nr_nonresident--;
+        node->block = entry->allocated_block;
+        node->flags = CP_RESIDENT;
+        _cp_promote(cp, node);
+        return victim;
+    }
+
+    node = (lru_node_t*)pool_alloc(cp->allocator->lru_node_pool);
+    node->block = entry->allocated_block;
+    node->owner = NULL;
+    node->flags = CP_RESIDENT | CP_TEST;
+    _cp_link(cp, node);
+    entry->lru_node = node;
+    cp->nr_cold++;
+    return victim;
+}
+
+static void _cp_access(void *policy, seq_entry_t *entry) {
+    (void)policy;
+    if (entry->lru_node != NULL)
+        entry->lru_node->flags |= CP_REFERENCED;
+}
+
+static block_descriptor_t *_cp_reclaim(void *policy) {
+    clock_pro_t *cp = (clock_pro_t*)policy;
+    if (cp->nr_hot + cp->nr_cold == 0)
+        return NULL;
+    return _cp_run_hand_cold(cp);
+}
+
+static void _cp_evicted(void *policy, seq_entry_t *entry) {
+    clock_pro_t *cp = (clock_pro_t*)policy;
+    lru_node_t *node = entry->lru_node;
+    if (node != NULL && !(node->flags & CP_RESIDENT))
+        node->block = entry->evicted_block;
+    _cp_run_hand_test(cp);
+}
+
+static void _cp_forget(void *policy, seq_entry_t *entry) {
+    clock_pro_t *cp = (clock_pro_t*)policy;
+    lru_node_t *node = entry->lru_node;
+    if (node == NULL)
+        return;
+
+    if (!(node->flags & CP_RESIDENT))
+        cp->nr_nonresident--;
+    else if (node->flags & CP_HOT)
+        cp->nr_hot--;
+    else
+        cp->nr_cold--;
+    _cp_unlink(cp, node);
+    pool_free(cp->allocator->lru_node_pool, node);
+    entry->lru_node = NULL;
+}
+
+static void _cp_sizes(void *policy, unsigned *active, unsigned *inactive) {
+    clock_pro_t *cp = (clock_pro_t*)policy;
+    *active = cp->nr_hot;
+    *inactive = cp->nr_cold;
+}
+
+static void _cp_dump(void *policy) {
+    clock_pro_t *cp = (clock_pro_t*)policy;
+    printf("[CLOCK-Pro, hot %u, cold %u, non-resident %u, cold target %u]->",
+           cp->nr_hot, cp->nr_cold, cp->nr_nonresident, cp->cold_target);
+
+    lru_node_t *node = cp->hand_hot;
+    while (node != NULL) {
+        const char *kind = !(node->flags & CP_RESIDENT) ? "non-resident" : (node->flags & CP_HOT) ? "hot" : "cold";
+        printf("[ seq_no: %lld, address %d, %s ]-> ", node->block->seq_no, node->block->first_page_address, kind);
+        node = node->next;
+        if (node == cp->hand_hot)
+            break;
+    }
+    printf("\n");
+}
+
+// _cp_save writes the nodes from hand_hot round, with where the other hands
+// are among them
+static void _cp_save(void *policy, checkpoint_t *checkpoint) {
+    clock_pro_t *cp = (clock_pro_t*)policy;
+    unsigned nr_nodes = cp->nr_hot + cp->nr_cold + cp->nr_nonresident;
+    unsigned hand_cold = 0, hand_test = 0;
+    lru_node_t *node = cp->hand_hot;
+    for (unsigned i = 0; i < nr_nodes; i++, node = node->next) {
+        if (node == cp->hand_cold)
+            hand_cold = i;
+        if (node == cp->hand_test)
+            hand_test = i;
+    }
+    checkpoint_write(checkpoint, &cp->cold_target, sizeof(cp->cold_target));
+    checkpoint_write(checkpoint, &nr_nodes, sizeof(nr_nodes));
+    checkpoint_write(checkpoint, &hand_cold, sizeof(hand_cold));
+    checkpoint_write(checkpoint, &hand_test, sizeof(hand_test));
+    for (unsigned i = 0; i < nr_nodes; i++, node = node->next)
+        checkpoint_write_node(checkpoint, node);
+}
+
+static int _cp_load(void *policy, checkpoint_t *checkpoint) {
+    clock_pro_t *cp = (clock_pro_t*)policy;
+    unsigned nr_nodes, hand_cold, hand_test;
+    if (checkpoint_read(checkpoint, &cp->cold_target, sizeof(cp->cold_target)) != 0 ||
+        checkpoint_read(checkpoint, &nr_nodes, sizeof(nr_nodes)) != 0 ||
+        checkpoint_read(checkpoint, &hand_cold, sizeof(hand_cold)) != 0 ||
+        checkpoint_read(checkpoint, &hand_test, sizeof(hand_test)) != 0 ||
+        cp->cold_target < 1 || cp->cold_target >= cp->capacity || nr_nodes > 2 * cp->capacity ||
+        (nr_nodes > 0 && (hand_cold >= nr_nodes || hand_test >= nr_nodes)))
+        return -1;
+
+    for (unsigned i = 0; i < nr_nodes; i++) {
+        lru_node_t *node = checkpoint_read_node(checkpoint, NULL);
+        if (node == NULL)
+            return -1;
+        // linked in behind hand_hot, which is the first one, in the order saved
+        _cp_link(cp, node);
+        if (!(node->flags & CP_RESIDENT))
+            cp->nr_nonresident++;
+        else if (node->flags & CP_HOT)
+            cp->nr_hot++;
+        else
+            cp->nr_cold++;
+        if (i == hand_cold)
+            cp->hand_cold = node;
+        if (i == hand_test)
+            cp->hand_test = node;
+    }
+    return cp->nr_hot + cp->nr_cold > cp->capacity ? -1 : 0;
+}
+
+const replacement_policy_ops_t clock_pro_policy_ops = {
+    .name = "clock-pro",
+    .create = _cp_create,
+    .destroy = _cp_destroy,
+    .admit = _cp_admit,
+    .access = _cp_access,
+    .reclaim = _cp_reclaim,
+    .evicted = _cp_evicted,
+    .forget = _cp_forget,
+    .sizes = _cp_sizes,
+    .dump = _cp_dump,
+    .drain = NULL,
+    .save = _cp_save,
+    .load = _cp_load,
+};
@@ -0,0 +1,169 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include "allocator.h"
+
+// The reserved region is one aligned block of memory set aside for
+// high-order allocations, like a Linux CMA area. Requests of cma_min_order
+// and above take from it before the rest of memory. Smaller ones only
+// borrow it once the rest of memory has no block for them, and only as
+// blocks tracked by a seq_no as a whole, so that when a high-order request
+// finds no free block, the borrowers of one range of the region are moved
+// out, or evicted if there is no room to move them to. That costs at most
+// the pages requested, where reclaim alone goes on until small blocks
+// freed by chance happen to merge into one large enough.
+
+// set_cma_region reserves the last aligned block of 2^order pages of an
+// allocator that holds no blocks yet for requests of min_order to order.
+// Returns -1 if blocks or slabs are held, a region is already reserved, the orders
+// don't fit the arena, or for a lock-free allocator, whose free lists
+// can't keep the region apart.
+int set_cma_region(buddy_allocator_t *allocator, int order, int min_order) {
+    if (seq_map_count(allocator->seq_map) != 0 || slab_pages(allocator) != 0 ||
+        allocator->concurrency == CONCURRENT_LOCK_FREE ||
+        allocator->cma_free_list != NULL || order < 0 || order > allocator->max_order ||
+        min_order < 0 || min_order > order || allocator->total_pages < 1 << order)
+        return -1;
+
+    if (allocator->concurrency == CONCURRENT_PCP)
+        drain_all_pcp(allocator);
+    coalesce_deferred(allocator);
+    if (allocator->concurrency == CONCURRENT_PCP)
+        pthread_mutex_lock(&allocator->lock);
+
+    // with nothing held every page is free, the arena is laid out anew
+    // around the region
+    for (int i = 0; i <= allocator->max_order; i++)
+        while (remove_head(allocator->free_list[i]) != NULL)
+            ;
+    allocator->cma_order = order;
+    allocator->cma_min_order = min_order;
+    allocator->cma_start = ((allocator->total_pages >> order) - 1) << order;
+    allocator->cma_end = allocator->cma_start + (1 << order);
+    allocator->cma_free_list = (free_list_t**)malloc((order + 1) * sizeof(free_list_t*));
+    for (int i = 0; i <= order; i++)
+        allocator->cma_free_list[i] = new_free_list(i, allocator->total_pages);
+    _seed_free_lists(allocator, allocator->free_list, allocator->max_order, 0, allocator->cma_start);
+    _seed_free_lists(allocator, allocator->free_list, allocator->max_order, allocator->cma_end, allocator->total_pages);
+    _seed_free_lists(allocator, allocator->cma_free_list, order, allocator->cma_start, allocator->cma_end);
+
+    if (allocator->concurrency == CONCURRENT_PCP)
+        pthread_mutex_unlock(&allocator->lock);
+    return 0;
+}
+
+// _range_cost returns the pages borrowed in the range of order starting at
+// start, or -1 if it holds a block that is neither free nor borrowed by a
+// seq_no as a whole: one held by a high-order request, being allocated, or
+// a page of a split block.
+static int _range_cost(buddy_allocator_t *allocator, int start, int order) {
+    int borrowed = 0;
+    for (int address = start; address < start + (1 << order); ) {
+        block_descriptor_t *block = &allocator->pages[address];
+        if (find_free_block(allocator->cma_free_list[block->order], address) == NULL) {
+            seq_entry_t *entry = block->seq_no < 0 ? NULL : seq_map_find(allocator->seq_map, block->seq_no);
+            if (entry == NULL || entry->allocated_block != block || entry->sparse != NULL ||
+                block->order >= allocator->cma_min_order)
+                return -1;
+            borrowed += 1 << block->order;
+        }
+        address += 1 << block->order;
+    }
+    return borrowed;
+}
+
+// _best_range returns the start of the range of order in the region with
+// the fewest pages borrowed, -1 if none can be emptied. Ranges are visited
+// from block to block, as _best_region does.
+static int _best_range(buddy_allocator_t *allocator, int order) {
+    int best = -1, best_cost = 0;
+    for (int start = allocator->cma_start; start < allocator->cma_end; ) {
+        int block_order = allocator->pages[start].order;
+        // a block spanning whole ranges is in use, the request failed
+        if (block_order >= order) {
+            start += 1 << block_order;
+            continue;
+        }
+
+        int cost = _range_cost(allocator, start, order);
+        if (cost >= 0 && (best < 0 || cost < best_cost)) {
+            best = start;
+            best_cost = cost;
+        }
+        start += 1 << order;
+    }
+    return best;
+}
+
+// _migrate_range moves the blocks borrowed in the range of order starting
+// at start out of the region, freeing their pages in it. Those with no room
+// left outside are put in victims. Returns how many were.
+static int _migrate_range(buddy_allocator_t *allocator, int start, int order, block_descriptor_t **victims) {
+    int nr_victims = 0;
+    for (int address = start; address < start + (1 << order); ) {
+        block_descriptor_t *block = &allocator->pages[address];
+        address += 1 << block->order;
+        // free, or merged since into a block freed before it
+        if (block->seq_no < 0)
+            continue;
+
+        block_descriptor_t *target = _allocate_unreserved_block(allocator, block->order);
+        if (target == NULL) {
+            victims[nr_victims++] = block;
+            continue;
+        }
+        _move_block(allocator, block, target);
+        _free_block(allocator, block);
+        count_event(allocator, cma_migrations);
+    }
+    return nr_victims;
+}
+
+// _has_cma_block tells whether the region has a free block of order
+static int _has_cma_block(buddy_allocator_t *allocator, int order) {
+    for (int i = order; i <= allocator->cma_order; i++)
+        if (allocator->cma_free_list[i]->size > 0)
+            return 1;
+    return 0;
+}
+
+// cma_evacuate empties a range of the reserved region for a request of
+// order that found no free block, moving its borrowed blocks out, or
+// evicting them when the rest of memory has no room for them. Those drop
+// out of the replacement policy as if freed, and come back as new blocks
+// if they fault. Called with lru_lock held. Returns 0 once the region has a
+// free block of order, -1 otherwise.
+int cma_evacuate(buddy_allocator_t *allocator, int order) {
+    if (allocator->cma_free_list == NULL || order < allocator->cma_min_order || order > allocator->cma_order)
+        return -1;
+
+    // blocks borrowed by the threads' caches go back first
+    if (allocator->concurrency == CONCURRENT_PCP) {
+        drain_all_pcp(allocator);
+        pthread_mutex_lock(&allocator->lock);
+    }
+    block_descriptor_t **victims = (block_descriptor_t**)malloc((1 << order) * sizeof(block_descriptor_t*));
+    int nr_victims = 0;
+    int start = _has_cma_block(allocator, order) ? -1 : _best_range(allocator, order);
+    if (start >= 0) {
+        count_event(allocator, cma_evacuations);
+        nr_victims = _migrate_range(allocator, start, order, victims);
+    }
+    if (allocator->concurrency == CONCURRENT_PCP)
+        pthread_mutex_unlock(&allocator->lock);
+
+    // evicting releases the pages, which takes the allocator lock
+    for (int i = 0; i < nr_victims; i++) {
+        seq_entry_t *entry = seq_map_find(allocator->seq_map, victims[i]->seq_no);
+        allocator->policy_ops->forget(allocator->policy, entry);
+        _evict_block(allocator, victims[i]);
+        count_event(allocator, cma_evictions);
+    }
+    free(victims);
+
+    if (allocator->concurrency == CONCURRENT_PCP)
+        pthread_mutex_lock(&allocator->lock);
+    int found = _has_cma_block(allocator, order);
+    if (allocator->concurrency == CONCURRENT_PCP)
+        pthread_mutex_unlock(&allocator->lock);
+    return found ? 0 : -1;
+}
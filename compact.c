@@ -0,0 +1,198 @@
+#include <string.h>
+#include <pthread.h>
+#include "allocator.h"
+
+// Compaction frees a whole aligned region of 2^order pages by moving the
+// blocks allocated inside it to free blocks elsewhere, like Linux's
+// migrate and free scanners but aimed at the one region that is cheapest
+// to empty. Moving a block repoints its seq_map entry and policy node, and
+// copies its pages if the allocator has backing memory.
+
+// _region_cost returns the pages allocated in the region of order starting at
+// start, or -1 if the region can't be emptied: it holds a block that is not
+// tracked by a seq_no as a whole (one in a pcp cache, deferred, being
+// allocated, or a page of a split block), or the free blocks outside it can't
+// take its allocated blocks. That is checked by placing them largest first,
+// splitting free blocks as _allocate_block would.
+static int _region_cost(buddy_allocator_t *allocator, int start, int order) {
+    int end = start + (1 << order);
+    int allocated = 0;
+    int moved[allocator->max_order + 1];
+    int free_outside[allocator->max_order + 1];
+    for (int i = 0; i <= allocator->max_order; i++) {
+        moved[i] = 0;
+        free_outside[i] = allocator->free_list[i]->size;
+    }
+
+    for (int address = start; address < end; ) {
+        block_descriptor_t *block = &allocator->pages[address];
+        if (find_free_block(allocator->free_list[block->order], address) != NULL) {
+            free_outside[block->order]--;
+        } else {
+            seq_entry_t *entry = block->seq_no < 0 ? NULL : seq_map_find(allocator->seq_map, block->seq_no);
+            if (entry == NULL || entry->allocated_block != block || entry->sparse != NULL)
+                return -1;
+            moved[block->order]++;
+            allocated += 1 << block->order;
+        }
+        address += 1 << block->order;
+    }
+
+    for (int i = order - 1; i >= 0; i--) {
+        for (; moved[i] > 0; moved[i]--) {
+            int j = i;
+            while (j <= allocator->max_order && free_outside[j] == 0)
+                j++;
+            if (j > allocator->max_order)
+                return -1;
+            free_outside[j]--;
+            for (j--; j >= i; j--)
+                free_outside[j]++;
+        }
+    }
+    return allocated;
+}
+
+// _best_region returns the start of the region of order with the fewest
+// allocated pages, -1 if none can be emptied. Regions are visited from block
+// to block, only the descriptor of a block's first page is up to date.
+static int _best_region(buddy_allocator_t *allocator, int order, int *cost) {
+    int best = -1;
+    for (int start = 0; start + (1 << order) <= allocator->total_pages; ) {
+        // the reserved region is emptied by cma_evacuate
+        if (start < allocator->cma_end && start + (1 << order) > allocator->cma_start) {
+            start += 1 << order;
+            continue;
+        }
+        int block_order = allocator->pages[start].order;
+        // a block spanning whole regions is in use, the request failed
+        if (block_order >= order) {
+            start += 1 << block_order;
+            continue;
+        }
+
+        int allocated = _region_cost(allocator, start, order);
+        if (allocated >= 0 && (best < 0 || allocated < *cost)) {
+            best = start;
+            *cost = allocated;
+        }
+        start += 1 << order;
+    }
+    return best;
+}
+
+// _move_block moves an allocated block to target, a free block of the same
+// order taken off the free lists, leaving the block's own pages unused.
+void _move_block(buddy_allocator_t *allocator, block_descriptor_t *block, block_descriptor_t *target) {
+    if (allocator->memory != NULL)
+        memcpy(block_address(allocator, target), block_address(allocator, block), (size_t)PAGE_SIZE << block->order);
+    for (int i = 0; i < 1 << block->order; i++)
+        allocator->pages[target->first_page_address + i].flags = allocator->pages[block->first_page_address + i].flags;
+    seq_entry_t *entry = seq_map_find(allocator->seq_map, block->seq_no);
+    target->seq_no = block->seq_no;
+    entry->allocated_block = target;
+    if (entry->lru_node != NULL && entry->lru_node->block == block)
+        entry->lru_node->block = target;
+    block->seq_no = -1;
+}
+
+// _migrate_block moves an allocated block to a free block of the same order,
+// which the caller has made sure lies outside the region being emptied.
+// Returns -1 if there is no free block to move it to.
+static int _migrate_block(buddy_allocator_t *allocator, block_descriptor_t *block) {
+    block_descriptor_t *target = _allocate_block(allocator, block->order);
+    if (target == NULL)
+        return -1;
+
+    _move_block(allocator, block, target);
+    count_event(allocator, compact_migrations);
+    return 0;
+}
+
+// _compact_region empties the region starting at start. Its free blocks are
+// taken off the free lists first so that no block is moved within it. If a
+// block can't be moved, the region is given back as it is, the blocks
+// already moved stay where they went.
+static int _compact_region(buddy_allocator_t *allocator, int start, int order) {
+    int end = start + (1 << order);
+    for (int address = start; address < end; address += 1 << allocator->pages[address].order) {
+        block_descriptor_t *block = &allocator->pages[address];
+        if (find_free_block(allocator->free_list[block->order], address) != NULL)
+            remove_node(allocator->free_list[block->order], block);
+    }
+
+    // largest first, as _region_cost planned
+    int moved_all = 1;
+    for (int i = order - 1; i >= 0 && moved_all; i--) {
+        for (int address = start; address < end; address += 1 << allocator->pages[address].order) {
+            block_descriptor_t *block = &allocator->pages[address];
+            if (block->order == i && block->seq_no >= 0 && _migrate_block(allocator, block) != 0) {
+                moved_all = 0;
+                break;
+            }
+        }
+    }
+
+    if (moved_all) {
+        _free_block(allocator, init_block_descriptor(&allocator->pages[start], order, start));
+        return 0;
+    }
+    for (int address = start; address < end; ) {
+        block_descriptor_t *block = &allocator->pages[address];
+        address += 1 << block->order;
+        if (block->seq_no < 0)
+            _free_block(allocator, block);
+    }
+    return -1;
+}
+
+// _should_compact is the cost model choosing compaction over reclaim for a
+// request of order. Compaction only helps if the request fails for
+// fragmentation rather than lack of memory, as in Linux's extfrag_threshold
+// check. Then, per page, moving costs a copy while evicting costs a swap-in
+// for the share of evicted blocks that have been faulting back in so far.
+static int _should_compact(buddy_allocator_t *allocator, int order) {
+    int free_blocks[allocator->max_order + 1];
+    long free_pages = 0;
+    for (int i = 0; i <= allocator->max_order; i++) {
+        free_blocks[i] = allocator->free_list[i]->size;
+        free_pages += (long)free_blocks[i] << i;
+    }
+    // the moved blocks need room outside the region
+    if (free_pages < 1L << order)
+        return 0;
+    if (_fragmentation_index(free_blocks, allocator->max_order, order) <= allocator->extfrag_threshold)
+        return 0;
+
+    unsigned long long reclaims = allocator->stats.reclaims + 1;
+    unsigned long long refaults = allocator->stats.page_faults + 1;
+    if (refaults > reclaims)
+        refaults = reclaims;
+    return COMPACT_MIGRATE_COST * reclaims <= COMPACT_REFAULT_COST * refaults;
+}
+
+// try_compaction empties an aligned region for a request of order that the
+// free lists can't satisfy, if the cost model prefers that to reclaim.
+// Called with lru_lock held. Returns 0 once a free block of order was made,
+// -1 otherwise.
+int try_compaction(buddy_allocator_t *allocator, int order) {
+    if (order == 0 || allocator->concurrency == CONCURRENT_LOCK_FREE)
+        return -1;
+
+    if (allocator->concurrency == CONCURRENT_PCP)
+        pthread_mutex_lock(&allocator->lock);
+    int result = -1;
+    int migrate_pages = 0;
+    int start = _should_compact(allocator, order) ? _best_region(allocator, order, &migrate_pages) : -1;
+    if (start >= 0) {
+        count_event(allocator, compact_stalls);
+        result = _compact_region(allocator, start, order);
+        if (result == 0)
+            count_event(allocator, compact_successes);
+        else
+            count_event(allocator, compact_failures);
+    }
+    if (allocator->concurrency == CONCURRENT_PCP)
+        pthread_mutex_unlock(&allocator->lock);
+    return result;
+}
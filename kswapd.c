@@ -0,0 +1,82 @@
+#include <pthread.h>
+#include "allocator.h"
+
+// _kswapd_balance evicts blocks until free pages reach the high watermark or
+// the replacement policy has nothing left to give.
+static void _kswapd_balance(buddy_allocator_t *allocator) {
+    while (free_page_count(allocator) < allocator->watermark[WMARK_HIGH]) {
+        pthread_mutex_lock(&allocator->lru_lock);
+        int reclaimed = reclaim(allocator);
+        pthread_mutex_unlock(&allocator->lru_lock);
+        if (reclaimed != 0)
+            break;
+        count_event(allocator, kswapd_reclaims);
+    }
+    // evicted small blocks went to this thread's cache, hand them back
+    drain_local_pcp(allocator);
+}
+
+static void *_kswapd(void *arg) {
+    buddy_allocator_t *allocator = (buddy_allocator_t*)arg;
+
+    pthread_mutex_lock(&allocator->kswapd_lock);
+    while (!allocator->kswapd_stop) {
+        if (!allocator->kswapd_wakeup) {
+            pthread_cond_wait(&allocator->kswapd_wait, &allocator->kswapd_lock);
+            continue;
+        }
+        __atomic_store_n(&allocator->kswapd_wakeup, 0, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&allocator->kswapd_lock);
+
+        count_event(allocator, kswapd_wakeups);
+        _kswapd_balance(allocator);
+
+        pthread_mutex_lock(&allocator->kswapd_lock);
+    }
+    pthread_mutex_unlock(&allocator->kswapd_lock);
+    return NULL;
+}
+
+// start_kswapd starts a background reclaimer for a concurrent allocator, like
+// Linux kswapd. It is woken when an allocation takes free pages below the low
+// watermark and evicts until they are back at the high watermark, so that
+// allocating threads only reclaim themselves below the min watermark.
+// Returns -1 for a single-threaded allocator, which has no locks to share.
+int start_kswapd(buddy_allocator_t *allocator) {
+    if (allocator->concurrency == SINGLE_THREADED || allocator->kswapd_running)
+        return -1;
+
+    pthread_mutex_init(&allocator->kswapd_lock, NULL);
+    pthread_cond_init(&allocator->kswapd_wait, NULL);
+    allocator->kswapd_wakeup = 0;
+    allocator->kswapd_stop = 0;
+    if (pthread_create(&allocator->kswapd, NULL, _kswapd, allocator) != 0)
+        return -1;
+    allocator->kswapd_running = 1;
+    return 0;
+}
+
+// stop_kswapd stops the background reclaimer, once no other thread is using
+// the allocator.
+void stop_kswapd(buddy_allocator_t *allocator) {
+    if (!allocator->kswapd_running)
+        return;
+
+    pthread_mutex_lock(&allocator->kswapd_lock);
+    allocator->kswapd_stop = 1;
+    pthread_cond_signal(&allocator->kswapd_wait);
+    pthread_mutex_unlock(&allocator->kswapd_lock);
+    pthread_join(allocator->kswapd, NULL);
+    allocator->kswapd_running = 0;
+}
+
+void wakeup_kswapd(buddy_allocator_t *allocator) {
+    // a wakeup still pending covers this one
+    if (__atomic_load_n(&allocator->kswapd_wakeup, __ATOMIC_RELAXED))
+        return;
+
+    pthread_mutex_lock(&allocator->kswapd_lock);
+    __atomic_store_n(&allocator->kswapd_wakeup, 1, __ATOMIC_RELAXED);
+    pthread_cond_signal(&allocator->kswapd_wait);
+    pthread_mutex_unlock(&allocator->kswapd_lock);
+}
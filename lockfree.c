@@ -0,0 +1,168 @@
+#include <stdlib.h>
+#include <stdatomic.h>
+#include "allocator.h"
+
+#define LF_INDEX_MASK 0xffffffffULL
+
+static void _lf_push(lf_free_list_t *list, unsigned index) {
+    unsigned long long head = atomic_load(&list->head);
+    unsigned long long new_head;
+    do {
+        atomic_store(&list->next[index], (unsigned)(head & LF_INDEX_MASK));
+        new_head = (((head >> 32) + 1) << 32) | (index + 1);
+    } while (!atomic_compare_exchange_weak(&list->head, &head, new_head));
+}
+
+// _lf_pop takes a free block off the stack and returns its index, or -1 if
+// the stack holds no free block. Stale entries are dropped on the way.
+static long _lf_pop(lf_free_list_t *list) {
+    for (;;) {
+        unsigned long long head = atomic_load(&list->head);
+        unsigned top = (unsigned)(head & LF_INDEX_MASK);
+        if (top == 0)
+            return -1;
+
+        // next may be overwritten by a concurrent pop/push of top,
+        // the tag makes the CAS fail in that case
+        unsigned next = atomic_load(&list->next[top - 1]);
+        unsigned long long new_head = (((head >> 32) + 1) << 32) | next;
+        if (!atomic_compare_exchange_weak(&list->head, &head, new_head))
+            continue;
+
+        unsigned index = top - 1;
+        // clear in_stack before claiming, so a racing _lf_publish either sees
+        // it set (and this claim then sees the block free) or links it again
+        atomic_store(&list->in_stack[index], 0);
+        unsigned char expected = LF_BLOCK_FREE;
+        if (atomic_compare_exchange_strong(&list->state[index], &expected, LF_BLOCK_BUSY))
+            return index;
+    }
+}
+
+// _lf_publish marks the block at address free on the order's list.
+static void _lf_publish(buddy_allocator_t *allocator, int order, int address) {
+    lf_free_list_t *list = &allocator->lf_free_list[order];
+    unsigned index = address >> order;
+
+    atomic_store(&list->state[index], LF_BLOCK_FREE);
+    // a stale entry still on the stack now stands for the block again
+    if (atomic_exchange(&list->in_stack[index], 1) == 0)
+        _lf_push(list, index);
+}
+
+static int _lf_claim(buddy_allocator_t *allocator, int order, int address) {
+    unsigned char expected = LF_BLOCK_FREE;
+    return atomic_compare_exchange_strong(&allocator->lf_free_list[order].state[address >> order], &expected, LF_BLOCK_BUSY);
+}
+
+// init_lf_free_lists sets up the lock-free lists and moves every block on the
+// regular free lists onto them.
+void init_lf_free_lists(buddy_allocator_t *allocator) {
+    allocator->lf_free_list = (lf_free_list_t*)malloc((allocator->max_order + 1) * sizeof(lf_free_list_t));
+
+    for (int order = 0; order <= allocator->max_order; order++) {
+        lf_free_list_t *list = &allocator->lf_free_list[order];
+        int nr_blocks = allocator->total_pages >> order;
+
+        atomic_init(&list->head, 0);
+        list->next = (_Atomic unsigned*)calloc(nr_blocks, sizeof(unsigned));
+        list->state = (_Atomic unsigned char*)calloc(nr_blocks, sizeof(unsigned char));
+        list->in_stack = (_Atomic unsigned char*)calloc(nr_blocks, sizeof(unsigned char));
+
+        block_descriptor_t *block;
+        while ((block = remove_head(allocator->free_list[order])) != NULL)
+            _lf_publish(allocator, order, block->first_page_address);
+    }
+}
+
+// _destroy_lf_free_lists frees what init_lf_free_lists set up
+void _destroy_lf_free_lists(buddy_allocator_t *allocator) {
+    for (int order = 0; order <= allocator->max_order; order++) {
+        free(allocator->lf_free_list[order].next);
+        free(allocator->lf_free_list[order].state);
+        free(allocator->lf_free_list[order].in_stack);
+    }
+    free(allocator->lf_free_list);
+}
+
+block_descriptor_t *lf_alloc_block(buddy_allocator_t *allocator, int req_order) {
+    for (int order = req_order; order <= allocator->max_order; order++) {
+        long index = _lf_pop(&allocator->lf_free_list[order]);
+        if (index < 0)
+            continue;
+
+        // split down to req_order, publishing the second halves
+        int address = (int)index << order;
+        for (int i = order - 1; i >= req_order; i--) {
+            count_event(allocator, splits[i + 1]);
+            int buddy_address = address + (1 << i);
+            init_block_descriptor(&allocator->pages[buddy_address], i, buddy_address);
+            _lf_publish(allocator, i, buddy_address);
+        }
+        return init_block_descriptor(&allocator->pages[address], req_order, address);
+    }
+
+    return NULL;
+}
+
+// lf_free_block merges the block with every free buddy it can claim and
+// publishes the result. If the buddy is freed at the same moment, both sides
+// may miss each other, so each rechecks after publishing: of two buddies
+// published at once, at least one sees the other free. Taking the pair back
+// starts with its lower half, so only one thread goes on to claim the upper
+// half, and retries the merge until it is done or the upper half is taken.
+void lf_free_block(buddy_allocator_t *allocator, block_descriptor_t *block) {
+    int order = block->order;
+    int address = block->first_page_address;
+
+    for (;;) {
+        while (order < allocator->max_order) {
+            int buddy_address = address ^ (1 << order);
+            if (buddy_address + (1 << order) > allocator->total_pages)
+                break;
+            if (!_lf_claim(allocator, order, buddy_address))
+                break;
+            // the buddy's stack entry, if any, is now stale
+            count_event(allocator, merges[order]);
+            address &= ~(1 << order);
+            order++;
+        }
+
+        init_block_descriptor(&allocator->pages[address], order, address);
+        _lf_publish(allocator, order, address);
+
+        if (order == allocator->max_order)
+            return;
+        int buddy_address = address ^ (1 << order);
+        if (buddy_address + (1 << order) > allocator->total_pages)
+            return;
+        if (atomic_load(&allocator->lf_free_list[order].state[buddy_address >> order]) != LF_BLOCK_FREE)
+            return;
+
+        // the buddy turned free after we looked, take the lower half back and
+        // retry; if it is taken by then, the pair is no longer ours to merge
+        address &= ~(1 << order);
+        if (!_lf_claim(allocator, order, address))
+            return;
+    }
+}
+
+// lf_free_blocks counts free blocks of order; like lf_free_pages it is exact
+// only while no thread is allocating or freeing.
+int lf_free_blocks(buddy_allocator_t *allocator, int order) {
+    int nr_free = 0;
+    int nr_blocks = allocator->total_pages >> order;
+    for (int i = 0; i < nr_blocks; i++)
+        if (atomic_load(&allocator->lf_free_list[order].state[i]) == LF_BLOCK_FREE)
+            nr_free++;
+    return nr_free;
+}
+
+// lf_free_pages counts free pages; it is exact only while no thread is
+// allocating or freeing.
+int lf_free_pages(buddy_allocator_t *allocator) {
+    int free_pages = 0;
+    for (int order = 0; order <= allocator->max_order; order++)
+        free_pages += lf_free_blocks(allocator, order) << order;
+    return free_pages;
+}
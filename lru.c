@@ -4,31 +4,34 @@
 #include "allocator.h"
 
 // create a new lru_node
-lru_node_t* new_lru_node(block_descriptor_t *block)
+lru_node_t* new_lru_node(lru_cache_t* lru_cache, block_descriptor_t *block)
 {
-    lru_node_t* temp = (lru_node_t*)malloc(sizeof(lru_node_t));
+    lru_node_t* temp = (lru_node_t*)pool_alloc(lru_cache->node_pool);
     temp->block = block;
+    temp->owner = lru_cache;
     temp->prev = NULL;
     temp->next = NULL;
+    temp->flags = 0;
  
     return temp;
 }
+
+// return a node handed out by lru_evict/lru_insert/lru_remove to the pool
+void free_lru_node(lru_cache_t* lru_cache, lru_node_t *node)
+{
+    pool_free(lru_cache->node_pool, node);
+}
  
 // create an empty lru_cache of given capacity
-lru_cache_t* new_lru_cache(int capacity)
+lru_cache_t* new_lru_cache(int capacity, object_pool_t *node_pool, seq_map_t *seq_map)
 {
     lru_cache_t* lru_cache = (lru_cache_t*)malloc(sizeof(lru_cache_t));
     lru_cache->count = 0;
     lru_cache->capacity = capacity;
+    lru_cache->node_pool = node_pool;
+    lru_cache->seq_map = seq_map;
     lru_cache->front = NULL;
     lru_cache->rear = NULL;
-
-    // init hash
-    lru_cache->hash_table = (lru_node_t**)malloc(1500 * sizeof(lru_node_t*));
- 
-    // initialize all hash entries as empty
-    for (int i = 0; i < capacity; ++i)
-       lru_cache->hash_table[i] = NULL;
     return lru_cache;
 }
  
@@ -54,6 +57,7 @@ lru_node_t *lru_evict(lru_cache_t* lru_cache)
  
     // change rear and remove the previous rear
     lru_node_t* evicted_node = lru_cache->rear;
+    seq_map_find(lru_cache->seq_map, evicted_node->block->seq_no)->lru_node = NULL;
     lru_cache->rear = lru_cache->rear->prev;
  
     if (lru_cache->rear)
@@ -73,13 +77,11 @@ lru_node_t *lru_insert(lru_cache_t* lru_cache, block_descriptor_t *block)
 
     // if cache is full, remove the rear node
     if (is_lru_cache_full(lru_cache)) {
-        // remove page from hash
-        lru_cache->hash_table[lru_cache->rear->block->seq_no] = NULL;
         evected_node = lru_evict(lru_cache);
     }
  
     // create node and insert into the front
-    lru_node_t* new_node = new_lru_node(block);
+    lru_node_t* new_node = new_lru_node(lru_cache, block);
     new_node->next = lru_cache->front;
  
     // if lru cache is empty, change both front and rear pointers
@@ -93,7 +95,7 @@ lru_node_t *lru_insert(lru_cache_t* lru_cache, block_descriptor_t *block)
         lru_cache->front = new_node;
     }
  
-    lru_cache->hash_table[block->seq_no] = new_node;
+    seq_map_find(lru_cache->seq_map, block->seq_no)->lru_node = new_node;
  
     lru_cache->count++;
     return evected_node;
@@ -101,14 +103,15 @@ lru_node_t *lru_insert(lru_cache_t* lru_cache, block_descriptor_t *block)
  
 
  // remove a node from lru cache, return removed node
-lru_node_t *lru_remove(lru_cache_t* lru_cache, int seq_no)
+lru_node_t *lru_remove(lru_cache_t* lru_cache, long long seq_no)
 {
     if (is_lru_cache_empty(lru_cache))
         return NULL;
  
-    lru_node_t* node_to_remove = lru_cache->hash_table[seq_no];
-    if (node_to_remove == NULL)
+    seq_entry_t *entry = seq_map_find(lru_cache->seq_map, seq_no);
+    if (entry == NULL || entry->lru_node == NULL || entry->lru_node->owner != lru_cache)
         return NULL;
+    lru_node_t* node_to_remove = entry->lru_node;
     
 
     // if node is the front
@@ -131,22 +134,410 @@ lru_node_t *lru_remove(lru_cache_t* lru_cache, int seq_no)
     node_to_remove->prev = NULL;
     node_to_remove->next = NULL;
 
-    lru_cache->hash_table[seq_no] = NULL;
+    entry->lru_node = NULL;
     lru_cache->count--;
 
     return node_to_remove;
 }
 
+// lru_move_front moves node from the list it is on to the front of lru_cache.
+// The node itself is moved, its seq_map entry keeps pointing at it.
+void lru_move_front(lru_cache_t* lru_cache, lru_node_t *node)
+{
+    lru_cache_t *owner = node->owner;
+    if (owner->front == node)
+        owner->front = node->next;
+    if (owner->rear == node)
+        owner->rear = node->prev;
+    if (node->prev != NULL)
+        node->prev->next = node->next;
+    if (node->next != NULL)
+        node->next->prev = node->prev;
+    owner->count--;
+
+    node->owner = lru_cache;
+    node->prev = NULL;
+    node->next = lru_cache->front;
+    if (lru_cache->front != NULL)
+        lru_cache->front->prev = node;
+    else
+        lru_cache->rear = node;
+    lru_cache->front = node;
+    lru_cache->count++;
+}
+
+// lru_rotate moves the rear node to the front, giving it a second chance
+void lru_rotate(lru_cache_t* lru_cache)
+{
+    if (lru_cache->front == lru_cache->rear)
+        return;
+
+    lru_node_t *node = lru_cache->rear;
+    lru_cache->rear = node->prev;
+    lru_cache->rear->next = NULL;
+
+    node->prev = NULL;
+    node->next = lru_cache->front;
+    lru_cache->front->prev = node;
+    lru_cache->front = node;
+}
+
 void dump_lru_cache(lru_cache_t *lru_cache) {
 
     lru_node_t *cur = lru_cache->front;
     
     printf("[LRU, count %d, cap %d]->", lru_cache->count, lru_cache->capacity);
     while (cur != NULL) {
-        printf("[ seq_no: %d, address %d ]-> ", cur->block->seq_no, cur->block->first_page_address);
+        printf("[ seq_no: %lld, address %d ]-> ", cur->block->seq_no, cur->block->first_page_address);
         cur = cur->next;
     }
 
     printf("\n");
     return;
- }
\ No newline at end of file
+ }
+
+// save_lru_cache writes the count of lru_cache, then its nodes front to rear
+void save_lru_cache(lru_cache_t *lru_cache, checkpoint_t *checkpoint)
+{
+    checkpoint_write(checkpoint, &lru_cache->count, sizeof(lru_cache->count));
+    for (lru_node_t *cur = lru_cache->front; cur != NULL; cur = cur->next)
+        checkpoint_write_node(checkpoint, cur);
+}
+
+// load_lru_cache reads what save_lru_cache wrote back into an empty lru_cache
+int load_lru_cache(lru_cache_t *lru_cache, checkpoint_t *checkpoint)
+{
+    unsigned count;
+    if (checkpoint_read(checkpoint, &count, sizeof(count)) != 0 || count > lru_cache->capacity)
+        return -1;
+
+    for (unsigned i = 0; i < count; i++) {
+        lru_node_t *node = checkpoint_read_node(checkpoint, lru_cache);
+        if (node == NULL)
+            return -1;
+        node->prev = lru_cache->rear;
+        if (lru_cache->rear != NULL)
+            lru_cache->rear->next = node;
+        else
+            lru_cache->front = node;
+        lru_cache->rear = node;
+        lru_cache->count++;
+    }
+    return 0;
+}
+
+
+// lru_policy is the default replacement policy: new blocks enter the inactive
+// list, a hit there promotes them to the active list, whose overflow is
+// demoted back. Blocks are evicted from the rear of the inactive list only.
+//
+// Hits are buffered in pending, like Linux's pagevecs, and applied in order
+// once LRU_BATCH are, or before any other call looks at the lists. The lists
+// then end up as if each hit had been applied right away, so blocks are
+// evicted in the same order.
+typedef struct lru_policy {
+    buddy_allocator_t *allocator;
+    lru_cache_t *active_list;
+    lru_cache_t *inactive_list;
+    lru_node_t *pending[LRU_BATCH]; // nodes hit, oldest first
+    int nr_pending;
+    void (*activate)(struct lru_policy *lru, lru_node_t *node); // applies a hit
+    // workingset variant only
+    unsigned capacity; // blocks on both lists together
+    unsigned min_capacity; // least room either list keeps
+    unsigned long long nonresident_age;
+} lru_policy_t;
+
+static void _lru_activate(lru_policy_t *lru, lru_node_t *node);
+
+static lru_policy_t *_new_lru_policy(buddy_allocator_t *allocator, unsigned capacity)
+{
+    lru_policy_t *lru = (lru_policy_t*)malloc(sizeof(lru_policy_t));
+    lru->allocator = allocator;
+    lru->nr_pending = 0;
+    lru->activate = _lru_activate;
+    lru->active_list = new_lru_cache(capacity / 2, allocator->lru_node_pool, allocator->seq_map);
+    lru->inactive_list = new_lru_cache(capacity - capacity / 2, allocator->lru_node_pool, allocator->seq_map);
+    lru->capacity = capacity;
+    lru->min_capacity = capacity / 8 > 0 ? capacity / 8 : 1;
+    lru->nonresident_age = 0;
+    return lru;
+}
+
+static void *_lru_create(buddy_allocator_t *allocator, unsigned capacity)
+{
+    return _new_lru_policy(allocator, capacity);
+}
+
+static void _lru_destroy(void *policy)
+{
+    lru_policy_t *lru = (lru_policy_t*)policy;
+    free(lru->active_list);
+    free(lru->inactive_list);
+    free(lru);
+}
+
+// _lru_take returns the block of a node handed out by the lists and frees the node
+static block_descriptor_t *_lru_take(lru_cache_t *lru_cache, lru_node_t *node)
+{
+    if (node == NULL)
+        return NULL;
+    block_descriptor_t *block = node->block;
+    free_lru_node(lru_cache, node);
+    return block;
+}
+
+// _lru_drain applies the buffered hits in the order they were made
+static void _lru_drain(void *policy)
+{
+    lru_policy_t *lru = (lru_policy_t*)policy;
+    for (int i = 0; i < lru->nr_pending; i++)
+        lru->activate(lru, lru->pending[i]);
+    lru->nr_pending = 0;
+}
+
+static block_descriptor_t *_lru_admit(void *policy, seq_entry_t *entry, int refault)
+{
+    lru_policy_t *lru = (lru_policy_t*)policy;
+    _lru_drain(lru);
+    if (!refault)
+        return _lru_take(lru->inactive_list, lru_insert(lru->inactive_list, entry->allocated_block));
+
+    if (entry->lru_node != NULL)
+        return NULL;
+    // a refaulted block goes straight to the active list
+    lru_node_t *downgraded_node = lru_insert(lru->active_list, entry->allocated_block);
+    if (downgraded_node == NULL)
+        return NULL;
+    count_event(lru->allocator, demotions);
+    lru_node_t *evicted_node = lru_insert(lru->inactive_list, downgraded_node->block);
+    free_lru_node(lru->active_list, downgraded_node);
+    return _lru_take(lru->inactive_list, evicted_node);
+}
+
+// _lru_activate applies a hit: a node on the inactive list is promoted to the
+// active list, whose rear is demoted if it was full. Nodes are moved rather
+// than freed and reallocated, so those still pending stay valid.
+static void _lru_activate(lru_policy_t *lru, lru_node_t *node)
+{
+    if (node->owner != lru->inactive_list)
+        return;
+
+    count_event(lru->allocator, promotions);
+    int full = is_lru_cache_full(lru->active_list);
+    lru_move_front(lru->active_list, node);
+    if (full) {
+        count_event(lru->allocator, demotions);
+        lru_move_front(lru->inactive_list, lru->active_list->rear);
+    }
+}
+
+// _lru_access buffers a hit. One that would change nothing is dropped: a hit
+// on the active list with no hits pending, or a repeat of the last one, whose
+// block is on the active list by the time it would be applied.
+static void _lru_access(void *policy, seq_entry_t *entry)
+{
+    lru_policy_t *lru = (lru_policy_t*)policy;
+    lru_node_t *node = entry->lru_node;
+    if (node == NULL)
+        return;
+    if (lru->nr_pending == 0 ? node->owner != lru->inactive_list : lru->pending[lru->nr_pending - 1] == node)
+        return;
+
+    lru->pending[lru->nr_pending++] = node;
+    if (lru->nr_pending == LRU_BATCH)
+        _lru_drain(lru);
+}
+
+static block_descriptor_t *_lru_reclaim(void *policy)
+{
+    lru_policy_t *lru = (lru_policy_t*)policy;
+    _lru_drain(lru);
+    return _lru_take(lru->inactive_list, lru_evict(lru->inactive_list));
+}
+
+static void _lru_forget(void *policy, seq_entry_t *entry)
+{
+    lru_policy_t *lru = (lru_policy_t*)policy;
+    _lru_drain(lru);
+    _lru_take(lru->active_list, lru_remove(lru->active_list, entry->seq_no));
+    _lru_take(lru->inactive_list, lru_remove(lru->inactive_list, entry->seq_no));
+}
+
+static void _lru_sizes(void *policy, unsigned *active, unsigned *inactive)
+{
+    lru_policy_t *lru = (lru_policy_t*)policy;
+    _lru_drain(lru);
+    *active = lru->active_list->count;
+    *inactive = lru->inactive_list->count;
+}
+
+static void _lru_dump(void *policy)
+{
+    lru_policy_t *lru = (lru_policy_t*)policy;
+    _lru_drain(lru);
+    printf("[Active list]->");
+    dump_lru_cache(lru->active_list);
+    printf("[Inactive list]->");
+    dump_lru_cache(lru->inactive_list);
+}
+
+// the workingset variant's age and list sizes are saved along, the default
+// policy's are fixed
+static void _lru_save(void *policy, checkpoint_t *checkpoint)
+{
+    lru_policy_t *lru = (lru_policy_t*)policy;
+    _lru_drain(lru);
+    checkpoint_write(checkpoint, &lru->nonresident_age, sizeof(lru->nonresident_age));
+    checkpoint_write(checkpoint, &lru->active_list->capacity, sizeof(lru->active_list->capacity));
+    checkpoint_write(checkpoint, &lru->inactive_list->capacity, sizeof(lru->inactive_list->capacity));
+    save_lru_cache(lru->active_list, checkpoint);
+    save_lru_cache(lru->inactive_list, checkpoint);
+}
+
+static int _lru_load(void *policy, checkpoint_t *checkpoint)
+{
+    lru_policy_t *lru = (lru_policy_t*)policy;
+    if (checkpoint_read(checkpoint, &lru->nonresident_age, sizeof(lru->nonresident_age)) != 0 ||
+        checkpoint_read(checkpoint, &lru->active_list->capacity, sizeof(lru->active_list->capacity)) != 0 ||
+        checkpoint_read(checkpoint, &lru->inactive_list->capacity, sizeof(lru->inactive_list->capacity)) != 0 ||
+        lru->active_list->capacity > lru->capacity || lru->inactive_list->capacity > lru->capacity)
+        return -1;
+    if (load_lru_cache(lru->active_list, checkpoint) != 0 || load_lru_cache(lru->inactive_list, checkpoint) != 0)
+        return -1;
+    return 0;
+}
+
+const replacement_policy_ops_t lru_policy_ops = {
+    .name = "lru",
+    .create = _lru_create,
+    .destroy = _lru_destroy,
+    .admit = _lru_admit,
+    .access = _lru_access,
+    .reclaim = _lru_reclaim,
+    .evicted = NULL,
+    .forget = _lru_forget,
+    .sizes = _lru_sizes,
+    .dump = _lru_dump,
+    .drain = _lru_drain,
+    .save = _lru_save,
+    .load = _lru_load,
+};
+
+
+// The workingset variant sizes the two lists at runtime, after Linux
+// mm/workingset.c. The inactive list gets whatever room the active list
+// leaves, and the active list's capacity is its target size.
+//
+// nonresident_age ticks on every eviction and activation, and an evicted
+// block's shadow entry is the age at its eviction. On refault, the distance
+// (age now - shadow) is how much larger the inactive list would have had to
+// be to keep the block. If the active list holds that many blocks it could
+// have given up, the block is activated right away and the active target
+// shrinks by one; otherwise it starts over on the inactive list. A promotion
+// into a full active list grows the target again.
+
+// _ws_fit_inactive gives the inactive list the room the active list leaves
+static void _ws_fit_inactive(lru_policy_t *lru)
+{
+    lru->inactive_list->capacity = lru->capacity - lru->active_list->count;
+}
+
+// _ws_demote moves the rear of the active list to the inactive list, which
+// always has room for it
+static void _ws_demote(lru_policy_t *lru)
+{
+    lru_move_front(lru->inactive_list, lru->active_list->rear);
+    _ws_fit_inactive(lru);
+    count_event(lru->allocator, demotions);
+}
+
+// _ws_activate applies a hit, growing the active target into a full active
+// list, as far as the inactive list can spare
+static void _ws_activate(lru_policy_t *lru, lru_node_t *node)
+{
+    if (node->owner != lru->inactive_list)
+        return;
+
+    count_event(lru->allocator, promotions);
+    lru->nonresident_age++;
+    if (is_lru_cache_full(lru->active_list)) {
+        if (lru->active_list->capacity < lru->capacity - lru->min_capacity)
+            lru->active_list->capacity++;
+        else
+            _ws_demote(lru);
+    }
+    lru_move_front(lru->active_list, node);
+    _ws_fit_inactive(lru);
+}
+
+static void *_ws_create(buddy_allocator_t *allocator, unsigned capacity)
+{
+    lru_policy_t *lru = _new_lru_policy(allocator, capacity);
+    lru->activate = _ws_activate;
+    _ws_fit_inactive(lru);
+    return lru;
+}
+
+static block_descriptor_t *_ws_admit(void *policy, seq_entry_t *entry, int refault)
+{
+    lru_policy_t *lru = (lru_policy_t*)policy;
+    _lru_drain(lru);
+    if (entry->lru_node != NULL)
+        return NULL;
+
+    if (!refault || lru->nonresident_age - entry->shadow > lru->active_list->count)
+        return _lru_take(lru->inactive_list, lru_insert(lru->inactive_list, entry->allocated_block));
+
+    // the inactive list was too short to hold on to the block
+    count_event(lru->allocator, workingset_activations);
+    lru->nonresident_age++;
+    if (lru->active_list->capacity > lru->min_capacity)
+        lru->active_list->capacity--;
+    while (lru->active_list->count >= lru->active_list->capacity)
+        _ws_demote(lru);
+
+    block_descriptor_t *victim = NULL;
+    if (lru->active_list->count + lru->inactive_list->count >= lru->capacity)
+        victim = _lru_take(lru->inactive_list, lru_evict(lru->inactive_list));
+    lru_insert(lru->active_list, entry->allocated_block);
+    _ws_fit_inactive(lru);
+    return victim;
+}
+
+static void _ws_evicted(void *policy, seq_entry_t *entry)
+{
+    lru_policy_t *lru = (lru_policy_t*)policy;
+    _lru_drain(lru);
+    entry->shadow = lru->nonresident_age++;
+}
+
+static void _ws_forget(void *policy, seq_entry_t *entry)
+{
+    _lru_forget(policy, entry);
+    _ws_fit_inactive((lru_policy_t*)policy);
+}
+
+static void _ws_dump(void *policy)
+{
+    lru_policy_t *lru = (lru_policy_t*)policy;
+    _lru_drain(lru);
+    printf("[Workingset, age %llu, active target %u]\n", lru->nonresident_age, lru->active_list->capacity);
+    _lru_dump(policy);
+}
+
+const replacement_policy_ops_t lru_workingset_policy_ops = {
+    .name = "lru-workingset",
+    .create = _ws_create,
+    .destroy = _lru_destroy,
+    .admit = _ws_admit,
+    .access = _lru_access,
+    .reclaim = _lru_reclaim,
+    .evicted = _ws_evicted,
+    .forget = _ws_forget,
+    .sizes = _lru_sizes,
+    .dump = _ws_dump,
+    .drain = _lru_drain,
+    .save = _lru_save,
+    .load = _lru_load,
+};
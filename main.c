@@ -1,63 +1,505 @@
 #include <stdio.h>
 #include <stdlib.h>
-#include "util.h"
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
 #include "allocator.h"
+#include "util.h"
+#include "trace.h"
+
+static void process_request(buddy_allocator_t *allocator, const trace_record_t *record)
+{
+    switch (record->type)
+    {
+        case 'A':
+            allocate_pages(allocator, record->seq_no, record->page_size);
+            break;
+        case 'X':
+            access_page(allocator, record->seq_no, record->page_size);
+            break;
+        case 'F':
+            free_pages(allocator, record->seq_no);
+            break;
+    }
+}
 
-int main (void)
+// process_batch hands the run of up to batch_size requests of the same type
+// at records to the batch calls. Returns how many it took.
+static int process_batch(buddy_allocator_t *allocator, const trace_record_t *records, int batch_size)
+{
+    static alloc_request_t *requests;
+    static long long *seq_nos;
+    static int *pages;
+    static int capacity;
+    if (capacity < batch_size) {
+        requests = (alloc_request_t*)realloc(requests, batch_size * sizeof(alloc_request_t));
+        seq_nos = (long long*)realloc(seq_nos, batch_size * sizeof(long long));
+        pages = (int*)realloc(pages, batch_size * sizeof(int));
+        capacity = batch_size;
+    }
+
+    int nr_records = 0;
+    while (nr_records < batch_size && records[nr_records].type == records[0].type) {
+        requests[nr_records].seq_no = seq_nos[nr_records] = records[nr_records].seq_no;
+        requests[nr_records].page_size = pages[nr_records] = records[nr_records].page_size;
+        nr_records++;
+    }
+    switch (records[0].type)
+    {
+        case 'A':
+            allocate_pages_batch(allocator, requests, nr_records);
+            break;
+        case 'X':
+            access_pages_batch(allocator, seq_nos, pages, nr_records);
+            break;
+        case 'F':
+            free_pages_batch(allocator, seq_nos, nr_records);
+            break;
+    }
+    return nr_records;
+}
 
+static void dump_allocator(buddy_allocator_t *allocator)
 {
+    for (int i = 0; i <= allocator->max_order; i++)
+        dump_free_list(allocator->free_list[i],i);
+    if (allocator->deferred_high > 0) {
+        printf("[Deferred]\n");
+        for (int i = 0; i <= DEFERRED_MAX_ORDER && i <= allocator->max_order; i++)
+            dump_free_list(allocator->deferred[i], i);
+    }
+    if (allocator->cma_free_list != NULL) {
+        printf("[Reserved]\n");
+        for (int i = 0; i <= allocator->cma_order; i++)
+            dump_free_list(allocator->cma_free_list[i], i);
+    }
+
+    dump_replacement_policy(allocator);
+}
 
+// replay_text replays a tab-separated trace, dumping the allocator after every request
+static int replay_text(const char *path)
+{
     // init file reading
     FILE * fp;
     char * line = NULL;
     size_t len = 0;
     ssize_t read;
 
-    fp = fopen("./A0248411L-assign4-input.dat", "r");
+    fp = fopen(path, "r");
     if (fp == NULL)
-        exit(EXIT_FAILURE);
-
-
+        return EXIT_FAILURE;
 
     // init allocator
-    buddy_allocator_t *allocator = new_buddy_allocator();
+    buddy_allocator_t *allocator = new_buddy_allocator(TOTAL_PAGES, MAX_ORDER);
 
     while ((read = getline(&line, &len, fp)) != -1) {
         printf("\nProcessing request: %s", line);
-        
-        char** tokenized_string = str_split(line, '\t');
-
-        char* request_type = tokenized_string[0];
-        int request_seq_no = atoi(tokenized_string[1]);
-        int request_page_size = atoi(tokenized_string[2]);
-        
-        switch (*request_type)
-        {
-            case 'A': 
-                allocate_pages(allocator, request_seq_no, request_page_size);
-                break;
-            case 'X':
-                access_pages(allocator, request_seq_no);
-                break;
-            case 'F':
-                free_pages(allocator, request_seq_no);
-                break;
-        }
-        // Remove first block to split it into halves
-        for (int i = 0; i < 10; i++)
-            dump_free_list(allocator->free_list[i],i);
 
+        trace_record_t record;
+        if (parse_trace_line(line, &record) == 0)
+            process_request(allocator, &record);
 
-        printf("[Active list]->");
-        dump_lru_cache(allocator->active_list);
-        printf("[Inactive list]->");
-        dump_lru_cache(allocator->inactive_list);
+        dump_allocator(allocator);
     }
 
     fclose(fp);
     if (line)
         free(line);
-    exit(EXIT_SUCCESS);
-   
+    destroy_buddy_allocator(allocator);
+    return EXIT_SUCCESS;
+}
+
+typedef struct replay_options {
+    int quiet; // no per-request logging, JSON snapshot instead of the final dump
+    unsigned long long snapshot_interval; // > 0 for a snapshot every so many requests
+    int show_stats; // end with the buddyinfo line and the allocator counters
+    replacement_policy_t policy;
+    int deferred_high; // > 0 for deferred coalescing, see set_deferred_coalescing
+    int extfrag_threshold; // compaction runs above this fragmentation index
+    const char *swap_path; // backing memory and a swap file there, removed at the end
+    int zswap_percent; // > 0 for a compressed pool of this share of memory in front of swap
+    int partial_eviction; // split partly used blocks to evict their idle pages
+    int readahead; // > 0 to swap in up to this many blocks predicted to fault next, see set_readahead
+    int batch_size; // > 1 to hand runs of up to this many requests of a type to the batch calls
+    const char *restore_path; // start from this checkpoint, whose settings replace the above
+    const char *save_path; // save a checkpoint here at the end
+    int cma_order; // >= 0 for a reserved region of this order, see set_cma_region
+    int cma_min_order; // for requests of this order and above, cma_order if < 0
+} replay_options_t;
+
+// replay_binary feeds a mapped binary trace straight into the allocator,
+// configured and reported on as options say.
+static int replay_binary(const char *path, const replay_options_t *options)
+{
+    trace_t *trace = open_trace(path);
+    if (trace == NULL) {
+        fprintf(stderr, "Cannot open binary trace %s\n", path);
+        return EXIT_FAILURE;
+    }
+
+    log_enabled = !options->quiet;
+    buddy_allocator_t *allocator;
+    if (options->restore_path != NULL) {
+        allocator = load_allocator(options->restore_path);
+        if (allocator == NULL) {
+            fprintf(stderr, "Cannot restore checkpoint %s\n", options->restore_path);
+            close_trace(trace);
+            return EXIT_FAILURE;
+        }
+    } else {
+        allocator = new_buddy_allocator(TOTAL_PAGES, MAX_ORDER);
+        set_replacement_policy(allocator, options->policy);
+        set_deferred_coalescing(allocator, options->deferred_high);
+        allocator->extfrag_threshold = options->extfrag_threshold;
+        set_partial_eviction(allocator, options->partial_eviction);
+        set_readahead(allocator, options->readahead);
+        int cma_min_order = options->cma_min_order >= 0 ? options->cma_min_order : options->cma_order;
+        if (options->cma_order >= 0 && set_cma_region(allocator, options->cma_order, cma_min_order) != 0) {
+            fprintf(stderr, "Cannot reserve a region of order %d for order %d and above\n", options->cma_order, cma_min_order);
+            destroy_buddy_allocator(allocator);
+            close_trace(trace);
+            return EXIT_FAILURE;
+        }
+    }
+    if (options->swap_path != NULL && enable_swap(allocator, options->swap_path, 2) != 0) {
+        fprintf(stderr, "Cannot set up swap at %s\n", options->swap_path);
+        destroy_buddy_allocator(allocator);
+        close_trace(trace);
+        return EXIT_FAILURE;
+    }
+    if (options->zswap_percent > 0 && enable_zswap(allocator, options->zswap_percent) != 0) {
+        fprintf(stderr, "Cannot set up zswap, it needs -w\n");
+        destroy_buddy_allocator(allocator);
+        close_trace(trace);
+        return EXIT_FAILURE;
+    }
+
+    for (uint64_t i = 0; i < trace->nr_records; i++) {
+        if (options->batch_size > 1) {
+            // batches stop at snapshots
+            uint64_t left = options->snapshot_interval > 0 ? options->snapshot_interval - i % options->snapshot_interval
+                                                           : trace->nr_records - i;
+            if (left > trace->nr_records - i)
+                left = trace->nr_records - i;
+            int batch_size = left < (uint64_t)options->batch_size ? (int)left : options->batch_size;
+            i += process_batch(allocator, &trace->records[i], batch_size) - 1;
+        } else {
+            process_request(allocator, &trace->records[i]);
+        }
+        if (options->snapshot_interval > 0 && (i + 1) % options->snapshot_interval == 0)
+            snapshot_allocator(allocator, stdout, i + 1);
+    }
+
+    if (options->quiet)
+        snapshot_allocator(allocator, stdout, trace->nr_records);
+    else
+        dump_allocator(allocator);
+    if (options->show_stats) {
+        dump_buddyinfo(allocator, stdout);
+        dump_allocator_stats(allocator, stdout);
+    }
+    int status = EXIT_SUCCESS;
+    if (options->save_path != NULL && save_allocator(allocator, options->save_path) != 0) {
+        fprintf(stderr, "Cannot save checkpoint %s, not possible with -w\n", options->save_path);
+        status = EXIT_FAILURE;
+    }
+    if (options->swap_path != NULL) {
+        close_swap(allocator);
+        unlink(options->swap_path);
+    }
+    destroy_buddy_allocator(allocator);
+    close_trace(trace);
+    return status;
+}
+
+// sim_config is one allocator setup of a simulation, given as a
+// comma-separated list of key=value settings, and what replaying the trace
+// with it gave
+typedef struct sim_config {
+    const char *spec;
+    int total_pages;
+    int max_order;
+    int lru_entries;
+    replacement_policy_t policy;
+    int deferred_high;
+    int extfrag_threshold;
+    int partial_eviction;
+    int readahead;
+    int cma_order;
+    int cma_min_order;
+
+    allocator_stats_t stats;
+    long free_pages;
+    int extfrag_index; // of max_order at the end
+    unsigned long long elapsed_ns;
+} sim_config_t;
+
+typedef struct simulation {
+    const trace_t *trace;
+    sim_config_t *configs;
+    int nr_configs;
+    int next_config; // taken by the workers in turn
+} simulation_t;
+
+// parse_sim_config fills config from spec, the defaults replay uses for
+// whatever spec leaves out. Returns -1 if a setting is unknown or invalid.
+static int parse_sim_config(const char *spec, sim_config_t *config)
+{
+    memset(config, 0, sizeof(sim_config_t));
+    config->spec = spec;
+    config->total_pages = TOTAL_PAGES;
+    config->max_order = MAX_ORDER;
+    config->lru_entries = MAX_LRU_ENTRIES;
+    config->policy = POLICY_LRU;
+    config->extfrag_threshold = EXTFRAG_THRESHOLD;
+    config->cma_order = -1;
+    config->cma_min_order = -1;
+
+    char *settings = strdup(spec);
+    int failed = 0;
+    for (char *setting = strtok(settings, ","); setting != NULL && !failed; setting = strtok(NULL, ",")) {
+        char *value = strchr(setting, '=');
+        if (value == NULL) {
+            failed = 1;
+            break;
+        }
+        *value++ = '\0';
+        int number = atoi(value);
+        if (strcmp(setting, "policy") == 0)
+            failed = (int)(config->policy = find_replacement_policy(value)) < 0;
+        else if (strcmp(setting, "pages") == 0)
+            failed = (config->total_pages = number) <= 0;
+        else if (strcmp(setting, "order") == 0)
+            failed = (config->max_order = number) < 0 || number > MAX_ORDER_LIMIT;
+        else if (strcmp(setting, "lru") == 0)
+            failed = (config->lru_entries = number) <= 0;
+        else if (strcmp(setting, "defer") == 0)
+            failed = (config->deferred_high = number) < 0;
+        else if (strcmp(setting, "compact") == 0)
+            config->extfrag_threshold = number;
+        else if (strcmp(setting, "evict") == 0)
+            config->partial_eviction = number != 0;
+        else if (strcmp(setting, "readahead") == 0)
+            failed = (config->readahead = number) < 0 || number > READAHEAD_MAX_WINDOW;
+        else if (strcmp(setting, "cma") == 0)
+            failed = (config->cma_order = number) < 0;
+        else if (strcmp(setting, "cma_min") == 0)
+            failed = (config->cma_min_order = number) < 0;
+        else
+            failed = 1;
+    }
+    free(settings);
+    if (config->total_pages < 1 << config->max_order || config->cma_order > config->max_order ||
+        (config->cma_order < 0 && config->cma_min_order >= 0) || config->cma_min_order > config->cma_order)
+        failed = 1;
+    return failed ? -1 : 0;
+}
+
+static void simulate_config(const trace_t *trace, sim_config_t *config)
+{
+    buddy_allocator_t *allocator = new_buddy_allocator(config->total_pages, config->max_order);
+    set_lru_entries(allocator, config->lru_entries);
+    set_replacement_policy(allocator, config->policy);
+    set_deferred_coalescing(allocator, config->deferred_high);
+    allocator->extfrag_threshold = config->extfrag_threshold;
+    set_partial_eviction(allocator, config->partial_eviction);
+    set_readahead(allocator, config->readahead);
+    if (config->cma_order >= 0)
+        set_cma_region(allocator, config->cma_order, config->cma_min_order >= 0 ? config->cma_min_order : config->cma_order);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (uint64_t i = 0; i < trace->nr_records; i++)
+        process_request(allocator, &trace->records[i]);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    config->elapsed_ns = (end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec;
+    get_allocator_stats(allocator, &config->stats);
+    config->free_pages = free_page_count(allocator);
+    config->extfrag_index = fragmentation_index(allocator, config->max_order);
+    destroy_buddy_allocator(allocator);
+}
+
+// _simulation_worker replays the trace with one config after another, until
+// none is left
+static void *_simulation_worker(void *arg)
+{
+    simulation_t *simulation = (simulation_t*)arg;
+    int i;
+    while ((i = __atomic_fetch_add(&simulation->next_config, 1, __ATOMIC_RELAXED)) < simulation->nr_configs)
+        simulate_config(simulation->trace, &simulation->configs[i]);
+    return NULL;
+}
+
+// simulate replays one mapped binary trace with each of nr_specs allocator
+// setups, each on its own allocator, on nr_threads threads sharing the
+// trace, and prints how they compare.
+static int simulate(const char *path, const char **specs, int nr_specs, int nr_threads)
+{
+    sim_config_t *configs = (sim_config_t*)malloc(nr_specs * sizeof(sim_config_t));
+    for (int i = 0; i < nr_specs; i++) {
+        if (parse_sim_config(specs[i], &configs[i]) != 0) {
+            fprintf(stderr, "Invalid configuration %s\n", specs[i]);
+            free(configs);
+            return EXIT_FAILURE;
+        }
+    }
+    trace_t *trace = open_trace(path);
+    if (trace == NULL) {
+        fprintf(stderr, "Cannot open binary trace %s\n", path);
+        free(configs);
+        return EXIT_FAILURE;
+    }
+
+    log_enabled = 0;
+    simulation_t simulation = { trace, configs, nr_specs, 0 };
+    if (nr_threads > nr_specs)
+        nr_threads = nr_specs;
+    pthread_t *threads = (pthread_t*)malloc(nr_threads * sizeof(pthread_t));
+    for (int i = 0; i < nr_threads; i++)
+        pthread_create(&threads[i], NULL, _simulation_worker, &simulation);
+    for (int i = 0; i < nr_threads; i++)
+        pthread_join(threads[i], NULL);
+
+    printf("%-40s %10s %8s %10s %8s %8s %8s %8s\n", "config", "faults", "fault%", "reclaims", "failed",
+           "free", "extfrag", "Mops/s");
+    for (int i = 0; i < nr_specs; i++) {
+        sim_config_t *config = &configs[i];
+        int index = config->extfrag_index < 0 ? -config->extfrag_index : config->extfrag_index;
+        printf("%-40s %10llu %7.2f%% %10llu %8llu %8ld %s%d.%03d %8.3f\n", config->spec, config->stats.page_faults,
+               config->stats.accesses > 0 ? 100.0 * config->stats.page_faults / config->stats.accesses : 0.0,
+               config->stats.reclaims, config->stats.failed_allocations, config->free_pages,
+               config->extfrag_index < 0 ? "  -" : "   ", index / 1000, index % 1000,
+               config->elapsed_ns > 0 ? trace->nr_records * 1000.0 / config->elapsed_ns : 0.0);
+        free_allocator_stats(&config->stats);
+    }
+
+    free(threads);
+    free(configs);
+    close_trace(trace);
+    return EXIT_SUCCESS;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s                      replay ./A0248411L-assign4-input.dat\n", prog);
+    fprintf(stderr, "       %s convert <in.dat> <out.trace>\n", prog);
+    fprintf(stderr, "       %s replay [-q] [-i] [-s <every>] [-p <policy>] [-d <high>] [-c <index>] [-e] [-a <window>] [-m <order>[,<min>]] [-b <size>] [-w <swapfile> [-z <percent>]] [-r <checkpoint>] [-o <checkpoint>] <file.trace>\n", prog);
+    fprintf(stderr, "           -q          no per-request logging, JSON snapshot at the end\n");
+    fprintf(stderr, "           -i          buddyinfo and allocator counters at the end\n");
+    fprintf(stderr, "           -p <policy> page replacement: lru (default), lru-workingset, clock, clock-pro or arc\n");
+    fprintf(stderr, "           -s <every>  JSON snapshot every <every> requests\n");
+    fprintf(stderr, "           -d <high>   defer coalescing of freed small blocks, up to <high> per order\n");
+    fprintf(stderr, "           -c <index>  compact above this fragmentation index, default 500, 1000 for never\n");
+    fprintf(stderr, "           -e          evict the idle pages of partly used blocks, faults bring back one page\n");
+    fprintf(stderr, "           -a <window> read ahead up to <window> evicted blocks predicted to fault next\n");
+    fprintf(stderr, "           -m <order>[,<min>] reserve the last aligned 2^<order> pages for requests of order <min>\n");
+    fprintf(stderr, "                       (default <order>) and above, smaller ones only borrow them\n");
+    fprintf(stderr, "           -b <size>   replay runs of up to <size> requests of a type through the batch calls\n");
+    fprintf(stderr, "           -w <file>   back pages with memory and swap evicted blocks to <file>\n");
+    fprintf(stderr, "           -z <percent> compress evicted blocks into a pool of up to <percent> of memory first\n");
+    fprintf(stderr, "           -r <file>   start from the checkpoint in <file>, with its settings instead of -p/-d/-c/-e/-a/-m\n");
+    fprintf(stderr, "           -o <file>   save a checkpoint to <file> at the end\n");
+    fprintf(stderr, "       %s simulate [-j <threads>] [-x <config>]... <file.trace>\n", prog);
+    fprintf(stderr, "           -j <threads> replay on up to <threads> threads, default one per CPU\n");
+    fprintf(stderr, "           -x <config> an allocator to replay with, key=value settings separated by commas:\n");
+    fprintf(stderr, "                       policy, pages, order, lru (entries per list), defer, compact, evict, readahead,\n");
+    fprintf(stderr, "                       cma (reserved region order), cma_min (its smallest request order),\n");
+    fprintf(stderr, "                       default one per replacement policy\n");
+}
+
+int main (int argc, char **argv)
+
+{
+    if (argc == 1)
+        exit(replay_text("./A0248411L-assign4-input.dat"));
+
+    if (argc == 4 && strcmp(argv[1], "convert") == 0) {
+        int nr_records = convert_trace(argv[2], argv[3]);
+        if (nr_records < 0) {
+            fprintf(stderr, "Cannot convert %s to %s\n", argv[2], argv[3]);
+            exit(EXIT_FAILURE);
+        }
+        printf("Converted %d requests\n", nr_records);
+        exit(EXIT_SUCCESS);
+    }
+
+    if (argc >= 3 && strcmp(argv[1], "simulate") == 0) {
+        const char **specs = (const char**)malloc((argc + NR_POLICIES) * sizeof(char*));
+        int nr_specs = 0;
+        int nr_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        int i = 2;
+        for (; i < argc - 1; i++) {
+            if (strcmp(argv[i], "-j") == 0 && i + 1 < argc - 1 && (nr_threads = atoi(argv[i + 1])) > 0)
+                i++;
+            else if (strcmp(argv[i], "-x") == 0 && i + 1 < argc - 1)
+                specs[nr_specs++] = argv[++i];
+            else
+                break;
+        }
+        if (i == argc - 1) {
+            char policy_specs[NR_POLICIES][32];
+            if (nr_specs == 0) {
+                for (int j = 0; j < NR_POLICIES; j++) {
+                    snprintf(policy_specs[j], sizeof(policy_specs[j]), "policy=%s", replacement_policy_name(j));
+                    specs[nr_specs++] = policy_specs[j];
+                }
+            }
+            int status = simulate(argv[argc - 1], specs, nr_specs, nr_threads > 0 ? nr_threads : 1);
+            free(specs);
+            exit(status);
+        }
+    }
+
+    if (argc >= 3 && strcmp(argv[1], "replay") == 0) {
+        replay_options_t options = { 0, 0, 0, POLICY_LRU, 0, EXTFRAG_THRESHOLD, NULL, 0, 0, 0, 0, NULL, NULL, -1, -1 };
+        int policy;
+        int i = 2;
+        for (; i < argc - 1; i++) {
+            if (strcmp(argv[i], "-q") == 0)
+                options.quiet = 1;
+            else if (strcmp(argv[i], "-i") == 0)
+                options.show_stats = 1;
+            else if (strcmp(argv[i], "-e") == 0)
+                options.partial_eviction = 1;
+            else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc - 1)
+                options.snapshot_interval = strtoull(argv[++i], NULL, 10);
+            else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc - 1 && (policy = find_replacement_policy(argv[i + 1])) >= 0)
+            {
+                options.policy = policy;
+                i++;
+            }
+            else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc - 1 && (options.deferred_high = atoi(argv[i + 1])) >= 0)
+                i++;
+            else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc - 1)
+                options.extfrag_threshold = atoi(argv[++i]);
+            else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc - 1 && (options.readahead = atoi(argv[i + 1])) >= 0 &&
+                     options.readahead <= READAHEAD_MAX_WINDOW)
+                i++;
+            else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc - 1)
+                options.batch_size = atoi(argv[++i]);
+            else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc - 1)
+                options.swap_path = argv[++i];
+            else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc - 1)
+                options.restore_path = argv[++i];
+            else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc - 1)
+                options.save_path = argv[++i];
+            else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc - 1 &&
+                     sscanf(argv[i + 1], "%d,%d", &options.cma_order, &options.cma_min_order) >= 1 && options.cma_order >= 0)
+                i++;
+            else if (strcmp(argv[i], "-z") == 0 && i + 1 < argc - 1 && (options.zswap_percent = atoi(argv[i + 1])) > 0)
+                i++;
+            else
+                break;
+        }
+        if (i == argc - 1)
+            exit(replay_binary(argv[argc - 1], &options));
+    }
+
+    usage(argv[0]);
+    exit(EXIT_FAILURE);
+
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,134 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include "allocator.h"
+
+// the calling thread's cache, valid only for the allocator it was created for
+static __thread pcp_cache_t *current_pcp;
+
+// get_pcp_cache returns the calling thread's cache for allocator, creating
+// and registering it on first use.
+pcp_cache_t *get_pcp_cache(buddy_allocator_t *allocator) {
+    if (current_pcp != NULL && current_pcp->allocator == allocator)
+        return current_pcp;
+
+    pthread_t self = pthread_self();
+    pthread_mutex_lock(&allocator->pcp_list_lock);
+
+    pcp_cache_t *pcp = allocator->pcp_caches;
+    while (pcp != NULL && !pthread_equal(pcp->thread, self))
+        pcp = pcp->next;
+
+    if (pcp == NULL) {
+        pcp = (pcp_cache_t*)calloc(1, sizeof(pcp_cache_t));
+        pthread_mutex_init(&pcp->lock, NULL);
+        pcp->thread = self;
+        pcp->allocator = allocator;
+        pcp->next = allocator->pcp_caches;
+        allocator->pcp_caches = pcp;
+    }
+
+    pthread_mutex_unlock(&allocator->pcp_list_lock);
+    current_pcp = pcp;
+    return pcp;
+}
+
+// _pcp_refill moves up to PCP_BATCH blocks of order from the buddy free lists
+// into the cache under a single acquisition of the allocator lock.
+static void _pcp_refill(pcp_cache_t *pcp, int order) {
+    buddy_allocator_t *allocator = pcp->allocator;
+
+    pthread_mutex_lock(&allocator->lock);
+    for (int i = 0; i < PCP_BATCH; i++) {
+        block_descriptor_t *block = _allocate_block(allocator, order);
+        if (block == NULL)
+            break;
+        block->next = pcp->lists[order];
+        pcp->lists[order] = block;
+        pcp->count[order]++;
+    }
+    pthread_mutex_unlock(&allocator->lock);
+}
+
+// _pcp_drain returns up to nr_blocks blocks of order to the buddy free lists.
+static void _pcp_drain(pcp_cache_t *pcp, int order, int nr_blocks) {
+    buddy_allocator_t *allocator = pcp->allocator;
+
+    pthread_mutex_lock(&allocator->lock);
+    for (int i = 0; i < nr_blocks && pcp->lists[order] != NULL; i++) {
+        block_descriptor_t *block = pcp->lists[order];
+        pcp->lists[order] = block->next;
+        pcp->count[order]--;
+        block->next = NULL;
+        _free_block(allocator, block);
+    }
+    pthread_mutex_unlock(&allocator->lock);
+}
+
+block_descriptor_t *pcp_alloc_block(pcp_cache_t *pcp, int order) {
+    pthread_mutex_lock(&pcp->lock);
+
+    if (pcp->lists[order] == NULL)
+        _pcp_refill(pcp, order);
+
+    block_descriptor_t *block = pcp->lists[order];
+    if (block != NULL) {
+        pcp->lists[order] = block->next;
+        pcp->count[order]--;
+        block->next = NULL;
+    }
+
+    pthread_mutex_unlock(&pcp->lock);
+    return block;
+}
+
+void pcp_free_block(pcp_cache_t *pcp, block_descriptor_t *block) {
+    int order = block->order;
+    pthread_mutex_lock(&pcp->lock);
+
+    block->next = pcp->lists[order];
+    pcp->lists[order] = block;
+    pcp->count[order]++;
+
+    if (pcp->count[order] > PCP_HIGH)
+        _pcp_drain(pcp, order, PCP_BATCH);
+
+    pthread_mutex_unlock(&pcp->lock);
+}
+
+// drain_local_pcp empties the calling thread's cache, if it has one.
+void drain_local_pcp(buddy_allocator_t *allocator) {
+    if (current_pcp == NULL || current_pcp->allocator != allocator)
+        return;
+
+    pthread_mutex_lock(&current_pcp->lock);
+    for (int order = 0; order <= PCP_MAX_ORDER; order++)
+        _pcp_drain(current_pcp, order, current_pcp->count[order]);
+    pthread_mutex_unlock(&current_pcp->lock);
+}
+
+// drain_all_pcp empties every thread's cache, so that blocks stranded in
+// other threads' caches can merge and satisfy a failing allocation.
+void drain_all_pcp(buddy_allocator_t *allocator) {
+    pthread_mutex_lock(&allocator->pcp_list_lock);
+    for (pcp_cache_t *pcp = allocator->pcp_caches; pcp != NULL; pcp = pcp->next) {
+        pthread_mutex_lock(&pcp->lock);
+        for (int order = 0; order <= PCP_MAX_ORDER; order++)
+            _pcp_drain(pcp, order, pcp->count[order]);
+        pthread_mutex_unlock(&pcp->lock);
+    }
+    pthread_mutex_unlock(&allocator->pcp_list_lock);
+}
+
+// _destroy_pcp_caches frees every thread's cache, with whatever blocks they
+// still hold. Only the calling thread forgets its cache, the others must
+// have exited.
+void _destroy_pcp_caches(buddy_allocator_t *allocator) {
+    while (allocator->pcp_caches != NULL) {
+        pcp_cache_t *pcp = allocator->pcp_caches;
+        allocator->pcp_caches = pcp->next;
+        if (pcp == current_pcp)
+            current_pcp = NULL;
+        pthread_mutex_destroy(&pcp->lock);
+        free(pcp);
+    }
+}
@@ -0,0 +1,64 @@
+#include <stdlib.h>
+#include "pool.h"
+
+// Each chunk starts with a pointer to the previous chunk, followed by
+// objects_per_chunk objects.
+#define CHUNK_HEADER_SIZE sizeof(void*)
+
+object_pool_t *new_object_pool(size_t object_size, int objects_per_chunk) {
+    object_pool_t *pool = (object_pool_t*)malloc(sizeof(object_pool_t));
+
+    // every free object must be able to hold the free list link
+    if (object_size < sizeof(void*))
+        object_size = sizeof(void*);
+    // keep objects pointer aligned
+    object_size = (object_size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+
+    pool->object_size = object_size;
+    pool->objects_per_chunk = objects_per_chunk;
+    pool->free_objects = NULL;
+    pool->chunks = NULL;
+    return pool;
+}
+
+static int _grow_pool(object_pool_t *pool) {
+    char *chunk = (char*)malloc(CHUNK_HEADER_SIZE + pool->object_size * pool->objects_per_chunk);
+    if (chunk == NULL)
+        return -1;
+
+    *(void**)chunk = pool->chunks;
+    pool->chunks = chunk;
+
+    // thread the new objects onto the free list, first object on top
+    char *objects = chunk + CHUNK_HEADER_SIZE;
+    for (int i = pool->objects_per_chunk - 1; i >= 0; i--) {
+        void *object = objects + i * pool->object_size;
+        *(void**)object = pool->free_objects;
+        pool->free_objects = object;
+    }
+    return 0;
+}
+
+void *pool_alloc(object_pool_t *pool) {
+    if (pool->free_objects == NULL && _grow_pool(pool) != 0)
+        return NULL;
+
+    void *object = pool->free_objects;
+    pool->free_objects = *(void**)object;
+    return object;
+}
+
+void pool_free(object_pool_t *pool, void *object) {
+    *(void**)object = pool->free_objects;
+    pool->free_objects = object;
+}
+
+// destroy_object_pool frees every chunk, with the objects still handed out.
+void destroy_object_pool(object_pool_t *pool) {
+    while (pool->chunks != NULL) {
+        void *chunk = pool->chunks;
+        pool->chunks = *(void**)chunk;
+        free(chunk);
+    }
+    free(pool);
+}
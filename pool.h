@@ -0,0 +1,22 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+// object_pool hands out fixed-size objects carved from large chunks.
+// Freed objects go onto a free list threaded through their first word and
+// are reused before a new chunk is requested, so steady-state alloc/free
+// never reaches malloc and memory use stays at the high-water mark.
+typedef struct object_pool {
+    size_t object_size;
+    int objects_per_chunk;
+    void *free_objects;
+    void *chunks;
+} object_pool_t;
+
+object_pool_t *new_object_pool(size_t object_size, int objects_per_chunk);
+void *pool_alloc(object_pool_t *pool);
+void pool_free(object_pool_t *pool, void *object);
+void destroy_object_pool(object_pool_t *pool);
+
+#endif
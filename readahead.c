@@ -0,0 +1,151 @@
+#include "allocator.h"
+
+// Readahead swaps evicted blocks back in before they are accessed, like
+// Linux swap readahead, so that a fault is followed by hits instead of more
+// faults. It watches the stream of seq_nos that fault, or hit a block read
+// ahead, which is where the stream would have faulted next:
+// - two steps of the same stride in a row predict the stream goes on with
+//   it, which covers sequential and strided scans,
+// - otherwise every seq_no remembers which one came after it the last time,
+//   and the stream is predicted to repeat that chain.
+// Up to readahead_window evicted blocks predicted next are swapped in. Each
+// block read ahead that gets accessed doubles the window, up to
+// readahead_max, and each that is evicted or freed unused halves it.
+//
+// Blocks are read into pages to spare above the low watermark. When memory
+// is full, as it is between faults without kswapd, none are to spare, so a
+// stream that goes where it was predicted to may also reclaim a block for
+// each block it reads, as long as its window is over 1. A stream that
+// starts going where predicted is given a window of 2 to try. If the
+// blocks it reads are evicted before use, as when the replacement policy
+// protects what is in memory from scans, its window soon drops back to 1.
+
+// set_readahead turns readahead on with windows of up to max_window blocks,
+// or off with 0. Returns -1 if max_window is over READAHEAD_MAX_WINDOW.
+int set_readahead(buddy_allocator_t *allocator, int max_window) {
+    if (max_window < 0 || max_window > READAHEAD_MAX_WINDOW)
+        return -1;
+    allocator->readahead_max = max_window;
+    allocator->readahead_window = max_window > 0 ? 1 : 0;
+    allocator->readahead_history[0] = -1;
+    allocator->readahead_history[1] = -1;
+    allocator->readahead_predicted = 0;
+    return 0;
+}
+
+// _readahead_get_block takes a block of order to read into, reclaiming for
+// it only if confident, see above.
+static block_descriptor_t *_readahead_get_block(buddy_allocator_t *allocator, int order, int confident) {
+    if (free_page_count(allocator) - (1L << order) >= allocator->watermark[WMARK_LOW]) {
+        block_descriptor_t *block = _get_block(allocator, order);
+        if (block != NULL)
+            return block;
+    }
+    unsigned long long wasted = allocator->stats.readahead_wasted;
+    if (!confident || reclaim(allocator) != 0)
+        return NULL;
+    count_event(allocator, direct_reclaims);
+    // the policy can't hold more blocks read ahead than it just gave up
+    if (allocator->stats.readahead_wasted != wasted)
+        return NULL;
+    return _get_block(allocator, order);
+}
+
+// _readahead_block swaps in entry's evicted block ahead of an access.
+// Returns -1 if there is no block for it, or the replacement policy has no
+// room left.
+static int _readahead_block(buddy_allocator_t *allocator, seq_entry_t *entry, int confident) {
+    int order = entry->evicted_block->order;
+    unsigned active, inactive;
+    allocator->policy_ops->sizes(allocator->policy, &active, &inactive);
+    if (active + inactive >= 2 * (unsigned)allocator->lru_entries)
+        return -1;
+    block_descriptor_t *block = _readahead_get_block(allocator, order, confident);
+    if (block == NULL)
+        return -1;
+
+    entry->allocated_block = block;
+    block->seq_no = entry->seq_no;
+    if (allocator->swap != NULL)
+        _load_evicted(allocator, entry, -1, block_address(allocator, block));
+    if (allocator->partial_eviction)
+        _clear_page_flags(allocator, block);
+    block_descriptor_t *evicted_block = entry->evicted_block;
+    entry->evicted_block = NULL;
+
+    // the block has not been used again yet: it starts over as a new one,
+    // a ghost hit would credit it with a reuse
+    if (entry->lru_node != NULL)
+        allocator->policy_ops->forget(allocator->policy, entry);
+    block_descriptor_t *victim = allocator->policy_ops->admit(allocator->policy, entry, 0);
+    pool_free(allocator->evicted_block_pool, evicted_block);
+    entry->readahead = 1;
+    count_event(allocator, readahead_blocks);
+    if (victim != NULL)
+        _evict_block(allocator, victim);
+    return 0;
+}
+
+// _readahead records that the stream reached entry, which just faulted or
+// hit a block read ahead, and swaps in the evicted blocks predicted to come
+// next. Called with lru_lock held.
+void _readahead(buddy_allocator_t *allocator, seq_entry_t *entry) {
+    long long *history = allocator->readahead_history;
+    long long stride = entry->seq_no - history[0];
+    int strided = history[1] >= 0 && stride != 0 && history[0] - history[1] == stride;
+    int predicted = strided;
+    if (history[0] >= 0 && stride != 0) {
+        seq_entry_t *prev = seq_map_find(allocator->seq_map, history[0]);
+        if (prev != NULL) {
+            predicted |= prev->next_fault == entry->seq_no;
+            prev->next_fault = entry->seq_no;
+        }
+    }
+    history[1] = history[0];
+    history[0] = entry->seq_no;
+    // a stream that starts going where predicted gets a window to try
+    if (predicted && !allocator->readahead_predicted && allocator->readahead_window < 2)
+        allocator->readahead_window = 2 < allocator->readahead_max ? 2 : allocator->readahead_max;
+    allocator->readahead_predicted = predicted;
+    int confident = predicted && allocator->readahead_window > 1;
+
+    // neither readahead nor the evictions it causes add or remove entries
+    long long seq_no = entry->seq_no;
+    seq_entry_t *ahead = entry;
+    for (int i = 0; i < allocator->readahead_window; i++) {
+        if (strided) {
+            seq_no += stride;
+            if (seq_no < 0)
+                break;
+        } else {
+            if (ahead == NULL || ahead->next_fault < 0 || ahead->next_fault == entry->seq_no)
+                break;
+            seq_no = ahead->next_fault;
+        }
+        ahead = seq_map_find(allocator->seq_map, seq_no);
+        if (ahead == NULL || ahead->allocated_block != NULL || ahead->evicted_block == NULL || ahead->sparse != NULL)
+            continue;
+        if (_readahead_block(allocator, ahead, confident) != 0)
+            break;
+    }
+}
+
+// _readahead_hit is called on the first access to a block read ahead
+void _readahead_hit(buddy_allocator_t *allocator, seq_entry_t *entry) {
+    entry->readahead = 0;
+    count_event(allocator, readahead_hits);
+    if (allocator->readahead_window < allocator->readahead_max)
+        allocator->readahead_window *= 2;
+    if (allocator->readahead_window > allocator->readahead_max)
+        allocator->readahead_window = allocator->readahead_max;
+    _readahead(allocator, entry);
+}
+
+// _readahead_unused is called when a block read ahead is evicted or freed
+// before anything accessed it
+void _readahead_unused(buddy_allocator_t *allocator, seq_entry_t *entry) {
+    entry->readahead = 0;
+    count_event(allocator, readahead_wasted);
+    if (allocator->readahead_window > 1)
+        allocator->readahead_window /= 2;
+}
@@ -0,0 +1,210 @@
+#include <stdlib.h>
+#include <string.h>
+#include "seq_map.h"
+
+// grow once a table is 7/8 full
+#define SEQ_MAP_MAX_LOAD_NUM 7
+#define SEQ_MAP_MAX_LOAD_DEN 8
+// minimum entries moved out of the old table per insert/remove while resizing
+#define SEQ_MAP_MIGRATE_BATCH 8
+
+static size_t _hash(long long seq_no) {
+    // splitmix64 finalizer, spreads sequential ids across the table
+    unsigned long long x = (unsigned long long)seq_no;
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return (size_t)x;
+}
+
+static void _init_table(seq_table_t *table, size_t capacity) {
+    table->slots = (seq_slot_t*)calloc(capacity, sizeof(seq_slot_t));
+    table->capacity = capacity;
+    table->count = 0;
+}
+
+static seq_slot_t *_table_find(seq_table_t *table, long long seq_no) {
+    if (table->slots == NULL)
+        return NULL;
+
+    size_t mask = table->capacity - 1;
+    size_t index = _hash(seq_no) & mask;
+    for (unsigned dist = 1; ; dist++) {
+        seq_slot_t *slot = &table->slots[index];
+        // an entry this far from home would have displaced the current one
+        if (slot->dist < dist)
+            return NULL;
+        if (slot->entry.seq_no == seq_no)
+            return slot;
+        index = (index + 1) & mask;
+    }
+}
+
+// _table_insert places entry, which must not already be in the table, and
+// returns the slot where it ended up.
+static seq_slot_t *_table_insert(seq_table_t *table, seq_entry_t entry) {
+    size_t mask = table->capacity - 1;
+    size_t index = _hash(entry.seq_no) & mask;
+    seq_slot_t carried = { 1, entry };
+    seq_slot_t *placed = NULL;
+
+    for (;;) {
+        seq_slot_t *slot = &table->slots[index];
+        if (slot->dist == 0) {
+            *slot = carried;
+            table->count++;
+            return placed != NULL ? placed : slot;
+        }
+        // take from the rich: displace entries closer to their home
+        if (slot->dist < carried.dist) {
+            seq_slot_t displaced = *slot;
+            *slot = carried;
+            carried = displaced;
+            if (placed == NULL)
+                placed = slot;
+        }
+        carried.dist++;
+        index = (index + 1) & mask;
+    }
+}
+
+static void _table_remove(seq_table_t *table, seq_slot_t *slot) {
+    size_t mask = table->capacity - 1;
+    size_t index = slot - table->slots;
+
+    // shift the following entries of the cluster back by one
+    for (;;) {
+        size_t next = (index + 1) & mask;
+        if (table->slots[next].dist <= 1)
+            break;
+        table->slots[index] = table->slots[next];
+        table->slots[index].dist--;
+        index = next;
+    }
+    table->slots[index].dist = 0;
+    table->count--;
+}
+
+// _migrate moves whole clusters from the old table into the new one until at
+// least batch entries have moved. Lookups in the old table rely on a cluster
+// never being left half migrated.
+static void _migrate(seq_map_t *map, size_t batch) {
+    seq_table_t *old_table = &map->old_table;
+    size_t mask = old_table->capacity - 1;
+    size_t moved = 0;
+
+    while (map->migrate_scanned < old_table->capacity) {
+        seq_slot_t *slot = &old_table->slots[map->migrate_cursor];
+        if (slot->dist == 0 && moved >= batch)
+            break;
+
+        if (slot->dist != 0) {
+            _table_insert(&map->table, slot->entry);
+            slot->dist = 0;
+            old_table->count--;
+            moved++;
+        }
+        map->migrate_cursor = (map->migrate_cursor + 1) & mask;
+        map->migrate_scanned++;
+    }
+
+    if (map->migrate_scanned == old_table->capacity) {
+        free(old_table->slots);
+        old_table->slots = NULL;
+        old_table->capacity = 0;
+        old_table->count = 0;
+    }
+}
+
+static void _start_resize(seq_map_t *map) {
+    // a resize still running is finished first, it is at most one table's worth
+    if (map->old_table.slots != NULL)
+        _migrate(map, map->old_table.capacity);
+
+    map->old_table = map->table;
+    _init_table(&map->table, map->old_table.capacity * 2);
+
+    // begin migrating at an empty slot so no cluster is split
+    size_t cursor = 0;
+    while (map->old_table.slots[cursor].dist != 0)
+        cursor++;
+    map->migrate_cursor = cursor;
+    map->migrate_scanned = 0;
+}
+
+seq_map_t *new_seq_map(size_t initial_capacity) {
+    size_t capacity = 16;
+    while (capacity < initial_capacity)
+        capacity <<= 1;
+
+    seq_map_t *map = (seq_map_t*)malloc(sizeof(seq_map_t));
+    _init_table(&map->table, capacity);
+    memset(&map->old_table, 0, sizeof(seq_table_t));
+    map->migrate_cursor = 0;
+    map->migrate_scanned = 0;
+    return map;
+}
+
+// destroy_seq_map frees the map. Whatever its entries point to is the
+// caller's to free first.
+void destroy_seq_map(seq_map_t *map) {
+    free(map->table.slots);
+    free(map->old_table.slots);
+    free(map);
+}
+
+size_t seq_map_count(seq_map_t *map) {
+    return map->table.count + map->old_table.count;
+}
+
+seq_entry_t *seq_map_find(seq_map_t *map, long long seq_no) {
+    seq_slot_t *slot = _table_find(&map->table, seq_no);
+    if (slot == NULL)
+        slot = _table_find(&map->old_table, seq_no);
+    return slot != NULL ? &slot->entry : NULL;
+}
+
+// seq_map_insert returns the entry for seq_no, adding an empty one if needed.
+seq_entry_t *seq_map_insert(seq_map_t *map, long long seq_no) {
+    if (map->old_table.slots != NULL)
+        _migrate(map, SEQ_MAP_MIGRATE_BATCH);
+
+    seq_entry_t *existing = seq_map_find(map, seq_no);
+    if (existing != NULL)
+        return existing;
+
+    if ((map->table.count + 1) * SEQ_MAP_MAX_LOAD_DEN > map->table.capacity * SEQ_MAP_MAX_LOAD_NUM)
+        _start_resize(map);
+
+    seq_entry_t entry = { seq_no, NULL, NULL, NULL, 0, NULL, NULL, NULL, -1, 0 };
+    return &_table_insert(&map->table, entry)->entry;
+}
+
+void seq_map_remove(seq_map_t *map, long long seq_no) {
+    if (map->old_table.slots != NULL)
+        _migrate(map, SEQ_MAP_MIGRATE_BATCH);
+
+    seq_slot_t *slot = _table_find(&map->table, seq_no);
+    if (slot != NULL) {
+        _table_remove(&map->table, slot);
+        return;
+    }
+    slot = _table_find(&map->old_table, seq_no);
+    if (slot != NULL)
+        _table_remove(&map->old_table, slot);
+}
+
+// seq_map_next returns the next entry after those *cursor has been moved
+// past, or NULL once every entry was returned, in no particular order.
+seq_entry_t *seq_map_next(seq_map_t *map, size_t *cursor) {
+    while (*cursor < map->table.capacity + map->old_table.capacity) {
+        size_t index = (*cursor)++;
+        seq_slot_t *slot = index < map->table.capacity ? &map->table.slots[index]
+                                                       : &map->old_table.slots[index - map->table.capacity];
+        if (slot->dist != 0)
+            return &slot->entry;
+    }
+    return NULL;
+}
@@ -0,0 +1,55 @@
+#ifndef SEQ_MAP_H
+#define SEQ_MAP_H
+
+#include <stddef.h>
+
+// seq_entry holds everything the allocator and its LRU lists track for one
+// request id. A seq_no is allocated, evicted, or neither (entry removed). A
+// split block may also be partly evicted, see sparse_block.
+typedef struct seq_entry {
+    long long seq_no;
+    struct block_descriptor *allocated_block; // in-memory block, NULL if evicted
+    struct block_descriptor *evicted_block; // order of a swapped out block
+    struct lru_node *lru_node; // node in whichever lru list holds the block
+    unsigned long long shadow; // replacement policy's record of the eviction, e.g. its time
+    struct swap_extent *swap; // contents of the evicted block, if the allocator has swap
+    struct zswap_entry *zswap; // or compressed contents, if it has zswap
+    struct sparse_block *sparse; // set once the block has been split to evict some of its pages
+    long long next_fault; // seq_no that faulted right after this one last time, -1 if none, for readahead
+    int readahead; // swapped in by readahead and not accessed since
+} seq_entry_t;
+
+typedef struct seq_slot {
+    unsigned dist; // 1 + distance from home slot, 0 if empty
+    seq_entry_t entry;
+} seq_slot_t;
+
+typedef struct seq_table {
+    seq_slot_t *slots;
+    size_t capacity; // power of two
+    size_t count;
+} seq_table_t;
+
+// seq_map is an open-addressing Robin Hood hash map keyed by 64-bit seq_no.
+// Deletion uses backward shifting, so there are no tombstones. Growing does
+// not rehash at once: new entries go to a table twice the size and every
+// insert/remove migrates a few whole probe clusters from the old table,
+// while lookups check both.
+typedef struct seq_map {
+    seq_table_t table;
+    seq_table_t old_table; // slots == NULL unless a resize is in progress
+    size_t migrate_cursor; // old_table slot to migrate next, always a cluster boundary
+    size_t migrate_scanned; // old_table slots visited so far
+} seq_map_t;
+
+seq_map_t *new_seq_map(size_t initial_capacity);
+void destroy_seq_map(seq_map_t *map);
+size_t seq_map_count(seq_map_t *map);
+// The returned entry is only valid until the next seq_map_insert/seq_map_remove.
+seq_entry_t *seq_map_find(seq_map_t *map, long long seq_no);
+seq_entry_t *seq_map_insert(seq_map_t *map, long long seq_no);
+void seq_map_remove(seq_map_t *map, long long seq_no);
+// Walks every entry, starting from *cursor 0, as long as the map is unchanged.
+seq_entry_t *seq_map_next(seq_map_t *map, size_t *cursor);
+
+#endif
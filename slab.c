@@ -0,0 +1,434 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "allocator.h"
+#include "util.h"
+
+// The slab layer hands out objects smaller than a page, which would
+// otherwise take a whole order 0 block each. A slab cache takes blocks for
+// its slabs with _get_unmovable_block and gives empty ones back with
+// _put_block, and in between serves objects from them without touching
+// the buddy free lists. Slab pages belong to no seq_no, so the replacement
+// policy never evicts them and compaction never moves them.
+
+#define BITS_PER_WORD (8 * sizeof(unsigned long))
+#define SLAB_MAGAZINE_SLOTS 8 // caches whose magazine a thread finds without a lookup
+
+static unsigned long next_cache_id;
+
+// the calling thread's magazines of the caches it used last, one slot per
+// cache id modulo SLAB_MAGAZINE_SLOTS, valid while cache_id matches
+static __thread struct {
+    unsigned long cache_id;
+    slab_magazine_t *magazine;
+} current_magazines[SLAB_MAGAZINE_SLOTS];
+
+static void _lock_cache(slab_cache_t *cache) {
+    if (cache->allocator->concurrency != SINGLE_THREADED)
+        pthread_mutex_lock(&cache->lock);
+}
+
+static void _unlock_cache(slab_cache_t *cache) {
+    if (cache->allocator->concurrency != SINGLE_THREADED)
+        pthread_mutex_unlock(&cache->lock);
+}
+
+static void _lock_slab_caches(buddy_allocator_t *allocator) {
+    if (allocator->concurrency != SINGLE_THREADED)
+        pthread_mutex_lock(&allocator->slab_lock);
+}
+
+static void _unlock_slab_caches(buddy_allocator_t *allocator) {
+    if (allocator->concurrency != SINGLE_THREADED)
+        pthread_mutex_unlock(&allocator->slab_lock);
+}
+
+// _slab_order picks the smallest order up to max_order whose slab wastes at
+// most an eighth of itself after the last object, as SLUB does.
+static int _slab_order(int object_size, int max_order) {
+    int order = 0;
+    while (order < max_order && (PAGE_SIZE << order) % object_size > (PAGE_SIZE << order) / 8)
+        order++;
+    return order;
+}
+
+// new_slab_cache creates a cache named name for objects of object_size
+// bytes, up to PAGE_SIZE. Returns NULL if the size is out of range or the
+// allocator already has a cache of that name.
+slab_cache_t *new_slab_cache(buddy_allocator_t *allocator, const char *name, int object_size) {
+    if (object_size <= 0 || object_size > PAGE_SIZE || strlen(name) >= SLAB_NAME_LEN)
+        return NULL;
+
+    slab_cache_t *cache = (slab_cache_t*)calloc(1, sizeof(slab_cache_t));
+    strcpy(cache->name, name);
+    cache->id = __atomic_add_fetch(&next_cache_id, 1, __ATOMIC_RELAXED);
+    cache->allocator = allocator;
+    cache->object_size = (object_size + SLAB_ALIGN - 1) / SLAB_ALIGN * SLAB_ALIGN;
+    int max_order = allocator->max_order < SLAB_MAX_ORDER ? allocator->max_order : SLAB_MAX_ORDER;
+    cache->order = _slab_order(cache->object_size, max_order);
+    cache->objects_per_slab = (PAGE_SIZE << cache->order) / cache->object_size;
+    cache->slabs = (slab_t**)calloc((allocator->total_pages >> cache->order) + 1, sizeof(slab_t*));
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_mutex_init(&cache->magazine_list_lock, NULL);
+
+    _lock_slab_caches(allocator);
+    slab_cache_t *other = allocator->slab_caches;
+    while (other != NULL && strcmp(other->name, name) != 0)
+        other = other->next;
+    if (other == NULL) {
+        cache->next = allocator->slab_caches;
+        allocator->slab_caches = cache;
+    }
+    _unlock_slab_caches(allocator);
+
+    if (other != NULL) {
+        free(cache->slabs);
+        free(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+static void _list_add(slab_list_t *list, slab_t *slab) {
+    slab->list = list;
+    slab->prev = NULL;
+    slab->next = list->head;
+    if (list->head != NULL)
+        list->head->prev = slab;
+    list->head = slab;
+    list->size++;
+}
+
+static void _list_del(slab_t *slab) {
+    slab_list_t *list = slab->list;
+    if (slab->prev != NULL)
+        slab->prev->next = slab->next;
+    else
+        list->head = slab->next;
+    if (slab->next != NULL)
+        slab->next->prev = slab->prev;
+    list->size--;
+    slab->list = NULL;
+}
+
+static void _list_move(slab_list_t *list, slab_t *slab) {
+    _list_del(slab);
+    _list_add(list, slab);
+}
+
+// _get_slab_block takes a block of order for a new slab, compacting or
+// reclaiming as allocate_pages does until there is one. Returns NULL if
+// nothing is left to reclaim.
+static block_descriptor_t *_get_slab_block(buddy_allocator_t *allocator, int order) {
+    _balance_free_pages(allocator, order, 0);
+    block_descriptor_t *block = _get_unmovable_block(allocator, order);
+
+    while (block == NULL) {
+        _lock_lru(allocator);
+        // slabs never go in the reserved region, emptying it is no use
+        int compacted = try_compaction(allocator, order) == 0;
+        int reclaimed = compacted ? 0 : reclaim(allocator);
+        _unlock_lru(allocator);
+        if (reclaimed != 0) {
+            count_event(allocator, failed_allocations);
+            alloc_log("Sorry, failed to allocate a slab \n");
+            return NULL;
+        }
+        if (!compacted)
+            count_event(allocator, direct_reclaims);
+        block = _get_unmovable_block(allocator, order);
+    }
+    return block;
+}
+
+// _new_slab makes a slab of every object of cache free, not yet on a list.
+// Called without the cache lock, reclaim may take a while.
+static slab_t *_new_slab(slab_cache_t *cache) {
+    block_descriptor_t *block = _get_slab_block(cache->allocator, cache->order);
+    if (block == NULL)
+        return NULL;
+
+    int words = (cache->objects_per_slab + BITS_PER_WORD - 1) / BITS_PER_WORD;
+    slab_t *slab = (slab_t*)calloc(1, sizeof(slab_t));
+    slab->block = block;
+    slab->nr_free = cache->objects_per_slab;
+    slab->free_map = (unsigned long*)calloc(words, sizeof(unsigned long));
+    for (int i = 0; i < cache->objects_per_slab; i++)
+        slab->free_map[i / BITS_PER_WORD] |= 1UL << (i % BITS_PER_WORD);
+    return slab;
+}
+
+// _release_slab gives an empty slab's block back, with the cache lock
+// released.
+static void _release_slab(slab_cache_t *cache, slab_t *slab) {
+    _put_block(cache->allocator, slab->block);
+    free(slab->free_map);
+    free(slab);
+}
+
+// _unlink_slab takes a slab off its list and out of cache. Called with the
+// cache lock held.
+static void _unlink_slab(slab_cache_t *cache, slab_t *slab) {
+    _list_del(slab);
+    cache->slabs[slab->block->first_page_address >> cache->order] = NULL;
+    cache->nr_slabs--;
+}
+
+// _take_object takes a free object from the fullest kind of slab that has
+// one. Called with the cache lock held. Returns -1 if every slab is full.
+static long _take_object(slab_cache_t *cache) {
+    slab_t *slab = cache->partial.head != NULL ? cache->partial.head : cache->empty.head;
+    if (slab == NULL)
+        return -1;
+
+    int word = 0;
+    while (slab->free_map[word] == 0)
+        word++;
+    int index = word * BITS_PER_WORD + __builtin_ctzl(slab->free_map[word]);
+    slab->free_map[word] &= ~(1UL << (index % BITS_PER_WORD));
+    slab->nr_free--;
+    cache->nr_active++;
+
+    if (slab->nr_free == 0)
+        _list_move(&cache->full, slab);
+    else if (slab->list == &cache->empty)
+        _list_move(&cache->partial, slab);
+    return (long)slab->block->first_page_address * PAGE_SIZE + (long)index * cache->object_size;
+}
+
+// _alloc_objects takes up to nr_objects objects into objects, adding slabs
+// as needed. Returns how many it took, fewer only once no slab can be had.
+static int _alloc_objects(slab_cache_t *cache, long *objects, int nr_objects) {
+    int nr_taken = 0;
+    _lock_cache(cache);
+    while (nr_taken < nr_objects) {
+        long object = _take_object(cache);
+        if (object >= 0) {
+            objects[nr_taken++] = object;
+            continue;
+        }
+
+        _unlock_cache(cache);
+        slab_t *slab = _new_slab(cache);
+        _lock_cache(cache);
+        if (slab == NULL)
+            break;
+        cache->slabs[slab->block->first_page_address >> cache->order] = slab;
+        cache->nr_slabs++;
+        _list_add(&cache->empty, slab);
+    }
+    _unlock_cache(cache);
+    return nr_taken;
+}
+
+// _find_slab returns the slab object was taken from, NULL if object is not
+// one of cache's.
+static slab_t *_find_slab(slab_cache_t *cache, long object) {
+    if (object < 0 || object >= (long)cache->allocator->total_pages * PAGE_SIZE)
+        return NULL;
+    slab_t *slab = cache->slabs[(object / PAGE_SIZE) >> cache->order];
+    if (slab == NULL)
+        return NULL;
+    long offset = object - (long)slab->block->first_page_address * PAGE_SIZE;
+    if (offset % cache->object_size != 0 || offset / cache->object_size >= cache->objects_per_slab)
+        return NULL;
+    return slab;
+}
+
+// _put_object returns object to its slab. Called with the cache lock held.
+// Returns a slab to release if that left more than SLAB_MAX_EMPTY empty,
+// otherwise NULL.
+static slab_t *_put_object(slab_cache_t *cache, long object) {
+    slab_t *slab = _find_slab(cache, object);
+    int index = slab == NULL ? 0 : (int)((object - (long)slab->block->first_page_address * PAGE_SIZE) / cache->object_size);
+    if (slab == NULL || (slab->free_map[index / BITS_PER_WORD] & (1UL << (index % BITS_PER_WORD))) != 0) {
+        alloc_log("Sorry, object %ld is not allocated from %s \n", object, cache->name);
+        return NULL;
+    }
+
+    slab->free_map[index / BITS_PER_WORD] |= 1UL << (index % BITS_PER_WORD);
+    slab->nr_free++;
+    cache->nr_active--;
+
+    if (slab->nr_free == cache->objects_per_slab) {
+        _list_move(&cache->empty, slab);
+        if (cache->empty.size > SLAB_MAX_EMPTY) {
+            _unlink_slab(cache, slab);
+            return slab;
+        }
+    } else if (slab->list == &cache->full) {
+        _list_move(&cache->partial, slab);
+    }
+    return NULL;
+}
+
+// _free_objects returns nr_objects objects to their slabs under one hold of
+// the cache lock, releasing the slabs left empty after it.
+static void _free_objects(slab_cache_t *cache, const long *objects, int nr_objects) {
+    if (nr_objects == 0)
+        return;
+    slab_t *released[nr_objects];
+    int nr_released = 0;
+
+    _lock_cache(cache);
+    for (int i = 0; i < nr_objects; i++) {
+        slab_t *slab = _put_object(cache, objects[i]);
+        if (slab != NULL)
+            released[nr_released++] = slab;
+    }
+    _unlock_cache(cache);
+
+    for (int i = 0; i < nr_released; i++)
+        _release_slab(cache, released[i]);
+}
+
+// _get_magazine returns the calling thread's magazine for cache, creating
+// and registering it on first use.
+static slab_magazine_t *_get_magazine(slab_cache_t *cache) {
+    int slot = cache->id % SLAB_MAGAZINE_SLOTS;
+    if (current_magazines[slot].cache_id == cache->id)
+        return current_magazines[slot].magazine;
+
+    pthread_t self = pthread_self();
+    pthread_mutex_lock(&cache->magazine_list_lock);
+
+    slab_magazine_t *magazine = cache->magazines;
+    while (magazine != NULL && !pthread_equal(magazine->thread, self))
+        magazine = magazine->next;
+
+    if (magazine == NULL) {
+        magazine = (slab_magazine_t*)calloc(1, sizeof(slab_magazine_t));
+        pthread_mutex_init(&magazine->lock, NULL);
+        magazine->thread = self;
+        magazine->next = cache->magazines;
+        cache->magazines = magazine;
+    }
+
+    pthread_mutex_unlock(&cache->magazine_list_lock);
+    current_magazines[slot].cache_id = cache->id;
+    current_magazines[slot].magazine = magazine;
+    return magazine;
+}
+
+// slab_alloc allocates an object from cache, from the calling thread's
+// magazine in the concurrent modes. Returns -1 if no slab can be had.
+long slab_alloc(slab_cache_t *cache) {
+    long object = -1;
+    if (cache->allocator->concurrency == SINGLE_THREADED) {
+        _alloc_objects(cache, &object, 1);
+        return object;
+    }
+
+    slab_magazine_t *magazine = _get_magazine(cache);
+    pthread_mutex_lock(&magazine->lock);
+    if (magazine->count == 0)
+        magazine->count = _alloc_objects(cache, magazine->objects, SLAB_MAGAZINE_BATCH);
+    if (magazine->count > 0)
+        object = magazine->objects[--magazine->count];
+    pthread_mutex_unlock(&magazine->lock);
+    return object;
+}
+
+// slab_free frees an object allocated from cache. In the concurrent modes it
+// goes to the calling thread's magazine, and a double free is only noticed
+// once the magazine is flushed.
+void slab_free(slab_cache_t *cache, long object) {
+    if (cache->allocator->concurrency == SINGLE_THREADED) {
+        _free_objects(cache, &object, 1);
+        return;
+    }
+    if (_find_slab(cache, object) == NULL) {
+        alloc_log("Sorry, object %ld is not allocated from %s \n", object, cache->name);
+        return;
+    }
+
+    slab_magazine_t *magazine = _get_magazine(cache);
+    pthread_mutex_lock(&magazine->lock);
+    magazine->objects[magazine->count++] = object;
+    if (magazine->count == SLAB_MAGAZINE_SIZE) {
+        magazine->count -= SLAB_MAGAZINE_BATCH;
+        _free_objects(cache, magazine->objects + magazine->count, SLAB_MAGAZINE_BATCH);
+    }
+    pthread_mutex_unlock(&magazine->lock);
+}
+
+// slab_address returns where object is in the allocator's backing memory,
+// NULL without any, see enable_swap.
+void *slab_address(slab_cache_t *cache, long object) {
+    if (cache->allocator->memory == NULL)
+        return NULL;
+    return cache->allocator->memory + object;
+}
+
+// shrink_slab_cache flushes every thread's magazine and gives every empty
+// slab of cache back to the free lists. Returns the pages given back.
+int shrink_slab_cache(slab_cache_t *cache) {
+    if (cache->allocator->concurrency != SINGLE_THREADED) {
+        pthread_mutex_lock(&cache->magazine_list_lock);
+        for (slab_magazine_t *magazine = cache->magazines; magazine != NULL; magazine = magazine->next) {
+            pthread_mutex_lock(&magazine->lock);
+            _free_objects(cache, magazine->objects, magazine->count);
+            magazine->count = 0;
+            pthread_mutex_unlock(&magazine->lock);
+        }
+        pthread_mutex_unlock(&cache->magazine_list_lock);
+    }
+
+    _lock_cache(cache);
+    slab_t *released = cache->empty.head;
+    int nr_released = cache->empty.size;
+    for (slab_t *slab = released; slab != NULL; slab = slab->next)
+        cache->slabs[slab->block->first_page_address >> cache->order] = NULL;
+    cache->nr_slabs -= nr_released;
+    cache->empty.head = NULL;
+    cache->empty.size = 0;
+    _unlock_cache(cache);
+
+    while (released != NULL) {
+        slab_t *next = released->next;
+        _release_slab(cache, released);
+        released = next;
+    }
+    return nr_released << cache->order;
+}
+
+// destroy_slab_cache frees cache and gives its slabs back. Returns -1,
+// leaving the cache as it is, if some of its objects are still allocated.
+int destroy_slab_cache(slab_cache_t *cache) {
+    shrink_slab_cache(cache);
+    if (cache->nr_slabs != 0)
+        return -1;
+
+    buddy_allocator_t *allocator = cache->allocator;
+    _lock_slab_caches(allocator);
+    slab_cache_t **link = &allocator->slab_caches;
+    while (*link != cache)
+        link = &(*link)->next;
+    *link = cache->next;
+    _unlock_slab_caches(allocator);
+
+    while (cache->magazines != NULL) {
+        slab_magazine_t *next = cache->magazines->next;
+        pthread_mutex_destroy(&cache->magazines->lock);
+        free(cache->magazines);
+        cache->magazines = next;
+    }
+    pthread_mutex_destroy(&cache->lock);
+    pthread_mutex_destroy(&cache->magazine_list_lock);
+    free(cache->slabs);
+    free(cache);
+    return 0;
+}
+
+// slab_pages returns the pages held by the slabs of every cache.
+long slab_pages(buddy_allocator_t *allocator) {
+    long pages = 0;
+    _lock_slab_caches(allocator);
+    for (slab_cache_t *cache = allocator->slab_caches; cache != NULL; cache = cache->next) {
+        _lock_cache(cache);
+        pages += (long)cache->nr_slabs << cache->order;
+        _unlock_cache(cache);
+    }
+    _unlock_slab_caches(allocator);
+    return pages;
+}
@@ -0,0 +1,259 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include "allocator.h"
+#include "util.h"
+
+// Partial eviction keeps large blocks that are only partly used from pinning
+// or thrashing whole high-order blocks, like Linux splitting a partly used
+// huge page under memory pressure. access_page sets PG_REFERENCED on the
+// page accessed. Before the replacement policy is asked, reclaim runs an
+// idle hand over physical memory, IDLE_SCAN_BATCH tracked blocks at a time,
+// clearing the bits as it passes. A block whose pages were not all accessed
+// since the hand last passed is split into single pages and the idle ones
+// are evicted. The pages left of a split block are evicted one by one as
+// they go idle too, until one remains. Blocks with no page accessed at all
+// are the replacement policy's, which still sees a split block as one unit
+// and evicts whatever it has left at once. A fault on a split block brings
+// back only the page accessed.
+
+// set_partial_eviction turns partial eviction on or off for an allocator
+// that holds no blocks yet. Returns -1 if it does, or for a lock-free
+// allocator, whose blocks can't be split in place.
+int set_partial_eviction(buddy_allocator_t *allocator, int enabled) {
+    if (seq_map_count(allocator->seq_map) != 0 || allocator->concurrency == CONCURRENT_LOCK_FREE)
+        return -1;
+    allocator->partial_eviction = enabled;
+    allocator->idle_hand = 0;
+    return 0;
+}
+
+sparse_block_t *_new_sparse_block(int order) {
+    sparse_block_t *sparse = (sparse_block_t*)malloc(sizeof(sparse_block_t));
+    sparse->order = order;
+    sparse->nr_resident = 0;
+    sparse->pages = (block_descriptor_t**)calloc(1 << order, sizeof(block_descriptor_t*));
+    sparse->swap = (swap_extent_t**)calloc(1 << order, sizeof(swap_extent_t*));
+    sparse->zswap = (zswap_entry_t**)calloc(1 << order, sizeof(zswap_entry_t*));
+    return sparse;
+}
+
+// _evict_page evicts page of entry's sparse block. If entry or its policy
+// node pointed at it, they move on to another page still in memory.
+static void _evict_page(buddy_allocator_t *allocator, seq_entry_t *entry, int page) {
+    sparse_block_t *sparse = entry->sparse;
+    block_descriptor_t *block = sparse->pages[page];
+    if (allocator->swap != NULL)
+        _save_evicted(allocator, entry, page, block_address(allocator, block), 1);
+    sparse->pages[page] = NULL;
+    sparse->nr_resident--;
+
+    if (entry->allocated_block == block) {
+        block_descriptor_t *resident = NULL;
+        for (int i = 0; i < 1 << sparse->order && resident == NULL; i++)
+            resident = sparse->pages[i];
+        entry->allocated_block = resident;
+        if (entry->lru_node != NULL && entry->lru_node->block == block)
+            entry->lru_node->block = resident;
+    }
+    block->seq_no = -1;
+    _put_block(allocator, block);
+}
+
+// _split_block turns entry's block into single pages and evicts those not
+// marked in keep. Returns the pages evicted.
+static int _split_block(buddy_allocator_t *allocator, seq_entry_t *entry, const char *keep) {
+    block_descriptor_t *block = entry->allocated_block;
+    int start = block->first_page_address;
+    sparse_block_t *sparse = _new_sparse_block(block->order);
+    entry->sparse = sparse;
+
+    for (int i = 0; i < 1 << sparse->order; i++) {
+        block_descriptor_t *page = init_block_descriptor(&allocator->pages[start + i], 0, start + i);
+        page->seq_no = entry->seq_no;
+        sparse->pages[i] = page;
+    }
+    sparse->nr_resident = 1 << sparse->order;
+
+    int evicted = 0;
+    for (int i = 0; i < 1 << sparse->order; i++) {
+        if (!keep[i]) {
+            _evict_page(allocator, entry, i);
+            evicted++;
+        }
+    }
+    count_event(allocator, sparse_splits);
+    count_events(allocator, sparse_evictions, evicted);
+    return evicted;
+}
+
+// _age_block ages a whole block, splitting it if some of its pages went
+// idle over a full pass of the hand. Returns the pages evicted.
+static int _age_block(buddy_allocator_t *allocator, seq_entry_t *entry) {
+    block_descriptor_t *block = entry->allocated_block;
+    block_descriptor_t *pages = &allocator->pages[block->first_page_address];
+    int nr_pages = 1 << block->order;
+    char *keep = (char*)malloc(nr_pages);
+    int referenced = 0;
+    for (int i = 0; i < nr_pages; i++) {
+        keep[i] = (pages[i].flags & PG_REFERENCED) != 0;
+        referenced += keep[i];
+        pages[i].flags &= ~PG_REFERENCED;
+    }
+
+    // a block the hand sees for the first time may not have been used yet
+    int scanned = block->flags & PG_SCANNED;
+    block->flags |= PG_SCANNED;
+    int evicted = 0;
+    if (scanned && referenced != 0 && referenced != nr_pages)
+        evicted = _split_block(allocator, entry, keep);
+    free(keep);
+    return evicted;
+}
+
+// _age_page ages one page of a split block, evicting it if it went idle and
+// is not the last one. Returns the pages evicted.
+static int _age_page(buddy_allocator_t *allocator, seq_entry_t *entry, block_descriptor_t *block) {
+    if (block->flags & PG_REFERENCED) {
+        block->flags &= ~PG_REFERENCED;
+        return 0;
+    }
+    if (entry->sparse->nr_resident == 1)
+        return 0;
+
+    int page = 0;
+    while (entry->sparse->pages[page] != block)
+        page++;
+    _evict_page(allocator, entry, page);
+    count_event(allocator, sparse_evictions);
+    return 1;
+}
+
+// _next_blocks moves the idle hand over up to IDLE_SCAN_BATCH blocks that
+// are tracked whole with more than one page, or are pages of a split block,
+// and stores them in batch. Blocks are walked from the start of the hand's
+// max order region, only the descriptor of a block's first page is up to
+// date. Returns how many were found.
+static int _next_blocks(buddy_allocator_t *allocator, block_descriptor_t **batch) {
+    if (allocator->concurrency == CONCURRENT_PCP)
+        pthread_mutex_lock(&allocator->lock);
+
+    int nr_blocks = 0;
+    int address = allocator->idle_hand & ~((1 << allocator->max_order) - 1);
+    while (address < allocator->total_pages && nr_blocks < IDLE_SCAN_BATCH) {
+        block_descriptor_t *block = &allocator->pages[address];
+        address += 1 << block->order;
+        if (address <= allocator->idle_hand || block->seq_no < 0)
+            continue;
+
+        seq_entry_t *entry = seq_map_find(allocator->seq_map, block->seq_no);
+        if (entry == NULL)
+            continue;
+        if ((entry->sparse == NULL && entry->allocated_block == block && block->order > 0) ||
+            (entry->sparse != NULL && block->order == 0))
+            batch[nr_blocks++] = block;
+    }
+    allocator->idle_hand = address < allocator->total_pages ? address : 0;
+
+    if (allocator->concurrency == CONCURRENT_PCP)
+        pthread_mutex_unlock(&allocator->lock);
+    return nr_blocks;
+}
+
+// reclaim_idle_pages runs the idle hand over the next batch of blocks.
+// Called with lru_lock held. Returns 0 if it evicted some pages, -1 if none
+// or partial eviction is off.
+int reclaim_idle_pages(buddy_allocator_t *allocator) {
+    if (!allocator->partial_eviction)
+        return -1;
+
+    block_descriptor_t *batch[IDLE_SCAN_BATCH];
+    int nr_blocks = _next_blocks(allocator, batch);
+    int evicted = 0;
+    // the blocks found stay as they are while lru_lock is held, except
+    // pages of a split block evicted before them, which are found again
+    for (int i = 0; i < nr_blocks; i++) {
+        if (batch[i]->seq_no < 0)
+            continue;
+        seq_entry_t *entry = seq_map_find(allocator->seq_map, batch[i]->seq_no);
+        // blocks borrowing the reserved region must stay movable as a whole
+        if (entry->sparse == NULL && batch[i]->order < allocator->cma_min_order &&
+            in_cma_region(allocator, batch[i]->first_page_address))
+            continue;
+        evicted += entry->sparse != NULL ? _age_page(allocator, entry, batch[i]) : _age_block(allocator, entry);
+    }
+    return evicted > 0 ? 0 : -1;
+}
+
+// _access_sparse records an access to page of a split block, faulting just
+// that page back in if it was evicted. Called with lru_lock held.
+void _access_sparse(buddy_allocator_t *allocator, seq_entry_t *entry, int page) {
+    long long seq_no = entry->seq_no;
+    block_descriptor_t *block = entry->sparse->pages[page];
+    if (block != NULL) {
+        block->flags |= PG_REFERENCED;
+        allocator->policy_ops->access(allocator->policy, entry);
+        return;
+    }
+
+    count_event(allocator, page_faults);
+    count_event(allocator, sparse_faults);
+    block = _fault_block(allocator, 0);
+    if (block == NULL)
+        return;
+
+    // reclaim may have evicted the rest of the block meanwhile
+    entry = seq_map_find(allocator->seq_map, seq_no);
+    block->seq_no = seq_no;
+    block->flags = PG_REFERENCED;
+    entry->sparse->pages[page] = block;
+    entry->sparse->nr_resident++;
+    if (allocator->swap != NULL)
+        _load_evicted(allocator, entry, page, block_address(allocator, block));
+    if (entry->allocated_block != NULL) {
+        allocator->policy_ops->access(allocator->policy, entry);
+        return;
+    }
+
+    entry->allocated_block = block;
+    block_descriptor_t *evicted_block = entry->evicted_block;
+    entry->evicted_block = NULL;
+    // a ghost node of the policy may still point at the evicted record
+    block_descriptor_t *victim = allocator->policy_ops->admit(allocator->policy, entry, 1);
+    pool_free(allocator->evicted_block_pool, evicted_block);
+    if (victim != NULL)
+        _evict_block(allocator, victim);
+}
+
+// _evict_sparse evicts every page a split block has left, for _evict_block
+void _evict_sparse(buddy_allocator_t *allocator, seq_entry_t *entry) {
+    for (int i = 0; i < 1 << entry->sparse->order; i++)
+        if (entry->sparse->pages[i] != NULL)
+            _evict_page(allocator, entry, i);
+}
+
+// _free_sparse releases the pages of a split block and whatever holds the
+// contents of those evicted, its seq_no is being freed. Called with
+// lru_lock held.
+void _free_sparse(buddy_allocator_t *allocator, seq_entry_t *entry) {
+    sparse_block_t *sparse = entry->sparse;
+    for (int i = 0; i < 1 << sparse->order; i++) {
+        if (sparse->pages[i] != NULL) {
+            sparse->pages[i]->seq_no = -1;
+            _put_block(allocator, sparse->pages[i]);
+        } else {
+            _drop_evicted(allocator, entry, i);
+        }
+    }
+    entry->allocated_block = NULL;
+    entry->sparse = NULL;
+    _destroy_sparse_block(sparse);
+}
+
+// _destroy_sparse_block frees a split block's page tables, not the pages
+// or contents they point to
+void _destroy_sparse_block(sparse_block_t *sparse) {
+    free(sparse->pages);
+    free(sparse->swap);
+    free(sparse->zswap);
+    free(sparse);
+}
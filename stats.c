@@ -0,0 +1,192 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "allocator.h"
+
+// free_blocks returns the number of free blocks of order. Blocks held in
+// per-thread caches are not counted, they are not available for merging.
+int free_blocks(buddy_allocator_t *allocator, int order) {
+    if (allocator->concurrency == CONCURRENT_LOCK_FREE)
+        return lf_free_blocks(allocator, order);
+    // the reserved region's free blocks count, they are there for the taking
+    if (allocator->cma_free_list != NULL && order <= allocator->cma_order)
+        return allocator->free_list[order]->size + allocator->cma_free_list[order]->size;
+    return allocator->free_list[order]->size;
+}
+
+// get_allocator_stats copies the event counters and the current free block
+// counts into stats, whose per-order arrays are then released with
+// free_allocator_stats.
+void get_allocator_stats(buddy_allocator_t *allocator, allocator_stats_t *stats) {
+    // buffered hits are only counted as promotions once applied
+    _lock_lru(allocator);
+    _drain_policy(allocator);
+    _unlock_lru(allocator);
+
+    if (allocator->concurrency == CONCURRENT_PCP)
+        pthread_mutex_lock(&allocator->lock);
+
+    memcpy(stats, &allocator->stats, sizeof(allocator_stats_t));
+    stats->splits = (unsigned long long*)malloc((allocator->max_order + 1) * sizeof(unsigned long long));
+    stats->merges = (unsigned long long*)malloc((allocator->max_order + 1) * sizeof(unsigned long long));
+    memcpy(stats->splits, allocator->stats.splits, (allocator->max_order + 1) * sizeof(unsigned long long));
+    memcpy(stats->merges, allocator->stats.merges, (allocator->max_order + 1) * sizeof(unsigned long long));
+    if (allocator->swap != NULL) {
+        stats->swap_write_batches = __atomic_load_n(&allocator->swap->write_batches, __ATOMIC_RELAXED);
+        stats->swap_cancelled_writes = __atomic_load_n(&allocator->swap->cancelled_writes, __ATOMIC_RELAXED);
+    }
+    if (allocator->zswap != NULL) {
+        stats->zswap_pool_bytes = __atomic_load_n(&allocator->zswap->bytes, __ATOMIC_RELAXED);
+        stats->zswap_stored_pages = __atomic_load_n(&allocator->zswap->nr_pages, __ATOMIC_RELAXED);
+    }
+    stats->free_blocks = (int*)malloc((allocator->max_order + 1) * sizeof(int));
+    for (int i = 0; i <= allocator->max_order; i++)
+        stats->free_blocks[i] = free_blocks(allocator, i);
+
+    if (allocator->concurrency == CONCURRENT_PCP)
+        pthread_mutex_unlock(&allocator->lock);
+}
+
+void free_allocator_stats(allocator_stats_t *stats) {
+    free(stats->splits);
+    free(stats->merges);
+    free(stats->free_blocks);
+}
+
+// _fragmentation_index computes fragmentation_index from the free block
+// counts per order.
+int _fragmentation_index(const int *free_blocks, int max_order, int order) {
+    long long requested = 1LL << order;
+    long long free_pages = 0;
+    long long free_blocks_total = 0;
+    long long free_blocks_suitable = 0;
+
+    for (int i = 0; i <= max_order; i++) {
+        free_blocks_total += free_blocks[i];
+        free_pages += (long long)free_blocks[i] << i;
+        if (i >= order)
+            free_blocks_suitable += free_blocks[i];
+    }
+
+    if (free_blocks_total == 0)
+        return 0;
+    // the index only means something for a request that would fail
+    if (free_blocks_suitable != 0)
+        return -1000;
+    return 1000 - (1000 + free_pages * 1000 / requested) / free_blocks_total;
+}
+
+// fragmentation_index is Linux's extfrag_index for order, scaled by 1000.
+// Towards 0 a failing allocation of this order is due to lack of memory,
+// towards 1000 it is due to fragmentation. -1000 means it would succeed.
+int fragmentation_index(buddy_allocator_t *allocator, int order) {
+    allocator_stats_t stats;
+    get_allocator_stats(allocator, &stats);
+    int index = _fragmentation_index(stats.free_blocks, allocator->max_order, order);
+    free_allocator_stats(&stats);
+    return index;
+}
+
+// dump_buddyinfo prints the free block counts per order in the layout of
+// /proc/buddyinfo.
+void dump_buddyinfo(buddy_allocator_t *allocator, FILE *out) {
+    allocator_stats_t stats;
+    get_allocator_stats(allocator, &stats);
+
+    fprintf(out, "Node 0, zone   Normal ");
+    for (int i = 0; i <= allocator->max_order; i++)
+        fprintf(out, "%7d", stats.free_blocks[i]);
+    fprintf(out, "\n");
+    free_allocator_stats(&stats);
+}
+
+// dump_slabinfo prints every slab cache in the layout of /proc/slabinfo. The
+// tunables are the magazine size and batch, used in the concurrent modes.
+void dump_slabinfo(buddy_allocator_t *allocator, FILE *out) {
+    fprintf(out, "slabinfo - version: 2.1\n");
+    fprintf(out, "# name            <active_objs> <num_objs> <objsize> <objperslab> <pagesperslab>"
+                 " : tunables <limit> <batchcount> <sharedfactor> : slabdata <active_slabs> <num_slabs> <sharedavail>\n");
+    if (allocator->concurrency != SINGLE_THREADED)
+        pthread_mutex_lock(&allocator->slab_lock);
+    for (slab_cache_t *cache = allocator->slab_caches; cache != NULL; cache = cache->next) {
+        if (allocator->concurrency != SINGLE_THREADED)
+            pthread_mutex_lock(&cache->lock);
+        fprintf(out, "%-17s %6ld %6ld %6d %4d %4d : tunables %4d %4d %4d : slabdata %6d %6d %6d\n",
+                cache->name, cache->nr_active, (long)cache->nr_slabs * cache->objects_per_slab,
+                cache->object_size, cache->objects_per_slab, 1 << cache->order,
+                SLAB_MAGAZINE_SIZE, SLAB_MAGAZINE_BATCH, 0,
+                cache->nr_slabs - cache->empty.size, cache->nr_slabs, 0);
+        if (allocator->concurrency != SINGLE_THREADED)
+            pthread_mutex_unlock(&cache->lock);
+    }
+    if (allocator->concurrency != SINGLE_THREADED)
+        pthread_mutex_unlock(&allocator->slab_lock);
+}
+
+// dump_allocator_stats prints every counter as "name value" lines, per-order
+// counters and fragmentation indexes one value per order.
+void dump_allocator_stats(buddy_allocator_t *allocator, FILE *out) {
+    allocator_stats_t stats;
+    get_allocator_stats(allocator, &stats);
+
+    fprintf(out, "split");
+    for (int i = 0; i <= allocator->max_order; i++)
+        fprintf(out, " %llu", stats.splits[i]);
+    fprintf(out, "\nmerge");
+    for (int i = 0; i <= allocator->max_order; i++)
+        fprintf(out, " %llu", stats.merges[i]);
+    fprintf(out, "\nextfrag_index");
+    for (int i = 0; i <= allocator->max_order; i++) {
+        int index = _fragmentation_index(stats.free_blocks, allocator->max_order, i);
+        fprintf(out, " %s%d.%03d", index < 0 ? "-" : "", (index < 0 ? -index : index) / 1000,
+                (index < 0 ? -index : index) % 1000);
+    }
+    fprintf(out, "\nreclaim %llu\n", stats.reclaims);
+    fprintf(out, "access %llu\n", stats.accesses);
+    fprintf(out, "page_fault %llu\n", stats.page_faults);
+    fprintf(out, "failed_allocation %llu\n", stats.failed_allocations);
+    fprintf(out, "promotion %llu\n", stats.promotions);
+    fprintf(out, "demotion %llu\n", stats.demotions);
+    fprintf(out, "workingset_activate %llu\n", stats.workingset_activations);
+    fprintf(out, "kswapd_wakeup %llu\n", stats.kswapd_wakeups);
+    fprintf(out, "kswapd_reclaim %llu\n", stats.kswapd_reclaims);
+    fprintf(out, "direct_reclaim %llu\n", stats.direct_reclaims);
+    fprintf(out, "deferred_free %llu\n", stats.deferred_frees);
+    fprintf(out, "deferred_reuse %llu\n", stats.deferred_reuses);
+    fprintf(out, "deferred_coalesce %llu\n", stats.deferred_coalesces);
+    fprintf(out, "compact_stall %llu\n", stats.compact_stalls);
+    fprintf(out, "compact_success %llu\n", stats.compact_successes);
+    fprintf(out, "compact_fail %llu\n", stats.compact_failures);
+    fprintf(out, "compact_migrate %llu\n", stats.compact_migrations);
+    fprintf(out, "swap_out %llu\n", stats.swap_outs);
+    fprintf(out, "swap_in %llu\n", stats.swap_ins);
+    fprintf(out, "swap_cache_hit %llu\n", stats.swap_cache_hits);
+    fprintf(out, "swap_write_batch %llu\n", stats.swap_write_batches);
+    fprintf(out, "swap_cancelled_write %llu\n", stats.swap_cancelled_writes);
+    fprintf(out, "zswap_store %llu\n", stats.zswap_stores);
+    fprintf(out, "zswap_reject %llu\n", stats.zswap_rejects);
+    fprintf(out, "zswap_hit %llu\n", stats.zswap_hits);
+    fprintf(out, "zswap_miss %llu\n", stats.zswap_misses);
+    fprintf(out, "zswap_writeback %llu\n", stats.zswap_writebacks);
+    fprintf(out, "zswap_pool_bytes %llu\n", stats.zswap_pool_bytes);
+    fprintf(out, "zswap_stored_pages %llu\n", stats.zswap_stored_pages);
+    // uncompressed over compressed size of what the pool holds
+    fprintf(out, "zswap_compress_ratio %.2f\n",
+            stats.zswap_pool_bytes > 0 ? (double)stats.zswap_stored_pages * PAGE_SIZE / stats.zswap_pool_bytes : 0.0);
+    fprintf(out, "sparse_split %llu\n", stats.sparse_splits);
+    fprintf(out, "sparse_evict %llu\n", stats.sparse_evictions);
+    fprintf(out, "sparse_fault %llu\n", stats.sparse_faults);
+    fprintf(out, "readahead %llu\n", stats.readahead_blocks);
+    fprintf(out, "readahead_hit %llu\n", stats.readahead_hits);
+    fprintf(out, "readahead_wasted %llu\n", stats.readahead_wasted);
+    // share of the blocks read ahead that were accessed in time
+    fprintf(out, "readahead_accuracy %.2f\n",
+            stats.readahead_blocks > 0 ? (double)stats.readahead_hits / stats.readahead_blocks : 0.0);
+    fprintf(out, "cma_alloc %llu\n", stats.cma_allocations);
+    fprintf(out, "cma_borrow %llu\n", stats.cma_borrows);
+    fprintf(out, "cma_evacuate %llu\n", stats.cma_evacuations);
+    fprintf(out, "cma_migrate %llu\n", stats.cma_migrations);
+    fprintf(out, "cma_evict %llu\n", stats.cma_evictions);
+    free_allocator_stats(&stats);
+}
@@ -0,0 +1,290 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "swap.h"
+
+#define BITS_PER_WORD (8 * sizeof(unsigned long))
+
+static int _slot_used(swap_device_t *swap, long slot) {
+    return (swap->slot_map[slot / BITS_PER_WORD] >> (slot % BITS_PER_WORD)) & 1;
+}
+
+static void _set_slots(swap_device_t *swap, long slot, int nr_slots, int used) {
+    for (long i = slot; i < slot + nr_slots; i++) {
+        if (used)
+            swap->slot_map[i / BITS_PER_WORD] |= 1UL << (i % BITS_PER_WORD);
+        else
+            swap->slot_map[i / BITS_PER_WORD] &= ~(1UL << (i % BITS_PER_WORD));
+    }
+}
+
+// _find_slots returns the first run of nr_slots free slots in [from, to), or -1
+static long _find_slots(swap_device_t *swap, long from, long to, int nr_slots) {
+    long run = 0;
+    for (long slot = from; slot < to; slot++) {
+        run = _slot_used(swap, slot) ? 0 : run + 1;
+        if (run == nr_slots)
+            return slot - nr_slots + 1;
+    }
+    return -1;
+}
+
+// _grow doubles the swap file, or more if nr_slots wouldn't fit at its end
+static int _grow(swap_device_t *swap, int nr_slots) {
+    long new_nr_slots = swap->nr_slots * 2;
+    while (new_nr_slots < swap->nr_slots + nr_slots)
+        new_nr_slots *= 2;
+    if (ftruncate(swap->fd, (off_t)(new_nr_slots * swap->page_size)) != 0)
+        return -1;
+
+    size_t old_words = (swap->nr_slots + BITS_PER_WORD - 1) / BITS_PER_WORD;
+    size_t new_words = (new_nr_slots + BITS_PER_WORD - 1) / BITS_PER_WORD;
+    swap->slot_map = (unsigned long*)realloc(swap->slot_map, new_words * sizeof(unsigned long));
+    memset(swap->slot_map + old_words, 0, (new_words - old_words) * sizeof(unsigned long));
+    swap->nr_slots = new_nr_slots;
+    return 0;
+}
+
+// _alloc_slots takes nr_slots consecutive slots, next-fit from the cursor
+static long _alloc_slots(swap_device_t *swap, int nr_slots) {
+    long slot = _find_slots(swap, swap->cursor, swap->nr_slots, nr_slots);
+    if (slot < 0)
+        slot = _find_slots(swap, 0, swap->cursor + nr_slots - 1 < swap->nr_slots ? swap->cursor + nr_slots - 1
+                                                                                 : swap->nr_slots, nr_slots);
+    if (slot < 0) {
+        long old_nr_slots = swap->nr_slots;
+        if (_grow(swap, nr_slots) != 0)
+            return -1;
+        // a free run may end the old file
+        slot = old_nr_slots;
+        while (slot > 0 && !_slot_used(swap, slot - 1))
+            slot--;
+    }
+    _set_slots(swap, slot, nr_slots, 1);
+    swap->cursor = slot + nr_slots;
+    return slot;
+}
+
+static void _free_extent(swap_device_t *swap, swap_extent_t *extent) {
+    _set_slots(swap, extent->slot, extent->nr_pages, 0);
+    free(extent->buffer);
+    free(extent);
+}
+
+static int _compare_slots(const void *a, const void *b) {
+    long slot_a = (*(swap_extent_t* const*)a)->slot, slot_b = (*(swap_extent_t* const*)b)->slot;
+    return (slot_a > slot_b) - (slot_a < slot_b);
+}
+
+// _write_batch writes the extents, sorted by slot, with one pwritev per run
+// of adjacent extents, and sets failed[i] for every extent of a run whose
+// write fell short
+static void _write_batch(swap_device_t *swap, swap_extent_t **batch, int nr_extents, int *failed) {
+    struct iovec iov[SWAP_BATCH];
+    qsort(batch, nr_extents, sizeof(swap_extent_t*), _compare_slots);
+
+    for (int first = 0; first < nr_extents; ) {
+        int last = first;
+        while (last + 1 < nr_extents && batch[last + 1]->slot == batch[last]->slot + batch[last]->nr_pages)
+            last++;
+
+        size_t bytes = 0;
+        for (int i = first; i <= last; i++) {
+            iov[i - first].iov_base = batch[i]->buffer;
+            iov[i - first].iov_len = batch[i]->nr_pages * swap->page_size;
+            bytes += iov[i - first].iov_len;
+        }
+        off_t offset = (off_t)(batch[first]->slot * swap->page_size);
+        int short_write = pwritev(swap->fd, iov, last - first + 1, offset) != (ssize_t)bytes;
+        if (short_write)
+            perror("swap write");
+        for (int i = first; i <= last; i++)
+            failed[i] = short_write;
+        __atomic_fetch_add(&swap->write_batches, 1, __ATOMIC_RELAXED);
+        first = last + 1;
+    }
+}
+
+static void *_writeback(void *arg) {
+    swap_device_t *swap = (swap_device_t*)arg;
+    swap_extent_t *batch[SWAP_BATCH];
+    int failed[SWAP_BATCH];
+
+    pthread_mutex_lock(&swap->lock);
+    for (;;) {
+        while (swap->queue_head == NULL && !swap->stop)
+            pthread_cond_wait(&swap->queue_wait, &swap->lock);
+        if (swap->queue_head == NULL)
+            break;
+
+        int nr_extents = 0;
+        while (swap->queue_head != NULL && nr_extents < SWAP_BATCH) {
+            swap_extent_t *extent = swap->queue_head;
+            swap->queue_head = extent->next;
+            swap->nr_queued--;
+            // swapped back in or freed while queued, nothing to write
+            if (extent->released) {
+                __atomic_fetch_add(&swap->cancelled_writes, 1, __ATOMIC_RELAXED);
+                _free_extent(swap, extent);
+                continue;
+            }
+            extent->state = SWAP_WRITING;
+            batch[nr_extents++] = extent;
+        }
+        if (swap->queue_head == NULL)
+            swap->queue_tail = NULL;
+        swap->nr_writing += nr_extents;
+        pthread_cond_broadcast(&swap->throttle_wait);
+        pthread_mutex_unlock(&swap->lock);
+
+        _write_batch(swap, batch, nr_extents, failed);
+
+        pthread_mutex_lock(&swap->lock);
+        for (int i = 0; i < nr_extents; i++) {
+            swap_extent_t *extent = batch[i];
+            // what could not be written is swapped in from the buffer instead
+            if (failed[i]) {
+                extent->state = SWAP_FAILED;
+            } else {
+                extent->state = SWAP_WRITTEN;
+                free(extent->buffer);
+                extent->buffer = NULL;
+            }
+            if (extent->released)
+                _free_extent(swap, extent);
+        }
+        swap->nr_writing -= nr_extents;
+        pthread_cond_broadcast(&swap->throttle_wait);
+    }
+    pthread_mutex_unlock(&swap->lock);
+    return NULL;
+}
+
+// open_swap_device creates the swap file at path with room for nr_slots
+// pages of page_size bytes, written back by nr_threads threads.
+// Returns NULL if the file can't be created.
+swap_device_t *open_swap_device(const char *path, size_t page_size, long nr_slots, int nr_threads) {
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+        return NULL;
+    if (nr_slots < 1)
+        nr_slots = 1;
+    if (ftruncate(fd, (off_t)(nr_slots * page_size)) != 0) {
+        close(fd);
+        return NULL;
+    }
+
+    swap_device_t *swap = (swap_device_t*)calloc(1, sizeof(swap_device_t));
+    swap->fd = fd;
+    swap->page_size = page_size;
+    swap->nr_slots = nr_slots;
+    swap->slot_map = (unsigned long*)calloc((nr_slots + BITS_PER_WORD - 1) / BITS_PER_WORD, sizeof(unsigned long));
+    pthread_mutex_init(&swap->lock, NULL);
+    pthread_cond_init(&swap->queue_wait, NULL);
+    pthread_cond_init(&swap->throttle_wait, NULL);
+
+    swap->nr_threads = nr_threads > 0 ? nr_threads : 1;
+    swap->threads = (pthread_t*)malloc(swap->nr_threads * sizeof(pthread_t));
+    for (int i = 0; i < swap->nr_threads; i++)
+        pthread_create(&swap->threads[i], NULL, _writeback, swap);
+    return swap;
+}
+
+// close_swap_device writes back whatever is queued, then stops the
+// writeback threads and closes the file. Every extent must have been
+// released before: written ones are freed by swap_release, queued ones as
+// the writeback threads skip them. One still held would be left behind.
+void close_swap_device(swap_device_t *swap) {
+    pthread_mutex_lock(&swap->lock);
+    swap->stop = 1;
+    pthread_cond_broadcast(&swap->queue_wait);
+    pthread_mutex_unlock(&swap->lock);
+    for (int i = 0; i < swap->nr_threads; i++)
+        pthread_join(swap->threads[i], NULL);
+
+    close(swap->fd);
+    free(swap->threads);
+    free(swap->slot_map);
+    free(swap);
+}
+
+// swap_out copies nr_pages pages into a new extent and queues it for
+// writeback. The caller may reuse the pages as soon as it returns. Waits
+// while SWAP_QUEUE_HIGH extents are queued. Returns NULL if the swap file
+// can't grow.
+swap_extent_t *swap_out(swap_device_t *swap, const void *pages, int nr_pages) {
+    swap_extent_t *extent = (swap_extent_t*)malloc(sizeof(swap_extent_t));
+    extent->nr_pages = nr_pages;
+    extent->state = SWAP_QUEUED;
+    extent->released = 0;
+    extent->next = NULL;
+    extent->buffer = (char*)malloc(nr_pages * swap->page_size);
+    memcpy(extent->buffer, pages, nr_pages * swap->page_size);
+
+    pthread_mutex_lock(&swap->lock);
+    while (swap->nr_queued >= SWAP_QUEUE_HIGH)
+        pthread_cond_wait(&swap->throttle_wait, &swap->lock);
+    extent->slot = _alloc_slots(swap, nr_pages);
+    if (extent->slot < 0) {
+        pthread_mutex_unlock(&swap->lock);
+        free(extent->buffer);
+        free(extent);
+        return NULL;
+    }
+
+    if (swap->queue_tail == NULL)
+        swap->queue_head = extent;
+    else
+        swap->queue_tail->next = extent;
+    swap->queue_tail = extent;
+    swap->nr_queued++;
+    pthread_cond_signal(&swap->queue_wait);
+    pthread_mutex_unlock(&swap->lock);
+    return extent;
+}
+
+// swap_in copies the pages of extent to pages, from its buffer if it has not
+// been written yet or its write failed, else from the file with a synchronous pread in the
+// calling thread, the one taking the page fault. Returns 1 for the former,
+// 0 for the latter and -1 on a read error.
+int swap_in(swap_device_t *swap, swap_extent_t *extent, void *pages) {
+    size_t bytes = extent->nr_pages * swap->page_size;
+
+    pthread_mutex_lock(&swap->lock);
+    if (extent->state != SWAP_WRITTEN) {
+        memcpy(pages, extent->buffer, bytes);
+        pthread_mutex_unlock(&swap->lock);
+        return 1;
+    }
+    pthread_mutex_unlock(&swap->lock);
+
+    // the slots stay ours until swap_release
+    if (pread(swap->fd, pages, bytes, (off_t)(extent->slot * swap->page_size)) != (ssize_t)bytes) {
+        perror("swap read");
+        return -1;
+    }
+    return 0;
+}
+
+// swap_release gives back the slots of an extent that was swapped in or
+// whose block was freed. A write in progress still completes first, a
+// queued one is skipped.
+void swap_release(swap_device_t *swap, swap_extent_t *extent) {
+    pthread_mutex_lock(&swap->lock);
+    extent->released = 1;
+    if (extent->state == SWAP_WRITTEN || extent->state == SWAP_FAILED)
+        _free_extent(swap, extent);
+    pthread_mutex_unlock(&swap->lock);
+}
+
+// swap_flush waits until every queued extent has been written.
+void swap_flush(swap_device_t *swap) {
+    pthread_mutex_lock(&swap->lock);
+    while (swap->nr_queued > 0 || swap->nr_writing > 0)
+        pthread_cond_wait(&swap->throttle_wait, &swap->lock);
+    pthread_mutex_unlock(&swap->lock);
+}
@@ -0,0 +1,66 @@
+#ifndef SWAP_H
+#define SWAP_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+#define SWAP_BATCH 32 // extents written per batch, adjacent ones in a single pwritev
+#define SWAP_QUEUE_HIGH 256 // evicting threads wait while this many extents are queued
+
+typedef enum swap_state {
+    SWAP_QUEUED, // contents only in buffer
+    SWAP_WRITING, // being written from buffer
+    SWAP_WRITTEN, // contents in the file, buffer freed
+    SWAP_FAILED, // the write failed, contents stay only in buffer
+} swap_state_t;
+
+// swap_extent is the copy of one evicted block in the swap device: nr_pages
+// consecutive slots starting at slot. Until it has been written, its pages
+// are also kept in buffer, which is where a swap-in then reads them from,
+// like Linux's swap cache.
+typedef struct swap_extent {
+    long slot;
+    int nr_pages;
+    swap_state_t state;
+    int released; // the owner is done with it, free once no longer written to
+    char *buffer;
+    struct swap_extent *next; // write queue
+} swap_extent_t;
+
+// swap_device is a swap file with its own writeback threads. Slots are handed
+// out next-fit from a cursor, so extents evicted one after another sit next
+// to each other in the file and a batch mostly becomes one sequential write.
+// The file grows when no run of free slots is long enough. Only writes go
+// through the writeback threads: a swap-in reads the file synchronously on
+// the faulting path, unless the extent's buffer still holds its pages.
+typedef struct swap_device {
+    int fd;
+    size_t page_size;
+    long nr_slots;
+    long cursor; // next slot to try
+    unsigned long *slot_map; // one bit per slot, set while used
+
+    pthread_mutex_t lock; // everything here and the extents' state, taken after any allocator lock
+    pthread_cond_t queue_wait; // writeback threads wait for work
+    pthread_cond_t throttle_wait; // swap_out waits for room in the queue
+    swap_extent_t *queue_head;
+    swap_extent_t *queue_tail;
+    int nr_queued;
+    int nr_writing; // extents taken off the queue and not written yet
+    int stop;
+    int nr_threads;
+    pthread_t *threads;
+
+    // event counters, bumped atomically
+    unsigned long long write_batches; // pwritev calls
+    unsigned long long cancelled_writes; // extents released before they were written
+} swap_device_t;
+
+swap_device_t *open_swap_device(const char *path, size_t page_size, long nr_slots, int nr_threads);
+void close_swap_device(swap_device_t *swap);
+swap_extent_t *swap_out(swap_device_t *swap, const void *pages, int nr_pages);
+int swap_in(swap_device_t *swap, swap_extent_t *extent, void *pages);
+void swap_release(swap_device_t *swap, swap_extent_t *extent);
+void swap_flush(swap_device_t *swap);
+
+#endif
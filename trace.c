@@ -0,0 +1,106 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "trace.h"
+
+// parse_trace_line fills record from a tab-separated "<type> <seq_no> <pages>"
+// line without allocating. Returns -1 if the line is not a request.
+int parse_trace_line(const char *line, trace_record_t *record) {
+    char *end;
+
+    if (*line != 'A' && *line != 'X' && *line != 'F')
+        return -1;
+    record->type = *line;
+    memset(record->pad, 0, sizeof(record->pad));
+
+    record->seq_no = strtoll(line + 1, &end, 10);
+    if (end == line + 1)
+        return -1;
+    record->page_size = (int32_t)strtol(end, NULL, 10);
+    return 0;
+}
+
+// convert_trace writes the requests of a tab-separated .dat trace to a binary
+// trace file. Returns the number of records written, or -1 on error.
+int convert_trace(const char *text_path, const char *binary_path) {
+    FILE *in = fopen(text_path, "r");
+    if (in == NULL)
+        return -1;
+    FILE *out = fopen(binary_path, "wb");
+    if (out == NULL) {
+        fclose(in);
+        return -1;
+    }
+
+    // the record count is patched in once all records are written
+    trace_header_t header;
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.nr_records = 0;
+    int failed = fwrite(&header, sizeof(header), 1, out) != 1;
+
+    char *line = NULL;
+    size_t len = 0;
+    trace_record_t record;
+    while (!failed && getline(&line, &len, in) != -1) {
+        if (parse_trace_line(line, &record) != 0)
+            continue;
+        failed = fwrite(&record, sizeof(record), 1, out) != 1;
+        header.nr_records++;
+    }
+    free(line);
+    fclose(in);
+
+    if (!failed)
+        failed = fseek(out, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, out) != 1;
+    // a short write may only show once the buffer is flushed
+    if (fclose(out) != 0 || failed)
+        return -1;
+    return (int)header.nr_records;
+}
+
+// open_trace maps a binary trace file read-only. Returns NULL if the file
+// cannot be mapped or is not a valid trace.
+trace_t *open_trace(const char *binary_path) {
+    int fd = open(binary_path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(trace_header_t)) {
+        close(fd);
+        return NULL;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    const trace_header_t *header = (const trace_header_t*)map;
+    if (memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != TRACE_VERSION ||
+        header->nr_records > ((size_t)st.st_size - sizeof(trace_header_t)) / sizeof(trace_record_t) ||
+        sizeof(trace_header_t) + header->nr_records * sizeof(trace_record_t) != (size_t)st.st_size) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    // records are read once front to back
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    trace_t *trace = (trace_t*)malloc(sizeof(trace_t));
+    trace->map = map;
+    trace->map_size = st.st_size;
+    trace->nr_records = header->nr_records;
+    trace->records = (const trace_record_t*)((const char*)map + sizeof(trace_header_t));
+    return trace;
+}
+
+void close_trace(trace_t *trace) {
+    munmap(trace->map, trace->map_size);
+    free(trace);
+}
@@ -0,0 +1,38 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define TRACE_MAGIC "BTRC"
+#define TRACE_VERSION 1
+
+// Binary trace file: a trace_header followed by nr_records trace_records,
+// both in host byte order.
+typedef struct trace_header {
+    char magic[4];
+    uint32_t version;
+    uint64_t nr_records;
+} trace_header_t;
+
+typedef struct trace_record {
+    int64_t seq_no;
+    int32_t page_size; // pages to allocate for 'A', page offset for 'X'
+    char type; // 'A', 'X' or 'F'
+    char pad[3];
+} trace_record_t;
+
+// trace is a read-only mapping of a binary trace file
+typedef struct trace {
+    void *map;
+    size_t map_size;
+    uint64_t nr_records;
+    const trace_record_t *records;
+} trace_t;
+
+int parse_trace_line(const char *line, trace_record_t *record);
+int convert_trace(const char *text_path, const char *binary_path);
+trace_t *open_trace(const char *binary_path);
+void close_trace(trace_t *trace);
+
+#endif
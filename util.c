@@ -3,6 +3,8 @@
 #include <string.h>
 #include <assert.h>
 
+int log_enabled = 1;
+
 char** str_split(char* a_str, const char a_delim)
 {
     char** result    = 0;
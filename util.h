@@ -1,2 +1,13 @@
+#include <stdio.h>
+
+// alloc_log is the allocator's per-request trace output. It can be switched
+// off at runtime through log_enabled, or compiled out with -DNO_ALLOCATOR_LOG.
+extern int log_enabled;
+#ifdef NO_ALLOCATOR_LOG
+#define alloc_log(...) ((void)0)
+#else
+#define alloc_log(...) do { if (log_enabled) printf(__VA_ARGS__); } while (0)
+#endif
+
 char** str_split(char* a_str, const char a_delim);
 int get_order(int page_size);
\ No newline at end of file
@@ -0,0 +1,296 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "allocator.h"
+#include "util.h"
+
+// The compressor is an LZ77 in the LZ4 block format: sequences of a token
+// (literal length << 4 | match length - 4), the literals, a 2-byte offset
+// back into the output and the match. Lengths of 15 or more continue in
+// extra bytes of 255 ended by a smaller one. The last sequence has literals
+// only.
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 65535
+#define LZ_LAST_LITERALS 5 // the end of the input is always copied as literals
+#define LZ_SKIP_TRIGGER 6 // after 2^6 misses in a row, look at every other position, and so on
+
+static uint32_t _read32(const unsigned char *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+// _emit_length writes the part of a length that did not fit its 4 bits
+static unsigned char *_emit_length(unsigned char *out, unsigned char *end, size_t length) {
+    for (; length >= 255; length -= 255) {
+        if (out >= end)
+            return NULL;
+        *out++ = 255;
+    }
+    if (out >= end)
+        return NULL;
+    *out++ = (unsigned char)length;
+    return out;
+}
+
+// _emit_sequence writes nr_literals literals followed by a match, or by
+// nothing if match_length is 0. Returns NULL if it does not fit.
+static unsigned char *_emit_sequence(unsigned char *out, unsigned char *end, const unsigned char *literals,
+                                     size_t nr_literals, size_t offset, size_t match_length) {
+    if (out >= end)
+        return NULL;
+    unsigned char *token = out++;
+    *token = (unsigned char)((nr_literals < 15 ? nr_literals : 15) << 4);
+    if (nr_literals >= 15 && (out = _emit_length(out, end, nr_literals - 15)) == NULL)
+        return NULL;
+    if ((size_t)(end - out) < nr_literals)
+        return NULL;
+    memcpy(out, literals, nr_literals);
+    out += nr_literals;
+    if (match_length == 0)
+        return out;
+
+    if (end - out < 2)
+        return NULL;
+    *out++ = (unsigned char)(offset & 0xff);
+    *out++ = (unsigned char)(offset >> 8);
+    size_t length = match_length - LZ_MIN_MATCH;
+    *token |= (unsigned char)(length < 15 ? length : 15);
+    if (length >= 15 && (out = _emit_length(out, end, length - 15)) == NULL)
+        return NULL;
+    return out;
+}
+
+// lz_compress compresses size bytes of in into at most capacity bytes of
+// out. Returns the compressed size, 0 if it would not fit.
+static size_t lz_compress(const unsigned char *in, size_t size, unsigned char *out, size_t capacity) {
+    uint32_t table[1 << LZ_HASH_BITS];
+    memset(table, 0xff, sizeof(table));
+    unsigned char *op = out, *end = out + capacity;
+    size_t anchor = 0;
+
+    size_t misses = 0;
+
+    for (size_t ip = 0; ip + LZ_MIN_MATCH + LZ_LAST_LITERALS <= size; ) {
+        uint32_t sequence = _read32(in + ip);
+        uint32_t hash = (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+        uint32_t ref = table[hash];
+        table[hash] = (uint32_t)ip;
+        if (ref == UINT32_MAX || ip - ref > LZ_MAX_OFFSET || _read32(in + ref) != sequence) {
+            // like LZ4, step faster through data that doesn't compress
+            ip += 1 + (misses++ >> LZ_SKIP_TRIGGER);
+            continue;
+        }
+        misses = 0;
+
+        size_t length = LZ_MIN_MATCH, limit = size - LZ_LAST_LITERALS - ip;
+        while (length + 8 <= limit && memcmp(in + ref + length, in + ip + length, 8) == 0)
+            length += 8;
+        while (length < limit && in[ref + length] == in[ip + length])
+            length++;
+        op = _emit_sequence(op, end, in + anchor, ip - anchor, ip - ref, length);
+        if (op == NULL)
+            return 0;
+        ip += length;
+        anchor = ip;
+    }
+
+    op = _emit_sequence(op, end, in + anchor, size - anchor, 0, 0);
+    return op == NULL ? 0 : (size_t)(op - out);
+}
+
+// _read_length adds the extra bytes of a length to length
+static const unsigned char *_read_length(const unsigned char *in, const unsigned char *end, size_t *length) {
+    unsigned char byte;
+    do {
+        if (in >= end)
+            return NULL;
+        byte = *in++;
+        *length += byte;
+    } while (byte == 255);
+    return in;
+}
+
+// lz_decompress expands size compressed bytes of in into exactly
+// out_size bytes of out. Returns -1 on malformed input.
+static int lz_decompress(const unsigned char *in, size_t size, unsigned char *out, size_t out_size) {
+    const unsigned char *ip = in, *end = in + size;
+    size_t op = 0;
+
+    while (ip < end) {
+        unsigned char token = *ip++;
+        size_t nr_literals = token >> 4;
+        if (nr_literals == 15 && (ip = _read_length(ip, end, &nr_literals)) == NULL)
+            return -1;
+        if ((size_t)(end - ip) < nr_literals || out_size - op < nr_literals)
+            return -1;
+        memcpy(out + op, ip, nr_literals);
+        ip += nr_literals;
+        op += nr_literals;
+        if (ip == end)
+            break;
+
+        if (end - ip < 2)
+            return -1;
+        size_t offset = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        size_t length = token & 15;
+        if (length == 15 && (ip = _read_length(ip, end, &length)) == NULL)
+            return -1;
+        length += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || out_size - op < length)
+            return -1;
+        // a match may overlap its own output: copy it in chunks of up to the
+        // distance already written, which doubles each time
+        size_t from = op - offset;
+        while (length > 0) {
+            size_t chunk = op - from < length ? op - from : length;
+            memcpy(out + op, out + from, chunk);
+            op += chunk;
+            length -= chunk;
+        }
+    }
+    return op == out_size ? 0 : -1;
+}
+
+static void _zswap_unlink(zswap_pool_t *pool, zswap_entry_t *zentry) {
+    if (zentry->prev != NULL)
+        zentry->prev->next = zentry->next;
+    else
+        pool->head = zentry->next;
+    if (zentry->next != NULL)
+        zentry->next->prev = zentry->prev;
+    else
+        pool->tail = zentry->prev;
+    __atomic_fetch_sub(&pool->bytes, zentry->length, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&pool->nr_pages, zentry->nr_pages, __ATOMIC_RELAXED);
+}
+
+static void _zswap_free(zswap_entry_t *zentry) {
+    free(zentry->data);
+    free(zentry);
+}
+
+// _zswap_writeback moves the least recently stored block of the pool to the
+// swap device. Returns -1, keeping the block in the pool, if it can't.
+static int _zswap_writeback(buddy_allocator_t *allocator) {
+    zswap_pool_t *pool = allocator->zswap;
+    zswap_entry_t *zentry = pool->tail;
+    size_t bytes = (size_t)zentry->nr_pages * PAGE_SIZE;
+    swap_extent_t *extent = NULL;
+    if (lz_decompress(zentry->data, zentry->length, pool->scratch, bytes) == 0)
+        extent = swap_out(allocator->swap, pool->scratch, zentry->nr_pages);
+    if (extent == NULL) {
+        alloc_log("Sorry, zswap writeback of seq_no %lld failed \n", zentry->seq_no);
+        return -1;
+    }
+
+    seq_entry_t *entry = seq_map_find(allocator->seq_map, zentry->seq_no);
+    if (zentry->page < 0) {
+        entry->zswap = NULL;
+        entry->swap = extent;
+    } else {
+        entry->sparse->zswap[zentry->page] = NULL;
+        entry->sparse->swap[zentry->page] = extent;
+    }
+    _zswap_unlink(pool, zentry);
+    count_events(allocator, swap_outs, zentry->nr_pages);
+    count_event(allocator, zswap_writebacks);
+    _zswap_free(zentry);
+    return 0;
+}
+
+// enable_zswap puts a compressed pool in front of the swap device, like
+// Linux zswap. Evicted blocks are compressed into it, a refault finds them
+// there before going to the swap file, and once the pool would exceed
+// max_pool_percent of the allocator's memory its least recently stored
+// blocks are written back to swap. The pool is allocated on top of the
+// arena. Needs enable_swap first, returns -1 without.
+int enable_zswap(buddy_allocator_t *allocator, int max_pool_percent) {
+    if (allocator->swap == NULL || allocator->zswap != NULL || max_pool_percent <= 0)
+        return -1;
+
+    zswap_pool_t *pool = (zswap_pool_t*)calloc(1, sizeof(zswap_pool_t));
+    pool->max_bytes = (size_t)allocator->total_pages * PAGE_SIZE * max_pool_percent / 100;
+    pool->scratch = (unsigned char*)malloc((size_t)PAGE_SIZE << allocator->max_order);
+    allocator->zswap = pool;
+    return 0;
+}
+
+// close_zswap drops the pool and whatever it holds, called by close_swap
+void close_zswap(buddy_allocator_t *allocator) {
+    zswap_pool_t *pool = allocator->zswap;
+    if (pool == NULL)
+        return;
+    while (pool->head != NULL) {
+        zswap_entry_t *zentry = pool->head;
+        pool->head = zentry->next;
+        _zswap_free(zentry);
+    }
+    free(pool->scratch);
+    free(pool);
+    allocator->zswap = NULL;
+}
+
+// zswap_store compresses the nr_pages pages of seq_no's evicted block, or of
+// page of its sparse block, into the pool. Returns NULL, leaving them to the
+// swap device, if they do not compress to ZSWAP_MAX_PERCENT of their size,
+// could never fit the pool or the pool can't write back enough to make room.
+zswap_entry_t *zswap_store(buddy_allocator_t *allocator, long long seq_no, int page, const void *pages, int nr_pages) {
+    zswap_pool_t *pool = allocator->zswap;
+    size_t bytes = (size_t)nr_pages * PAGE_SIZE;
+    size_t capacity = bytes * ZSWAP_MAX_PERCENT / 100;
+    if (capacity > pool->max_bytes)
+        capacity = pool->max_bytes;
+
+    size_t length = lz_compress((const unsigned char*)pages, bytes, pool->scratch, capacity);
+    if (length == 0) {
+        count_event(allocator, zswap_rejects);
+        return NULL;
+    }
+    zswap_entry_t *zentry = (zswap_entry_t*)malloc(sizeof(zswap_entry_t));
+    zentry->seq_no = seq_no;
+    zentry->page = page;
+    zentry->nr_pages = nr_pages;
+    zentry->length = length;
+    zentry->data = (unsigned char*)malloc(length);
+    memcpy(zentry->data, pool->scratch, length);
+    // writing back reuses scratch
+    while (pool->bytes + length > pool->max_bytes) {
+        if (_zswap_writeback(allocator) != 0) {
+            _zswap_free(zentry);
+            count_event(allocator, zswap_rejects);
+            return NULL;
+        }
+    }
+
+    zentry->prev = NULL;
+    zentry->next = pool->head;
+    if (pool->head != NULL)
+        pool->head->prev = zentry;
+    else
+        pool->tail = zentry;
+    pool->head = zentry;
+    __atomic_fetch_add(&pool->bytes, length, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&pool->nr_pages, nr_pages, __ATOMIC_RELAXED);
+
+    count_event(allocator, zswap_stores);
+    return zentry;
+}
+
+// zswap_load decompresses zentry into pages and drops it from the pool.
+// Returns -1 if the data is corrupt.
+int zswap_load(buddy_allocator_t *allocator, zswap_entry_t *zentry, void *pages) {
+    _zswap_unlink(allocator->zswap, zentry);
+    int result = lz_decompress(zentry->data, zentry->length, (unsigned char*)pages, (size_t)zentry->nr_pages * PAGE_SIZE);
+    _zswap_free(zentry);
+    return result;
+}
+
+// zswap_invalidate drops zentry from the pool, its seq_no is being freed
+void zswap_invalidate(buddy_allocator_t *allocator, zswap_entry_t *zentry) {
+    _zswap_unlink(allocator->zswap, zentry);
+    _zswap_free(zentry);
+}